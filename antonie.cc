@@ -19,6 +19,11 @@
 #include <inttypes.h>
 #include <algorithm>
 #include <numeric>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <tuple>
 
 #include <errno.h>
 #include <math.h>
@@ -37,11 +42,12 @@
 #include "geneannotated.hh"
 #include "misc.hh"
 #include "fastq.hh"
-#include <mba/diff.h>
-#include <mba/msgno.h>
 #include "antonie.hh"
 #include "saminfra.hh"
+#include "countinghash.hh"
+#include "readstats.hh"
 #include "refgenome.hh"
+#include "bandedalign.hh"
 #include "compat.hh"
 
 extern "C" {
@@ -78,20 +84,20 @@ void ReferenceChromosome::printCoverage(FILE* jsfp, const std::string& histoName
   VarMeanEstimator vmeDepth;
   d_unmRegions.clear();
   //  ofstream covfile("coverage");
-  //  int prevcov = d_mapping[0].coverage;
+  //  int prevcov = d_coverage[0];
 
   map<double, VarMeanEstimator> gcCoverage;
 
-  for(string::size_type pos = 0; pos < d_mapping.size(); ++pos) {
-    cov = d_mapping[pos].coverage;
-    string gcsnip=snippet((pos > 20) ? (pos - 20) : 1, pos+20);
-    double gc=getGCContent(gcsnip); // 1 based!
+  for(string::size_type pos = 0; pos < d_coverage.size(); ++pos) {
+    cov = d_coverage[pos];
+    auto gcsnip=view((pos > 20) ? (pos - 20) : 1, pos+20);
+    double gc=gcsnip.gcContent(); // 1 based!
     
-    if(gcsnip.length()==40) {// we get strange results otherwise
+    if(gcsnip.size()==40) {// we get strange results otherwise
       gcCoverage[gc](cov);
     }
     else {
-      // cout <<"Odd gcsnip length: "<<gcsnip.length()<<", pos = "<<pos<<endl;
+      // cout <<"Odd gcsnip length: "<<gcsnip.size()<<", pos = "<<pos<<endl;
       
     }
 
@@ -114,7 +120,7 @@ void ReferenceChromosome::printCoverage(FILE* jsfp, const std::string& histoName
     }
     
     if(!noCov && wasNul) {
-      if(prevNulpos > 40 && pos + 40 < d_genome.length()) {
+      if(prevNulpos > 40 && pos + 40 < d_genome.size()) {
 	Unmatched unm;
 	unm.left = d_genome.substr(prevNulpos-40, 40);
 	unm.right = d_genome.substr(pos, 40);
@@ -149,7 +155,7 @@ void ReferenceChromosome::printCoverage(FILE* jsfp, const std::string& histoName
   (*g_log) << (boost::format("Average depth: %|40t|    %10.2f +- %.2f\n") % mean(vmeDepth) % sqrt(variance(vmeDepth))).str();
 
   double expected=-1; // size()*(1-erf(mean(vmeDepth)/(sqrt(variance(vmeDepth))*sqrt(2))));
-  (*g_log) << (boost::format("Undercovered nucleotides: %|40t| %10d (%.2f%%), %d ranges, %.1f could be expected\n") % noCoverages % (noCoverages*100.0/d_mapping.size()) % cl.d_clusters.size() %expected).str();
+  (*g_log) << (boost::format("Undercovered nucleotides: %|40t| %10d (%.2f%%), %d ranges, %.1f could be expected\n") % noCoverages % (noCoverages*100.0/d_coverage.size()) % cl.d_clusters.size() %expected).str();
   
   uint64_t total = std::accumulate(covhisto.begin(), covhisto.end(), 0), cumul=0;
 
@@ -166,107 +172,58 @@ void ReferenceChromosome::printCoverage(FILE* jsfp, const std::string& histoName
 }
 
 
-//! 0 if nothing interesting, positive if our read has insert at that position, negative if we have a delete at that position
-int MBADiff(dnapos_t pos, const FastQRead& fqr, const string& reference, unsigned int* amount=0)
+/** Tries to explain fqfrag near pos with indels, aligning it to the reference from a band before pos to a band beyond its end.
+    Returns false if that does not give a credible gapped alignment, otherwise aligner has it, *start is where it 
+    begins and *score counts its mismatches over qlimit plus its gaps */
+bool alignIndels(const ReferenceChromosome& rg, dnapos_t pos, const FastQRead& fqfrag, int qlimit, BandedAligner* aligner, dnapos_t* start, unsigned int* score)
 {
-  string::size_type n, m;
-  int d,  sn;
-  struct varray *ses = varray_new(sizeof(struct diff_edit), NULL);
-  
-  n = reference.length();
-  m = fqr.d_nucleotides.length();
-  if ((d = diff(fqr.d_nucleotides.c_str(), 0, m, reference.c_str(), 0, n, NULL, NULL, NULL, 0, ses, &sn, NULL)) == -1) {
-    MMNO(errno);
-    printf("Error\n");
-    return EXIT_FAILURE;
-  }
-  int ret=0;
-
-  if(sn > 3 && sn < 10) {
-    auto *match1 = (struct diff_edit*)varray_get(ses, 0),
-      *change1=(struct diff_edit*)varray_get(ses, 1), 
-      *match2=(struct diff_edit*)varray_get(ses, 2);
-
-    int totMatch = match1->len + match2->len;
-    if(match1->op == DIFF_MATCH && totMatch > 10*change1->len &&  match1->len > 10 && match2->len > 10 &&
-       match2->op == DIFF_MATCH && (d - 2*change1->len) < 4) {
-      if(0 && amount )
-		printf("pos %u, d=%u (%d) sn=%d, rpos=%u, calling '%s' of %d bases\nUS:  %s\nREF: %s\n", pos, d, d - 2*change1->len, 
-	     sn, pos+change1->off, change1->op==DIFF_INSERT ? "Delete" : "Insert", change1->len, fqr.d_nucleotides.c_str(), reference.c_str());
-      
-      if(amount)
-	*amount=change1->len;
-
-      if(change1->op == DIFF_INSERT) 
-	ret=-change1->off;
-      else
-	ret=change1->off;
-#if 0
-      for (int i = 0; i < sn; i++) {
-	struct diff_edit *e = (struct diff_edit*)varray_get(ses, i);
-	
-	switch (e->op) {
-	case DIFF_MATCH:
-	  printf("MAT: ");
-	  fwrite(fqr.d_nucleotides.c_str() + e->off, 1, e->len, stdout);
-	  break;
-	case DIFF_INSERT:
-	  printf("INS: ");
-	  fwrite(reference.c_str() + e->off, 1, e->len, stdout);
-	  break;
-	case DIFF_DELETE:
-	  printf("DEL: ");
-	  fwrite(fqr.d_nucleotides.c_str() + e->off, 1, e->len, stdout);
-	  break;
-	}
-	printf("\n");
-      }
-#endif
+  const dnapos_t band = 16;
+  dnapos_t begin = pos > band ? pos - band : 1;
+  static thread_local string window; // so we don't allocate per call
+  rg.view(begin, pos + fqfrag.d_nucleotides.length() + band).str(&window);
+  aligner->align(fqfrag.d_nucleotides, window, pos - begin);
+
+  unsigned int gaps = 0, good = 0, readPos = 0, firstGap = 0, lastGap = 0;
+  for(const auto& e : aligner->script()) {
+    if(e.op == BandedAligner::Edit::Insert || e.op == BandedAligner::Edit::Delete) {
+      if(!gaps++)
+        firstGap = readPos;
+      if(e.op == BandedAligner::Edit::Insert)
+        readPos += e.length;
+      lastGap = readPos;
+      continue;
     }
+    if(e.op == BandedAligner::Edit::Mismatch)
+      for(unsigned int i = readPos; i < readPos + e.length; ++i)
+        if(fqfrag.d_quality[i] > qlimit)
+          ++good;
+    readPos += e.length;
   }
-
-  varray_del(ses);
-
-  return ret;
+  // a gap close to either end is explained just as well by a few mismatches
+  if(!gaps || firstGap < 10 || fqfrag.d_nucleotides.length() - lastGap < 10 || good + gaps >= 5)
+    return false;
+  *start = begin + aligner->start();
+  *score = good + gaps;
+  return true;
 }
 
 unsigned int diffScore(ReferenceChromosome& rg, dnapos_t pos, const FastQRead& fqfrag, int qlimit)
 {
-  unsigned int diffcount=0;
-  string reference = rg.snippet(pos, pos + fqfrag.d_nucleotides.length());
-  for(string::size_type i = 0; i < fqfrag.d_nucleotides.size() && i < reference.size();++i) {
-    if(fqfrag.d_nucleotides[i] != reference[i] && fqfrag.d_quality[i] > qlimit) 
-      diffcount++;
-  }
-
-  if(diffcount >= 5) { // bit too different, try mbadiff!
-    int res=MBADiff(pos, fqfrag, reference);
-    if(res < 0 || res > 0)
-      return 1;
+  static thread_local vector<uint64_t> mask; // so we don't allocate per call
+  // no early exit, we get ranked on the full count
+  unsigned int diffcount = rg.view(pos, pos + fqfrag.d_nucleotides.length()).mismatches(fqfrag.d_nucleotides, fqfrag.d_quality, qlimit, &mask).good;
+
+  if(diffcount >= 5) { // bit too different, maybe there are indels
+    static thread_local BandedAligner aligner;
+    dnapos_t start;
+    unsigned int score;
+    if(alignIndels(rg, pos, fqfrag, qlimit, &aligner, &start, &score))
+      return score;
   }
 
   return diffcount;
 }
 
-vector<dnapos_t> getTriplets(const vector<pair<dnapos_t, char>>& together, unsigned int interval, unsigned int shift) 
-{
-  vector<dnapos_t> ret;
-
-  for(unsigned int i = 0; i < together.size() - 2; ++i) {
-    if(together[i].second=='L' && together[i+1].second=='M' && together[i+2].second=='R' && 
-       together[i+1].first - together[i].first < 1.2*interval && together[i+2].first - together[i+1].first < 1.2*interval) {
-      dnapos_t lpos;
-      lpos=together[i].first; 
-
-      if(lpos < shift)
-        continue;
-      
-      ret.push_back(lpos-shift);
-    }
-  }         
-  return ret;
-}
-
 void printCorrectMappings(FILE* jsfp, const ReferenceChromosome& rg, const std::string& name)
 {
   fprintf(jsfp, "%s=[", name.c_str());
@@ -291,103 +248,147 @@ struct qtally
   uint64_t incorrect;
 };
 
-int MapToReference(ReferenceChromosome& rg, dnapos_t pos, FastQRead fqfrag, int qlimit, BAMWriter* sbw, vector<qtally>* qqcounts, int* outIndel=0)
+//! Records the alignment alignIndels() made of fqfrag at pos in tally and qqcounts
+void mapAlignment(MappingTally& tally, dnapos_t pos, const FastQRead& fqfrag, int qlimit, const BandedAligner& aligner, vector<qtally>* qqcounts)
 {
-  if(pos > rg.size()) // can happen because of inserts or circular genomes
-    return false;
-  if(outIndel)
-    *outIndel=0;
-  string reference = rg.snippet(pos, pos + fqfrag.d_nucleotides.length());
-
-  double diffcount=0;
-  for(string::size_type i = 0; i < fqfrag.d_nucleotides.size() && i < reference.size();++i) {
-    if(fqfrag.d_nucleotides[i] != reference[i]) {
-      if(fqfrag.d_quality[i] > qlimit) 
-	diffcount++;
-      else
-	diffcount+=0.5;
+  const string& nucleotides = fqfrag.d_nucleotides;
+  const string& quality = fqfrag.d_quality;
+  auto head = [&](unsigned int i) { return fqfrag.reversed ^ (i > nucleotides.length()/2); }; // head or tail
+  auto readMapPos = [&](unsigned int i) { return fqfrag.reversed ? nucleotides.length() - 1 - i : i; };
+
+  int indel = 0; // the first one, for mapFastQ: >0 if our read has an insert there, <0 if it misses nucleotides there
+  unsigned int i = 0;
+  dnapos_t refPos = pos;
+  for(const auto& e : aligner.script()) {
+    switch(e.op) {
+    case BandedAligner::Edit::Match:
+      for(unsigned int n = 0; n < e.length; ++n, ++i, ++refPos) {
+        tally.cover(refPos, quality[i], qlimit);
+        (*qqcounts)[(unsigned int)quality[i]].correct++;
+        if(readMapPos(i) < tally.d_correctMappings.size())
+          tally.d_correctMappings[readMapPos(i)]++;
+      }
+      break;
+    case BandedAligner::Edit::Mismatch:
+      for(unsigned int n = 0; n < e.length; ++n, ++i, ++refPos) {
+        if(quality[i] > qlimit)
+          tally.d_pileup.add(refPos, nucleotides[i], quality[i], head(i));
+        (*qqcounts)[(unsigned int)quality[i]].incorrect++;
+        if(readMapPos(i) < tally.d_wrongMappings.size())
+          tally.d_wrongMappings[readMapPos(i)]++;
+      }
+      break;
+    case BandedAligner::Edit::Insert:
+      if(!indel)
+        indel = i;
+      tally.d_pileup.add(refPos, nucleotides[i], quality[i], head(i));
+      tally.d_inserts[refPos][nucleotides.substr(i, e.length)]++;
+      i += e.length;
+      break;
+    case BandedAligner::Edit::Delete:
+      if(!indel)
+        indel = -(int)(refPos - pos);
+      for(unsigned int n = 0; n < e.length; ++n, ++refPos) {
+        tally.d_pileup.add(refPos, 'X', 40, head(i));
+        (*qqcounts)[40].incorrect++;
+        if(readMapPos(i) < tally.d_wrongMappings.size())
+          tally.d_wrongMappings[readMapPos(i)]++;
+      }
+      break;
     }
   }
+  tally.mapFastQ(pos, fqfrag, indel);
+}
+
+//! Maps fqfrag to rg at pos, and records what we learned in tally, qqcounts and (if set) bamq. With indels, the read may end up starting elsewhere, outPos and outCigar say where and how
+int MapToReference(ReferenceChromosome& rg, MappingTally& tally, dnapos_t pos, const FastQRead& fqfrag, int qlimit, BAMWriter::queue_t* bamq, vector<qtally>* qqcounts, dnapos_t* outPos=0, string* outCigar=0)
+{
+  if(pos > rg.size()) // can happen because of inserts or circular genomes
+    return false;
+  if(outPos)
+    *outPos=pos;
+  if(outCigar)
+    outCigar->clear();
+  auto reference = rg.view(pos, pos + fqfrag.d_nucleotides.length());
+  static thread_local vector<uint64_t> mask; // so we don't allocate per call
+  // beyond 5 good mismatches we try to align with indels, and only need the mask if that does not work
+  auto mismatches = reference.mismatches(fqfrag.d_nucleotides, fqfrag.d_quality, qlimit, &mask, 5);
+  double diffcount = mismatches.good + mismatches.poor/2.0;
   bool didMap=false;
 
   if(diffcount < 5) {
     didMap=true;
-    rg.mapFastQ(pos, fqfrag);
-    if(sbw)
-      sbw->qwrite(pos, fqfrag);
+    tally.mapFastQ(pos, fqfrag);
+    if(bamq)
+      BAMWriter::qwrite(bamq, pos, fqfrag);
   }
   else {
-    unsigned int amount=0;
-    int indel=MBADiff(pos, fqfrag, reference, &amount);
-    if(outIndel)
-      *outIndel=indel;
-
-    if(indel) {
-      rg.mapFastQ(pos, fqfrag, indel);
-      if(sbw)
-	sbw->qwrite(pos, fqfrag, indel);
-      didMap=true;
-
-      diffcount=1; // makes sure we get mapped anyhow
-      if(indel > 0) { // our read has an insert at this position
-	//	cout<<"Mapping an insert: "<<pos+indel<<" of "<<amount<<" codons, "<<fqfrag.d_nucleotides.substr(indel, amount)<<endl;
-
-	// down below, everything will match, so we need to locimap here
-        rg.d_locimap[pos+indel].samples.push_back({fqfrag.d_nucleotides[indel], fqfrag.d_quality[indel], 
-	      (bool)(fqfrag.reversed ^ ((unsigned int)indel > fqfrag.d_nucleotides.length()/2)),      // head or tail
-	      fqfrag.d_nucleotides.substr(indel, amount)});
-
-        fqfrag.d_nucleotides.erase(indel, amount); // this makes things align again
-        fqfrag.d_quality.erase(indel, amount); 
-        rg.d_insertCounts[pos+indel]++; 
-      } else {      // our read has an erase at this position
-	//	cout<<"Mapping a delete at "<<pos-indel<<" of " <<amount<<" codons"<<endl;
-        fqfrag.d_nucleotides.insert(-indel, amount, 'X');
-	//	cout<<"REF: "<<reference<<endl<<"US:  "<<fqfrag.d_nucleotides<<endl;
-        fqfrag.d_quality.insert(-indel, amount, 40);
-      }
+    static thread_local BandedAligner aligner;
+    static thread_local string cigar;
+    unsigned int score;
+    if(alignIndels(rg, pos, fqfrag, qlimit, &aligner, &pos, &score)) {
+      mapAlignment(tally, pos, fqfrag, qlimit, aligner, qqcounts);
+      aligner.cigar(&cigar);
+      if(bamq)
+        BAMWriter::qwrite(bamq, pos, fqfrag, cigar);
+      if(outPos)
+        *outPos=pos;
+      if(outCigar)
+        *outCigar=cigar;
+      return true;
     }
+    if(mismatches.stopped)
+      reference.mismatches(fqfrag.d_nucleotides, &mask);
   }
 
   unsigned int readMapPos;
   for(string::size_type i = 0; i < fqfrag.d_nucleotides.size() && i < reference.size();++i) {
-    readMapPos = fqfrag.reversed ? ((reference.length()- 1) - i) : i; // d_nucleotides might have an insert
+    readMapPos = fqfrag.reversed ? ((reference.size()- 1) - i) : i;
       
-    char c =  fqfrag.d_nucleotides[i];
-
-    if(c != reference[i]) {
-      //      diff.append(1, fqfrag.d_quality[i] > qlimit ? '!' : '^');
-      //      cout<<"Have diff at "<<pos+i<<", diffCount="<<diffcount<<", qfilt="<< (fqfrag.d_quality[i] > qlimit)<<endl;
+    if((mask[i/64] >> (i%64)) & 1) {
       if(fqfrag.d_quality[i] > qlimit && diffcount < 5) 
-        rg.d_locimap[pos+i].samples.push_back({fqfrag.d_nucleotides[i], fqfrag.d_quality[i], 
-	      (bool)(fqfrag.reversed ^ (i > fqfrag.d_nucleotides.length()/2))}); // head or tail
+        tally.d_pileup.add(pos+i, fqfrag.d_nucleotides[i], fqfrag.d_quality[i], 
+			   fqfrag.reversed ^ (i > fqfrag.d_nucleotides.length()/2)); // head or tail
       
       if(diffcount < 5) {
 	unsigned int q = (unsigned int)fqfrag.d_quality[i];
 	(*qqcounts)[q].incorrect++;
-	rg.d_wrongMappings[readMapPos]++;
+	if(readMapPos < tally.d_wrongMappings.size()) // we sized for the longest read we sampled
+	  tally.d_wrongMappings[readMapPos]++;
       }
     }
     else {
-      // diff.append(1, ' ');
-      rg.cover(pos+i,fqfrag.d_quality[i], qlimit);
+      tally.cover(pos+i,fqfrag.d_quality[i], qlimit);
       if(diffcount < 5) {
 	(*qqcounts)[(unsigned int)fqfrag.d_quality[i]].correct++;
-	rg.d_correctMappings[readMapPos]++;
+	if(readMapPos < tally.d_correctMappings.size())
+	  tally.d_correctMappings[readMapPos]++;
       }
     }
   }
-  //  if(diffcount > 5) {
-  //  cout<<"US:  "<<fqfrag.d_nucleotides<<endl<<"DIF: ";
-  //  cout<<diff<<endl<<"REF: "<<reference<<endl;
-  //  cout<<"QUA: "<<fqfrag.d_quality<<endl;
-  //  cout<<endl;
-  //}
-  //return diff;
   return didMap;
 }
 
 
+//! aProb .. xProb of [start, stop) as JSON members, each the summed quality of that difference, divided by 30
+string pileupProbs(const ReferenceChromosome& rg, dnapos_t start, dnapos_t stop)
+{
+  vector<double> probs[Pileup::NumBases];
+  for(auto& p : probs)
+    p.resize(stop-start);
+  for(dnapos_t pos = start; pos < stop && pos < rg.d_pileup.size(); ++pos) {
+    for(unsigned int base = 0; base < Pileup::NumBases; ++base)
+      probs[base][pos-start] = rg.d_pileup.quality(pos, (Pileup::Base)base)/30.0;
+  }
+  string ret;
+  for(unsigned int base = 0; base < Pileup::NumBases; ++base) {
+    if(base)
+      ret += ", ";
+    ret += string(1, "acgtx"[base]) + "Prob: " + jsonVectorX(probs[base], [start](int i){return i+start;});
+  }
+  return ret;
+}
+
 void emitRegion(FILE*fp, ReferenceChromosome& rg, StereoFASTQReader& fastq, const string& name, unsigned int index, dnapos_t start, 
 		dnapos_t stop, const std::string& report_="", int maxVarcount=-1)
 {
@@ -400,29 +401,10 @@ void emitRegion(FILE*fp, ReferenceChromosome& rg, StereoFASTQReader& fastq, cons
   for(dnapos_t pos = start; pos < stop; ++pos) {
     if(pos != start) 
       fprintf(fp, ",");
-    fprintf(fp, "[%d,%d]", pos, rg.d_mapping[pos].coverage);
+    fprintf(fp, "[%d,%d]", pos, rg.d_coverage[pos]);
   }
   fprintf(fp, "], ");
-  vector<double> aProb(stop-start), cProb(stop-start), gProb(stop-start), tProb(stop-start), xProb(stop-start);
-  for(dnapos_t pos = start; pos < stop; ++pos) {
-    if(rg.d_locimap.count(pos)) {
-      for(const auto& locus: rg.d_locimap[pos].samples) {
-	acgtxDo(locus.nucleotide, 
-		[&]() { aProb[pos-start]+= locus.quality/30.0; }, 
-		[&]() { cProb[pos-start]+= locus.quality/30.0; }, 
-		[&]() { gProb[pos-start]+= locus.quality/30.0; }, 
-		[&]() { tProb[pos-start]+= locus.quality/30.0; },
-		[&]() { xProb[pos-start]+= locus.quality/30.0; });
-      }
-    }
-  }
-  
-  fprintf(fp, "aProb: %s, cProb: %s, gProb: %s, tProb: %s, xProb: %s",
-	  jsonVectorX(aProb, [start](int i){return i+start;}).c_str(), 
-	  jsonVectorX(cProb, [start](int i){return i+start;}).c_str(), 
-	  jsonVectorX(gProb, [start](int i){return i+start;}).c_str(), 
-	  jsonVectorX(tProb, [start](int i){return i+start;}).c_str(),
-	  jsonVectorX(xProb, [start](int i){return i+start;}).c_str());
+  fprintf(fp, "%s", pileupProbs(rg, start, stop).c_str());
 
   string picture; // =rg.getMatchingFastQs(start, stop, fastq);
   string snippet=rg.snippet(start, dnapos) + " | " +rg.snippet(dnapos, stop);
@@ -453,18 +435,15 @@ void emitRegion(FILE*fp, ReferenceChromosome& rg, StereoFASTQReader& fastq, cons
   emitRegion(fp, rg, fastq, name, index, start > 200 ? start-200 : 1, (start +200) < rg.size() ? (start + 200) : rg.size(), report);
 }
 
-unsigned int variabilityCount(const ReferenceChromosome& rg, dnapos_t position, const ReferenceChromosome::LociStats& lc, double* fraction)
+unsigned int variabilityCount(const ReferenceChromosome& rg, dnapos_t position, double* fraction)
 {
   vector<int> counts(256);
-  counts[rg.snippet(position, position+1)[0]]+=rg.d_mapping[position].coverage;
+  counts[rg.snippet(position, position+1)[0]]+=rg.d_coverage[position];
   
-  int forwardCount=0;
+  int forwardCount=rg.d_pileup.heads(position);
+  for(unsigned int base = 0; base < Pileup::NumBases; ++base) 
+    counts["ACGTX"[base]] += rg.d_pileup.count(position, (Pileup::Base)base);
 
-  for(const auto& j : lc.samples) {
-    counts[j.nucleotide]++;
-    if(j.headOrTail)
-      forwardCount++;
-  }
   sort(counts.begin(), counts.end());
   unsigned int nonDom=0;
   for(unsigned int i=0; i < 255; ++i) {
@@ -474,7 +453,7 @@ unsigned int variabilityCount(const ReferenceChromosome& rg, dnapos_t position,
   if(nonDom + counts[255] < 20) // depth
     return 0;
 
-  *fraction = 1.0*forwardCount / (1.0*lc.samples.size());
+  *fraction = 1.0*forwardCount / (1.0*rg.d_pileup.total(position));
   if(*fraction < 0.05 || *fraction > 0.95)
     return 0;
 
@@ -482,72 +461,80 @@ unsigned int variabilityCount(const ReferenceChromosome& rg, dnapos_t position,
 }
 
 
-vector<ReferenceChromosome::MatchDescriptor> fuzzyFind(FastQRead* fqfrag, ReferenceChromosome& rg, unsigned int keylen, int qlimit)
+/** Verifies the diagonals most seeds of fqfrag voted for, on either strand, and appends them to matches. If sparse seeds find 
+    nothing we would map, we try again with all of them. Leaves fqfrag turned the way of the last one we verified */
+void fuzzyFind(FastQRead* fqfrag, ReferenceChromosome& rg, int qlimit, vector<ReferenceChromosome::MatchDescriptor>* matches)
 {
-  vector<ReferenceChromosome::MatchDescriptor> ret;
-
-  string left, middle, right;
-  typedef pair<dnapos_t, char> tpos;
-  vector<dnapos_t> lpositions, mpositions, rpositions;
-
-  if(fqfrag->d_nucleotides.length() < 3*keylen) // too short
-    return ret;
-
-  unsigned int interval=(fqfrag->d_nucleotides.length() - 3*keylen)/3;
-
-  for(unsigned int attempts=0; attempts < interval; attempts += 3) {
-    for(int tries = 0; tries < 2; ++tries) {
-      if(tries)
-	fqfrag->reverse();
-      left=fqfrag->d_nucleotides.substr(attempts, keylen);   
-      middle=fqfrag->d_nucleotides.substr(interval+attempts, keylen); 
-      right=fqfrag->d_nucleotides.substr(2*interval+attempts, keylen);
-      lpositions=rg.getReadPositions(left); 
+  static thread_local vector<ReferenceChromosome::SeedChain> chains; // so we don't allocate per read
+  const bool reversed = fqfrag->reversed; // chains are relative to how we got the read
+  const auto first = matches->size(); // ours start here
+
+  for(bool dense : {false, true}) {
+    rg.getSeedChains(fqfrag->d_nucleotides, 16, dense, &chains);
+    for(const auto& chain : chains) {
+      if(std::find_if(matches->begin() + first, matches->end(), [&chain, reversed](const ReferenceChromosome::MatchDescriptor& md) {
+            return md.pos==chain.pos && md.reverse == (reversed ^ chain.reverse);
+          }) != matches->end())
+        continue;
 
-      if(lpositions.empty())
-	continue;
-      mpositions=rg.getReadPositions(middle); 
-      if(mpositions.empty())
-	continue;
-      rpositions=rg.getReadPositions(right);
-      
-      if(lpositions.size() + mpositions.size() + rpositions.size() < 3)
-	continue;
-      vector<tpos> together;
-      for(auto fpos: lpositions) { together.push_back(make_pair(fpos, 'L')); }        
-      for(auto fpos: mpositions) { together.push_back(make_pair(fpos, 'M')); }
-      for(auto fpos: rpositions) { together.push_back(make_pair(fpos, 'R')); }
-      
-      sort(together.begin(), together.end());
-      
-      auto matches=getTriplets(together, interval, attempts);
-      //	random_shuffle(matches.begin(), matches.end()); // should prevent pileup because if 'score==0' shortcut below
-      int score;
-      for(auto match : matches) {
-	if(std::find_if(ret.begin(), ret.end(), 
-			[&match](const ReferenceChromosome::MatchDescriptor& md){ return md.pos==match;}) != ret.end())
-	  continue;
-	
-	score = diffScore(rg, match, *fqfrag, qlimit);
-        
-	ret.push_back({&rg, match, fqfrag->reversed, score});
-	if(score==0) // won't get any better than this
-	  return ret;
-      }
+      if(fqfrag->reversed != (reversed ^ chain.reverse))
+        fqfrag->reverse();
+      int score = diffScore(rg, chain.pos, *fqfrag, qlimit);
+      matches->push_back({&rg, chain.pos, fqfrag->reversed, score});
+      if(score==0) // won't get any better than this
+        return;
     }
+    if(std::find_if(matches->begin() + first, matches->end(), [](const ReferenceChromosome::MatchDescriptor& md) { return md.score < 5; }) != matches->end())
+      break;
   }
-  return ret;
 }
 
-vector<ReferenceChromosome::MatchDescriptor> fuzzyFind(FastQRead* fqfrag, vector<unique_ptr<ReferenceChromosome> >& refs, int keylen, int qlimit)
+void fuzzyFind(FastQRead* fqfrag, vector<unique_ptr<ReferenceChromosome> >& refs, int qlimit, vector<ReferenceChromosome::MatchDescriptor>* matches)
 {
-  vector<ReferenceChromosome::MatchDescriptor> ret;
-  for(auto& rg : refs) {
-    auto inter = fuzzyFind(fqfrag, *rg, keylen, qlimit);
-    for(auto& i : inter)
-      ret.push_back(i); // XXX must be a better way
+  for(auto& rg : refs)
+    fuzzyFind(fqfrag, *rg, qlimit, matches);
+}
+
+/** Mate rescue: looks for fqfrag only where inserts says it should be if its mate is at anchor, turned the other way.
+    Aligning there is a lot cheaper than a fuzzyFind() over the whole genome. Returns false if we find nothing credible,
+    otherwise *match has where fqfrag maps. Leaves fqfrag turned opposite to the anchor */
+bool rescueMate(const ReferenceChromosome::MatchDescriptor& anchor, unsigned int anchorLength, FastQRead* fqfrag,
+                const InsertSizeModel& inserts, int qlimit, ReferenceChromosome::MatchDescriptor* match)
+{
+  ReferenceChromosome& rg = *anchor.rg;
+  const int64_t length = fqfrag->d_nucleotides.length(), band = 16;
+  // the leftmost mate starts the insert, the rightmost one ends it
+  int64_t first, last, expected;
+  if(anchor.reverse) {
+    first = (int64_t)anchor.pos + anchorLength - inserts.high();
+    last = (int64_t)anchor.pos + anchorLength - inserts.low();
+    expected = (int64_t)anchor.pos + anchorLength - inserts.median();
   }
-  return ret;
+  else {
+    first = (int64_t)anchor.pos + inserts.low() - length;
+    last = (int64_t)anchor.pos + inserts.high() - length;
+    expected = (int64_t)anchor.pos + inserts.median() - length;
+  }
+  dnapos_t begin = std::max<int64_t>(1, first - band);
+  dnapos_t end = std::min<int64_t>(rg.size() + 1, last + length + band);
+  if(end < begin + length)
+    return false;
+
+  if(fqfrag->reversed == anchor.reverse)
+    fqfrag->reverse();
+  static thread_local BandedAligner aligner;
+  static thread_local string window;
+  rg.view(begin, end).str(&window);
+  aligner.align(fqfrag->d_nucleotides, window, std::max<int64_t>(0, expected - begin));
+  if(aligner.distance() > length/4) // nothing in the window looks like our read
+    return false;
+
+  dnapos_t pos = begin + aligner.start();
+  int score = diffScore(rg, pos, *fqfrag, qlimit);
+  if(score >= 5)
+    return false;
+  *match = {&rg, pos, fqfrag->reversed, score};
+  return true;
 }
 
 
@@ -567,7 +554,6 @@ void writeUnmatchedReads(const vector<uint64_t>& unfoundReads, StereoFASTQReader
 struct ClusterLocus
 {
   unsigned int pos;
-  ReferenceChromosome::LociStats locistat;
   bool operator<(const ClusterLocus& rhs) const
   {
     return pos < rhs.pos;
@@ -575,7 +561,7 @@ struct ClusterLocus
 };
 
 string makeAminoReport(ReferenceChromosome& rg, dnapos_t pos, const vector<GeneAnnotation>& gas, 
-		       const ReferenceChromosome::LociStats& locistat, string* headline, string* body)
+		       string* headline, string* body)
 { 
   string origCodon{"XXX"}, newCodon;
   string gene;
@@ -587,17 +573,16 @@ string makeAminoReport(ReferenceChromosome& rg, dnapos_t pos, const vector<GeneA
   int aCount{0}, cCount{0}, gCount{0}, tCount{0};
   char c=rg.snippet(pos, pos+1)[0];
   acgtDo(c, 
-	 [&](){aCount += rg.d_mapping[pos].coverage;},
-	 [&](){cCount += rg.d_mapping[pos].coverage;},
-	 [&](){gCount += rg.d_mapping[pos].coverage;},
-	 [&](){tCount += rg.d_mapping[pos].coverage;}
+	 [&](){aCount += rg.d_coverage[pos];},
+	 [&](){cCount += rg.d_coverage[pos];},
+	 [&](){gCount += rg.d_coverage[pos];},
+	 [&](){tCount += rg.d_coverage[pos];}
 	 );
   
-  for(auto j = locistat.samples.begin(); 
-      j != locistat.samples.end(); ++j) {
-    c=j->nucleotide;
-    acgtDo(c, [&](){ aCount++; }, [&](){ cCount++; }, [&](){ gCount++; }, [&](){ tCount++; } );
-  }
+  aCount += rg.d_pileup.count(pos, Pileup::A);
+  cCount += rg.d_pileup.count(pos, Pileup::C);
+  gCount += rg.d_pileup.count(pos, Pileup::G);
+  tCount += rg.d_pileup.count(pos, Pileup::T);
   for(const auto& ga : gas) {
     if(ga.gene) {
       gene = rg.snippet(ga.startPos, ga.stopPos+1);
@@ -653,7 +638,7 @@ string makeAminoReport(ReferenceChromosome& rg, dnapos_t pos, const vector<GeneA
   return ret2.str();
 }
 
-string makeReport(ReferenceChromosome& rg, dnapos_t pos, ReferenceChromosome::LociStats locistat, double fraction, string* summary=0)
+string makeReport(ReferenceChromosome& rg, dnapos_t pos, double fraction, string* summary=0)
 {
   ostringstream report;
   if(summary)
@@ -672,38 +657,36 @@ string makeReport(ReferenceChromosome& rg, dnapos_t pos, ReferenceChromosome::Lo
   aCount = cCount = tCount = gCount = xCount = 0;
   
   acgtxDo(c, 
-	 [&](){aCount += rg.d_mapping[pos].coverage;},
-	 [&](){cCount += rg.d_mapping[pos].coverage;},
-	 [&](){gCount += rg.d_mapping[pos].coverage;},
-	  [&](){tCount += rg.d_mapping[pos].coverage;},
-	  [&](){xCount += rg.d_mapping[pos].coverage;}
+	 [&](){aCount += rg.d_coverage[pos];},
+	 [&](){cCount += rg.d_coverage[pos];},
+	 [&](){gCount += rg.d_coverage[pos];},
+	  [&](){tCount += rg.d_coverage[pos];},
+	  [&](){xCount += rg.d_coverage[pos];}
 	 );
 
   char orig = rg.snippet(pos, pos+1)[0];
-  report << (fmt1 % pos % rg.d_mapping[pos].coverage % orig ).str();
-  sort(locistat.samples.begin(), locistat.samples.end());
-  for(auto j = locistat.samples.begin(); 
-      j != locistat.samples.end(); ++j) {
-    c=j->nucleotide;
-    acgtxDo(c, [&](){ aCount++; }, [&](){ cCount++; }, [&](){ gCount++; }, [&](){ tCount++; }, [&](){ xCount++; }  );    
-    report<<c;
-  }
+  report << (fmt1 % pos % rg.d_coverage[pos] % orig ).str();
+  // differences, then their mean quality, per nucleotide
+  unsigned int differences = rg.d_pileup.total(pos);
+  for(unsigned int base = 0; base < Pileup::NumBases; ++base) 
+    report << string(rg.d_pileup.count(pos, (Pileup::Base)base), "ACGTX"[base]);
   report<<endl<<fmt2;
-  for(auto j = locistat.samples.begin(); 
-      j != locistat.samples.end(); ++j) {
-    report<<((char)(j->quality+33));
-  }
-  report << endl << fmt2;
-  for(auto j = locistat.samples.begin(); 
-      j != locistat.samples.end(); ++j) {
-    report << (j->headOrTail ? 'H' : '.');
+  for(unsigned int base = 0; base < Pileup::NumBases; ++base) {
+    if(unsigned int count = rg.d_pileup.count(pos, (Pileup::Base)base))
+      report << "ACGTX"[base] << ": Q" << rg.d_pileup.quality(pos, (Pileup::Base)base) / count << " ";
   }
-
-  int tot=locistat.samples.size() + rg.d_mapping[pos].coverage;
+  report << endl << fmt2 << "Head: " << rg.d_pileup.heads(pos) << '/' << differences;
+  aCount += rg.d_pileup.count(pos, Pileup::A);
+  cCount += rg.d_pileup.count(pos, Pileup::C);
+  gCount += rg.d_pileup.count(pos, Pileup::G);
+  tCount += rg.d_pileup.count(pos, Pileup::T);
+  xCount += rg.d_pileup.count(pos, Pileup::Del);
+
+  int tot=differences + rg.d_coverage[pos];
   report<<endl;
   string aminoHeadline, aminoBody;
   if(!gas.empty())
-    makeAminoReport(rg, pos, gas, locistat, &aminoHeadline, &aminoBody);
+    makeAminoReport(rg, pos, gas, &aminoHeadline, &aminoBody);
   report<<fmt2<<aminoHeadline<<endl;
 
   if(!gas.empty()) {
@@ -713,7 +696,7 @@ string makeReport(ReferenceChromosome& rg, dnapos_t pos, ReferenceChromosome::Lo
     }
     report << endl;
   }
-  report << fmt2<< "Fraction tail: "<<fraction<<", "<< locistat.samples.size()<<endl;
+  report << fmt2<< "Fraction tail: "<<fraction<<", "<< differences<<endl;
   report << fmt2<< "A: " << aCount*100/tot <<"%, C: "<<cCount*100/tot<<"%, G: "<<gCount*100/tot<<"%, T: "<<tCount*100/tot<<"%"<<", X: "<<xCount*100/tot<<"%"<<endl;
 
   if(!aminoBody.empty())
@@ -751,22 +734,10 @@ void printQualities(FILE* jsfp, const qstats_t& qstats)
   fflush(jsfp);
 }
 
-vector<ReferenceChromosome::MatchDescriptor> getAllReadPosBoth(vector<unique_ptr<ReferenceChromosome> >& refs, const vector<unsigned int>& indexLengths, FastQRead* fqfrag) 
+void getAllReadPosBoth(vector<unique_ptr<ReferenceChromosome> >& refs, FastQRead* fqfrag, vector<ReferenceChromosome::MatchDescriptor>* matches) 
 {
-  vector<ReferenceChromosome::MatchDescriptor> ret;
-  auto iter = indexLengths.begin();
-  for(; iter != indexLengths.end(); ++iter)
-    if(*iter == fqfrag->d_nucleotides.length())
-      break;
-  if(iter == indexLengths.end())
-    return ret;
-
-  for(auto& rg : refs) {
-    auto inter = rg->getAllReadPosBoth(fqfrag);
-    for(auto& i : inter) 
-      ret.push_back(i); // XXX must be better way, back_inserter?
-  }
-  return ret;
+  for(auto& rg : refs)
+    rg->getAllReadPosBoth(*fqfrag, matches);
 }
 
 void emitLociAndCluster(FILE* jsfp, ReferenceChromosome* rg, int numRef, 
@@ -774,58 +745,46 @@ void emitLociAndCluster(FILE* jsfp, ReferenceChromosome* rg, int numRef,
 {
   ofstream ofs("loci."+lexical_cast<string>(numRef));
   ofs<<"locus\tnumdiff\tdepth\tA\tAq\tC\tCq\tG\tGq\tT\tTq\tdels\ttotQ\tfracHead"<<endl;
-  map<dnapos_t, ReferenceChromosome::LociStats> slocimap;
 
   FILE* locifp=fopen(("loci."+lexical_cast<string>(numRef)+".js").c_str(), "w");
-    
-  for(auto& p : rg->d_locimap) {
-    slocimap.insert(p);
-  }
-
 
   fprintf(jsfp, "genomes[%d].loci=[", numRef);
   fprintf(locifp, "loci[\"%s\"]=[", g_name.c_str());
 
+  const Pileup& pileup = rg->d_pileup;
   bool emitted=false;
-  for(auto& p : slocimap) {
-    if(p.second.samples.size()==1) // no variability if only 2
+  for(dnapos_t locus = 0; locus < pileup.size(); ++locus) {
+    unsigned int numDiff = pileup.total(locus);
+    if(numDiff <= 1) // no variability if only 2
       continue;
     
-    int aCount=0, cCount=0, gCount=0, tCount=0, xCount=0;
-    int aQual=0, cQual=0, gQual=0, tQual=0;
-    int head=0;
-    map<string, int> insertCounts;
-    for(const auto& c: p.second.samples) {
-      acgtxDo(c.nucleotide, 
-	      [&](){ aCount++; aQual+=c.quality;}, 
-	      [&](){ cCount++; cQual+=c.quality;}, 
-	      [&](){ gCount++; gQual+=c.quality;}, 
-	      [&](){ tCount++; tQual+=c.quality;},
-	      [&](){ xCount++; });
-      if(c.headOrTail)
-	head++;
-      if(!c.insert.empty())
-	insertCounts[c.insert]++;
-    }
+    int aCount=pileup.count(locus, Pileup::A), cCount=pileup.count(locus, Pileup::C);
+    int gCount=pileup.count(locus, Pileup::G), tCount=pileup.count(locus, Pileup::T);
+    int xCount=pileup.count(locus, Pileup::Del);
+    int aQual=pileup.quality(locus, Pileup::A), cQual=pileup.quality(locus, Pileup::C);
+    int gQual=pileup.quality(locus, Pileup::G), tQual=pileup.quality(locus, Pileup::T);
     
     if(aQual < 90 && cQual < 90 && gQual < 90 && tQual < 90 && xCount < 3)
       continue;
     
     string insertReport;
-    for(const auto& i : insertCounts) {
-      if(!insertReport.empty())
-	insertReport+=", ";
-      insertReport += i.first+": "+lexical_cast<string>(i.second);
+    auto inserts = rg->d_inserts.find(locus);
+    if(inserts != rg->d_inserts.end()) {
+      for(const auto& i : inserts->second) {
+	if(!insertReport.empty())
+	  insertReport+=", ";
+	insertReport += i.first+": "+lexical_cast<string>(i.second);
+      }
     }
 
-    double fraction =(1.0*head/p.second.samples.size());
+    double fraction =(1.0*pileup.heads(locus)/numDiff);
     if(fraction < 0.1 || fraction > 0.9)
       continue;
     
-    vcl.feed(ClusterLocus{p.first, p.second});
+    vcl.feed(ClusterLocus{locus});
 
     string summary;
-    char orig = rg->snippet(p.first, p.first+1)[0];
+    char orig = rg->snippet(locus, locus+1)[0];
     if(aCount && orig!='A') {
       summary.append(1, orig);
       summary.append(">A");
@@ -856,7 +815,7 @@ void emitLociAndCluster(FILE* jsfp, ReferenceChromosome* rg, int numRef,
     }
   
 
-    ofs<<p.first<<"\t"<<p.second.samples.size()<<"\t"<<rg->d_mapping[p.first].coverage<<"\t";
+    ofs<<locus<<"\t"<<numDiff<<"\t"<<rg->d_coverage[locus]<<"\t";
     ofs<<aCount<<"\t"<<aQual<<"\t";
     ofs<<cCount<<"\t"<<cQual<<"\t";
     ofs<<gCount<<"\t"<<gQual<<"\t";
@@ -868,7 +827,7 @@ void emitLociAndCluster(FILE* jsfp, ReferenceChromosome* rg, int numRef,
     bool gene=false;
     string aminoReport;
     if(rg->d_gar) {
-      auto gas = rg->d_gar->lookup("", p.first);
+      auto gas = rg->d_gar->lookup("", locus);
       abort(); // needs name of chromosome
       for(auto ga : gas) {
         replace_all(ga.tag, "\n", "\\n");
@@ -879,7 +838,7 @@ void emitLociAndCluster(FILE* jsfp, ReferenceChromosome* rg, int numRef,
 
       }
       if(gene) {
-	aminoReport = makeAminoReport(*rg, p.first, gas, p.second, 0, 0);
+	aminoReport = makeAminoReport(*rg, locus, gas, 0, 0);
 	replace_all(aminoReport, "\n", " ");
 	trim_left(aminoReport);
       }
@@ -893,25 +852,14 @@ void emitLociAndCluster(FILE* jsfp, ReferenceChromosome* rg, int numRef,
 
     string graph;
 
-    dnapos_t start = p.first-100, stop = min(p.first+100, (dnapos_t)rg->d_mapping.size());
-    vector<double> aProb(stop-start), cProb(stop-start), gProb(stop-start), tProb(stop-start), xProb(stop-start);
+    dnapos_t start = locus-100, stop = min(locus+100, (dnapos_t)rg->d_coverage.size());
 
     for(dnapos_t pos = start; pos < stop; ++pos) {
       if(!graph.empty()) 
 	graph+=",";
-      graph+="["+to_string(pos)+","+to_string(rg->d_mapping[pos].coverage)+"]";
-
-      if(rg->d_locimap.count(pos)) {
-	for(const auto& locus: rg->d_locimap[pos].samples) {
-	  acgtxDo(locus.nucleotide, 
-		  [&]() { aProb[pos-start]+= locus.quality/30.0; }, 
-		  [&]() { cProb[pos-start]+= locus.quality/30.0; }, 
-		  [&]() { gProb[pos-start]+= locus.quality/30.0; }, 
-		  [&]() { tProb[pos-start]+= locus.quality/30.0; },
-		  [&]() { xProb[pos-start]+= locus.quality/30.0; });
-	}
-      }
+      graph+="["+to_string(pos)+","+to_string(rg->d_coverage[pos])+"]";
     }
+    string probs = pileupProbs(*rg, start, stop);
 
 
     for(int n=0; n < 2; ++n) {
@@ -922,16 +870,12 @@ void emitLociAndCluster(FILE* jsfp, ReferenceChromosome* rg, int numRef,
 	      "tCount: %d, tQual: %d, "
 	      "totQual: %d, "
 	      "xCount: %d, "
-	      "fraction: %f, gene: %d, annotation: '%s', aminoReport: '%s', insertReport: '%s', summary: '%s', graph: [%s], aProb: %s, cProb: %s, gProb: %s, tProb: %s, xProb: %s}", 
-	      p.first, (int)p.second.samples.size(), '?', rg->d_mapping[p.first].coverage, 
+	      "fraction: %f, gene: %d, annotation: '%s', aminoReport: '%s', insertReport: '%s', summary: '%s', graph: [%s], %s}", 
+	      locus, (int)numDiff, '?', rg->d_coverage[locus], 
 	      aCount, aQual, cCount, cQual, gCount, gQual, tCount, tQual, 
 	      aQual+cQual+gQual+tQual,
 	      xCount, fraction, gene, annotation.c_str(), aminoReport.c_str(), insertReport.c_str(), summary.c_str(), graph.c_str(),
-	      jsonVectorX(aProb, [start](int i){return i+start;}).c_str(), 
-	      jsonVectorX(cProb, [start](int i){return i+start;}).c_str(), 
-	      jsonVectorX(gProb, [start](int i){return i+start;}).c_str(), 
-	      jsonVectorX(tProb, [start](int i){return i+start;}).c_str(),
-	      jsonVectorX(xProb, [start](int i){return i+start;}).c_str());
+	      probs.c_str());
     }
     emitted=true;
   }
@@ -955,8 +899,436 @@ void pleaseQuitHandler(int)
   g_pleaseQuit=true;
 }
 
+//! A pair of reads, plus if the duplicate filter deemed them too frequent
+struct ReadPair
+{
+  FastQRead fqfrag[2];
+  bool dup[2];
+};
+
+/** A numbered batch of ReadPair s, the unit of work for mapping threads. Once mapped, batches go back to the reader
+    through BatchQueue::recycle(), which reads into the strings the pairs already have, so they stop allocating */
+struct ReadPairBatch
+{
+  uint64_t number;
+  vector<ReadPair> pairs;
+};
+
+//! Bounded queue that hands ReadPairBatch es from the reading thread to the mapping threads, and back
+class BatchQueue
+{
+public:
+  explicit BatchQueue(unsigned int limit) : d_limit(limit)
+  {}
+  void push(unique_ptr<ReadPairBatch> batch) //!< blocks while the queue is full
+  {
+    std::unique_lock<std::mutex> lock(d_mut);
+    d_cond.wait(lock, [this]() { return d_batches.size() < d_limit; });
+    d_batches.push_back(move(batch));
+    d_cond.notify_all();
+  }
+  unique_ptr<ReadPairBatch> pop() //!< blocks, returns empty pointer once closed and empty
+  {
+    std::unique_lock<std::mutex> lock(d_mut);
+    d_cond.wait(lock, [this]() { return d_closed || !d_batches.empty(); });
+    if(d_batches.empty())
+      return unique_ptr<ReadPairBatch>();
+    auto ret = move(d_batches.front());
+    d_batches.pop_front();
+    d_cond.notify_all();
+    return ret;
+  }
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(d_mut);
+    d_closed=true;
+    d_cond.notify_all();
+  }
+  void recycle(unique_ptr<ReadPairBatch> batch) //!< for spare() to hand out again, pairs and all
+  {
+    std::lock_guard<std::mutex> lock(d_mut);
+    d_spares.push_back(move(batch));
+  }
+  unique_ptr<ReadPairBatch> spare() //!< a recycled batch, or a new one if there is none
+  {
+    std::lock_guard<std::mutex> lock(d_mut);
+    if(d_spares.empty())
+      return unique_ptr<ReadPairBatch>(new ReadPairBatch);
+    auto ret = move(d_spares.back());
+    d_spares.pop_back();
+    return ret;
+  }
+private:
+  std::mutex d_mut;
+  std::condition_variable d_cond;
+  std::deque<unique_ptr<ReadPairBatch>> d_batches;
+  vector<unique_ptr<ReadPairBatch>> d_spares;
+  unsigned int d_limit;
+  bool d_closed{false};
+};
+
+/** Pairs up the matches of two mates. We sort both by chromosome and position and walk them together, so we only
+    look at matches close enough to be a pair instead of at all combinations. Pairs rank by the sum of the scores
+    of their mates, and lose half a point if the insert size model finds their insert unlikely. Keeps its buffers
+    between calls, so keep one per thread */
+class PairResolver
+{
+public:
+  typedef ReferenceChromosome::MatchDescriptor match_t;
+  struct Pair
+  {
+    match_t first, second;
+    int insert; //!< from the start of the forward mate to the end of the reverse one
+  };
+  //! the best ranking pairs, ordered like first and second are. Empty if nothing pairs up
+  const vector<Pair>& resolve(const vector<match_t>& first, unsigned int firstLength, 
+                              const vector<match_t>& second, unsigned int secondLength, const InsertSizeModel& inserts);
+private:
+  struct Entry
+  {
+    const match_t* match;
+    unsigned int index;
+    bool operator<(const Entry& rhs) const
+    {
+      return tie(match->rg, match->pos, index) < tie(rhs.match->rg, rhs.match->pos, rhs.index);
+    }
+  };
+  static void sortEntries(const vector<match_t>& matches, vector<Entry>* entries);
+
+  vector<Entry> d_first, d_second;
+  vector<pair<unsigned int, unsigned int> > d_bestIndices;
+  vector<Pair> d_best;
+};
+
+void PairResolver::sortEntries(const vector<match_t>& matches, vector<Entry>* entries)
+{
+  entries->clear();
+  for(unsigned int i = 0; i < matches.size(); ++i)
+    entries->push_back({&matches[i], i});
+  sort(entries->begin(), entries->end());
+}
+
+const vector<PairResolver::Pair>& PairResolver::resolve(const vector<match_t>& first, unsigned int firstLength, 
+                                                        const vector<match_t>& second, unsigned int secondLength, const InsertSizeModel& inserts)
+{
+  d_best.clear();
+  d_bestIndices.clear();
+  if(first.empty() || second.empty())
+    return d_best;
+  sortEntries(first, &d_first);
+  sortEntries(second, &d_second);
+
+  const int64_t reach = inserts.high(); // mates further apart than this are no pair
+  int bestRank = std::numeric_limits<int>::max();
+  auto begin = d_second.cbegin();
+  for(const auto& e : d_first) {
+    const match_t& m1 = *e.match;
+    while(begin != d_second.cend() && (begin->match->rg < m1.rg || 
+                                       (begin->match->rg == m1.rg && (int64_t)begin->match->pos + reach <= m1.pos)))
+      ++begin;
+    for(auto iter = begin; iter != d_second.cend() && iter->match->rg == m1.rg && iter->match->pos < m1.pos + reach; ++iter) {
+      const match_t& m2 = *iter->match;
+      if(m1.reverse == m2.reverse)
+        continue;
+      int64_t insert = m1.reverse ? (int64_t)m1.pos + firstLength - m2.pos : (int64_t)m2.pos + secondLength - m1.pos;
+      int rank = 2*(m1.score + m2.score) + (insert < inserts.low() || insert > inserts.high());
+      if(rank > bestRank)
+        continue;
+      if(rank < bestRank) {
+        bestRank = rank;
+        d_bestIndices.clear();
+      }
+      d_bestIndices.push_back({e.index, iter->index});
+    }
+  }
+  // random picks from these must not depend on how we sorted
+  sort(d_bestIndices.begin(), d_bestIndices.end());
+  for(const auto& idx : d_bestIndices) {
+    const match_t& m1 = first[idx.first], &m2 = second[idx.second];
+    d_best.push_back({m1, m2, (int)(m1.reverse ? (int64_t)m1.pos + firstLength - m2.pos : (int64_t)m2.pos + secondLength - m1.pos)});
+  }
+  return d_best;
+}
+
+/** Maps ReadPair s to the reference chromosomes. Only reads from the ReferenceChromosome s, everything it learns 
+    (statistics, coverage, BAM queue) it keeps to itself. Run one per thread, merge() them afterwards, and commit() the result. */
+class ReadMapper
+{
+public:
+  //! model is what we pair and rescue mates by. It must not change while we map, see primeInsertSizes
+  ReadMapper(vector<unique_ptr<ReferenceChromosome> >& refgens, const InsertSizeModel& model, unsigned int maxreadsize, 
+	     int qlimit, bool writeBAM, uint32_t seed);
+  void mapBatch(ReadPairBatch& batch);
+  void merge(ReadMapper& rhs); //!< add everything rhs learned to us
+  void commit(BAMWriter& sbw); //!< move our tallies into the ReferenceChromosome s, and our BAM queue into sbw
+  vector<uint64_t> getUnfoundReads(); //!< in the order of the input
+
+  uint64_t withAny{0}, found{0}, total{0}, goodPairMatches{0}, badPairMatches{0};
+  ReadStatistics stats;
+  vector<qtally> qqcounts;
+  uint64_t rescued{0}; //!< reads in a good pair that we found next to their mate instead of by searching the genome
+  InsertSizeModel inserts; //!< what the pairs we mapped taught us, for reporting only
+private:
+  void mapPair(ReadPair& rp, uint64_t batchNumber);
+  bool rescueNear(const vector<ReferenceChromosome::MatchDescriptor>& anchors, unsigned int anchorLength, FastQRead* fqfrag, 
+                  vector<ReferenceChromosome::MatchDescriptor>* matches);
+  MappingTally& tally(ReferenceChromosome* rg)
+  {
+    return d_tallies.find(rg)->second;
+  }
+  BAMWriter::queue_t* bamQueue()
+  {
+    return d_writeBAM ? &d_bamQueue : 0;
+  }
+
+  vector<unique_ptr<ReferenceChromosome> >& d_refgens;
+  const InsertSizeModel& d_model;
+  int d_qlimit;
+  bool d_writeBAM;
+  uint32_t d_seed;
+  map<ReferenceChromosome*, MappingTally> d_tallies;
+  BAMWriter::queue_t d_bamQueue;
+  PairResolver d_resolver;
+  // per pair scratch, kept so we don't allocate per read
+  vector<ReferenceChromosome::MatchDescriptor> d_matches[2], d_best;
+  string d_cigar;
+  vector<pair<uint64_t, uint64_t> > d_unfoundReads; // batch number, position
+};
+
+ReadMapper::ReadMapper(vector<unique_ptr<ReferenceChromosome> >& refgens, const InsertSizeModel& model, unsigned int maxreadsize, 
+		       int qlimit, bool writeBAM, uint32_t seed) 
+  : stats(maxreadsize), qqcounts(256), 
+    d_refgens(refgens), d_model(model), d_qlimit(qlimit), d_writeBAM(writeBAM), d_seed(seed)
+{
+  for(auto& rg : d_refgens)
+    d_tallies.insert({rg.get(), rg->makeTally()});
+}
+
+void ReadMapper::mapBatch(ReadPairBatch& batch)
+{
+  for(auto& rp : batch.pairs)
+    mapPair(rp, batch.number);
+}
+
+//! Looks for fqfrag next to the best few of the anchors its mate mapped to, adds what we find to matches. Returns if we added anything
+bool ReadMapper::rescueNear(const vector<ReferenceChromosome::MatchDescriptor>& anchors, unsigned int anchorLength, FastQRead* fqfrag, 
+                            vector<ReferenceChromosome::MatchDescriptor>* matches)
+{
+  bool ret = false;
+  unsigned int tried = 0;
+  ReferenceChromosome::MatchDescriptor match;
+  for(const auto& anchor : anchors) {
+    if(anchor.score >= 5 || ++tried > 8)
+      continue;
+    if(rescueMate(anchor, anchorLength, fqfrag, d_model, d_qlimit, &match) &&
+       std::find_if(matches->begin(), matches->end(), [&match](const ReferenceChromosome::MatchDescriptor& md) {
+           return md.rg == match.rg && md.pos == match.pos;
+         }) == matches->end()) {
+      matches->push_back(match);
+      ret = true;
+    }
+  }
+  return ret;
+}
+
+void ReadMapper::mapPair(ReadPair& rp, uint64_t batchNumber)
+{
+  FastQRead& fqfrag1(rp.fqfrag[0]);
+  FastQRead& fqfrag2(rp.fqfrag[1]);
+  bool dup1(rp.dup[0]), dup2(rp.dup[1]);
+  vector<ReferenceChromosome::MatchDescriptor>* pairpositions = d_matches; // reused from pair to pair
+  pairpositions[0].clear();
+  pairpositions[1].clear();
+  bool searched[2]={false, false};
+  for(unsigned int paircount=0; paircount < 2; ++paircount) {
+    FastQRead& fqfrag(paircount ? fqfrag2 : fqfrag1);
+    total++;
+    stats.feed(fqfrag, rp.dup[paircount]);
+    if(rp.dup[paircount])
+      continue;
+
+    if(fqfrag.d_nucleotides.find('N') != string::npos) {
+      // unfoundReads.push_back(fqfrag.position); // will fail elsewhere and get filed there
+      withAny++;
+      continue;
+    }
+    getAllReadPosBoth(d_refgens, &fqfrag, &pairpositions[paircount]);
+    searched[paircount]=true;
+  }
+
+  // a mate without exact matches is looked for next to its partner first, and only then in the whole genome
+  bool wasRescued[2]={false, false};
+  for(unsigned int paircount=0; paircount < 2; ++paircount) {
+    if(!searched[paircount] || !pairpositions[paircount].empty())
+      continue;
+    FastQRead& fqfrag(paircount ? fqfrag2 : fqfrag1);
+    wasRescued[paircount] = rescueNear(pairpositions[1-paircount], (paircount ? fqfrag1 : fqfrag2).d_nucleotides.length(), &fqfrag, &pairpositions[paircount]);
+    if(!wasRescued[paircount])
+      fuzzyFind(&fqfrag, d_refgens, d_qlimit, &pairpositions[paircount]);
+  }
+    
+  const vector<PairResolver::Pair>* potMatch = &d_resolver.resolve(pairpositions[0], fqfrag1.d_nucleotides.length(), 
+                                                                   pairpositions[1], fqfrag2.d_nucleotides.length(), d_model);
+  // both mates map, but not together. In repeats, the right copy of a mate may not be among what we found for it
+  if(potMatch->empty() && searched[0] && searched[1]) {
+    bool more = false;
+    for(unsigned int paircount=0; paircount < 2; ++paircount) {
+      FastQRead& fqfrag(paircount ? fqfrag2 : fqfrag1);
+      if(rescueNear(pairpositions[1-paircount], (paircount ? fqfrag1 : fqfrag2).d_nucleotides.length(), &fqfrag, &pairpositions[paircount]))
+        more = wasRescued[paircount] = true;
+    }
+    if(more)
+      potMatch = &d_resolver.resolve(pairpositions[0], fqfrag1.d_nucleotides.length(), 
+                                     pairpositions[1], fqfrag2.d_nucleotides.length(), d_model);
+  }
+  if(!potMatch->empty()) {
+    KeyedRandom rng(fqfrag1.getChoiceKey(), d_seed);
+    const auto& chosen = pickRandom(*potMatch, rng);
+    goodPairMatches++;
+    rescued += wasRescued[0] + wasRescued[1]; // only now do we know the rescued mates are in a good pair
+    int distance = chosen.insert;
+
+    if(distance >= 0 && potMatch->size() == 1) // a random pick from repeats would teach us noise
+      inserts(distance);
+    for(int paircount = 0 ; paircount < 2; ++paircount) {
+      auto fqfrag = paircount ? &fqfrag2 : &fqfrag1;
+      auto dup = paircount ? dup2 : dup1,
+	otherDup = paircount? dup1 : dup2;
+      dnapos_t pos = paircount ? chosen.second.pos : chosen.first.pos;
+
+      if((paircount ? chosen.second.reverse : chosen.first.reverse) != fqfrag->reversed)
+	fqfrag->reverse();
+
+      if(otherDup && !dup) {
+	MapToReference(*chosen.second.rg, tally(chosen.second.rg), pos, *fqfrag, d_qlimit, bamQueue(), &qqcounts);
+      }
+      else if(!otherDup && !dup) {
+	dnapos_t mappedPos;
+	if(MapToReference(*chosen.second.rg, tally(chosen.second.rg), pos, *fqfrag, d_qlimit, 0, &qqcounts, &mappedPos, &d_cigar) && d_writeBAM) {
+	  BAMWriter::qwrite(&d_bamQueue, mappedPos, *fqfrag, d_cigar, 3 + (paircount ? 0x80 : 0x40),
+			    "=", 
+			    paircount ? chosen.first.pos : chosen.second.pos, 
+			    (chosen.first.reverse ^ (bool)paircount) ? -distance : distance);
+	}
+      }
+      found++;
+    }
+  }
+  else {
+    //      cout<<"No pair matches, need to map individually: "<<endl;
+    badPairMatches++;
+    for(unsigned int paircount = 0; paircount < 2; ++paircount) {
+      if(paircount ? dup2 : dup1)
+	continue;
+	
+      FastQRead* fqfrag = paircount ? &fqfrag2 : &fqfrag1;
+      if(pairpositions[paircount].empty()) {
+	d_unfoundReads.push_back({batchNumber, fqfrag->position});
+	continue;
+      }
+      // the best scoring matches, in the order we found them
+      int best = std::min_element(pairpositions[paircount].begin(), pairpositions[paircount].end(), 
+				  [](const ReferenceChromosome::MatchDescriptor& a, const ReferenceChromosome::MatchDescriptor& b) {
+				    return a.score < b.score;
+				  })->score;
+      d_best.clear();
+      for(const auto& match : pairpositions[paircount])
+	if(match.score == best)
+	  d_best.push_back(match);
+      KeyedRandom rng(fqfrag->getChoiceKey(), d_seed);
+      auto pick = pickRandom(d_best, rng);
+
+      if(fqfrag->reversed != pick.reverse)
+	fqfrag->reverse();
+
+      MapToReference(*pick.rg, tally(pick.rg), pick.pos, *fqfrag, d_qlimit, bamQueue(), &qqcounts);
+      found++;
+    }
+  } 
+}
+
+void ReadMapper::merge(ReadMapper& rhs)
+{
+  withAny += rhs.withAny;
+  found += rhs.found;
+  total += rhs.total;
+  goodPairMatches += rhs.goodPairMatches;
+  badPairMatches += rhs.badPairMatches;
+  stats.merge(rhs.stats);
+  for(unsigned int q = 0; q < qqcounts.size() && q < rhs.qqcounts.size(); ++q) {
+    qqcounts[q].correct += rhs.qqcounts[q].correct;
+    qqcounts[q].incorrect += rhs.qqcounts[q].incorrect;
+  }
+  rescued += rhs.rescued;
+  inserts += rhs.inserts;
+
+  for(auto& t : d_tallies)
+    t.second.merge(rhs.tally(t.first));
+  d_bamQueue.insert(d_bamQueue.end(), rhs.d_bamQueue.begin(), rhs.d_bamQueue.end());
+  rhs.d_bamQueue.clear();
+  d_unfoundReads.insert(d_unfoundReads.end(), rhs.d_unfoundReads.begin(), rhs.d_unfoundReads.end());
+  rhs.d_unfoundReads.clear();
+}
 
-void doInitialReadStatistics(FILE* jsfp, const string& fname, StereoFASTQReader& fastq, vector<unsigned int>* recommendIndex, unsigned int* maxreadlen, unsigned int *recommendBeginSnip=0, unsigned int* recommendEndSnip=0)
+void ReadMapper::commit(BAMWriter& sbw)
+{
+  for(auto& t : d_tallies) 
+    t.first->merge(t.second);
+  sbw.mergeQueue(d_bamQueue);
+}
+
+vector<uint64_t> ReadMapper::getUnfoundReads()
+{
+  stable_sort(d_unfoundReads.begin(), d_unfoundReads.end(), [](const pair<uint64_t,uint64_t>& a, const pair<uint64_t,uint64_t>& b) {
+      return a.first < b.first;
+    });
+  vector<uint64_t> ret;
+  ret.reserve(d_unfoundReads.size());
+  for(const auto& u : d_unfoundReads)
+    ret.push_back(u.second);
+  return ret;
+}
+
+
+
+//! primeInsertSizes looks at no more than this many pairs from the start of the input, whatever --scan-pairs says
+const uint64_t c_primePairs = 50000;
+
+/** The insert size model all ReadMapper s share. We learn it before mapping, from the pairs among the first c_primePairs 
+    of which both mates have exact matches that pair up in only one way, and stop once c_primeSamples did. Had every mapper 
+    learn as it went, a pair would be judged by whatever its thread had seen so far, and so the output would depend on 
+    the number of threads and on where in the input the pair was. Leaves fastq at the start */
+InsertSizeModel primeInsertSizes(vector<unique_ptr<ReferenceChromosome> >& refgens, StereoFASTQReader& fastq, uint64_t* used)
+{
+  const uint64_t c_primeSamples = 20000;
+  InsertSizeModel model;
+  PairResolver resolver;
+  FastQRead fqfrag[2];
+  vector<ReferenceChromosome::MatchDescriptor> matches[2];
+  uint64_t counter = 0;
+  *used = 0;
+  while(counter < c_primePairs && *used < c_primeSamples && fastq.getReadPair(&fqfrag[0], &fqfrag[1])) {
+    ++counter;
+    if(fqfrag[0].d_nucleotides.find('N') != string::npos || fqfrag[1].d_nucleotides.find('N') != string::npos)
+      continue;
+    for(unsigned int paircount = 0; paircount < 2; ++paircount) {
+      matches[paircount].clear();
+      getAllReadPosBoth(refgens, &fqfrag[paircount], &matches[paircount]);
+    }
+    const auto& pairs = resolver.resolve(matches[0], fqfrag[0].d_nucleotides.length(), matches[1], fqfrag[1].d_nucleotides.length(), model);
+    if(pairs.size() == 1 && pairs[0].insert >= 0) {
+      model(pairs[0].insert);
+      ++*used;
+    }
+  }
+  fastq.seek(0);
+  return model;
+}
+
+/** Samples every 11th read pair to pick trims and the maximum read length. With maxPairs set, we only look at the first maxPairs pairs,
+    so on big (or gzipped) inputs the mapping pass is the only one that reads everything. Reads longer than what we saw are fine, per position
+    statistics just don't count their tail. Rewinds fastq when done */
+void doInitialReadStatistics(FILE* jsfp, const string& fname, StereoFASTQReader& fastq, uint64_t maxPairs, unsigned int* maxreadlen, unsigned int *recommendBeginSnip=0, unsigned int* recommendEndSnip=0)
 {
   FastQRead fqfrag1, fqfrag2;
   vector<uint32_t> lengths;
@@ -967,19 +1339,20 @@ void doInitialReadStatistics(FILE* jsfp, const string& fname, StereoFASTQReader&
   for(auto& kmers : kmerMappings) 
     kmers.resize(256); // 4^4, corresponds to the '4' below
   
-  (*g_log)<<"Scanning FASTQ input to determine trim optima and indexation parameters"<<endl;
-  uint64_t totalReads=0;
+  if(maxPairs)
+    (*g_log)<<"Scanning the first "<<maxPairs<<" read pairs of the FASTQ input to determine trim optima and indexation parameters"<<endl;
+  else
+    (*g_log)<<"Scanning FASTQ input to determine trim optima and indexation parameters"<<endl;
 
-  boost::progress_display show_progress(filesize(fname.c_str()), cerr);
+  boost::progress_display show_progress(maxPairs ? maxPairs : filesize(fname.c_str()), cerr);
   unsigned int bytes;
-  unsigned int counter=0;
-  while((bytes=fastq.getReadPair(&fqfrag1, &fqfrag2))) {
-    show_progress+=bytes;
+  uint64_t counter=0;
+  while((!maxPairs || counter < maxPairs) && (bytes=fastq.getReadPair(&fqfrag1, &fqfrag2))) {
+    show_progress+= maxPairs ? 1 : bytes;
     if((++counter%11)) 
       continue;
     safeIncVec(lengths, fqfrag1.d_nucleotides.length());
     safeIncVec(lengths, fqfrag2.d_nucleotides.length());
-    totalReads+=2;
 
     for(int n=0; n < 2; ++n) {
       FastQRead* fqfrag = n ? &fqfrag1 : &fqfrag2;
@@ -996,22 +1369,9 @@ void doInitialReadStatistics(FILE* jsfp, const string& fname, StereoFASTQReader&
     }
   }
 
-  multimap<uint32_t, uint32_t> lenstats;
   *maxreadlen=0;
-  for(auto iter = lengths.cbegin(); iter != lengths.cend(); ++iter) {
-    lenstats.insert(make_pair(*iter, iter - lengths.cbegin())); // amount, length
+  for(auto iter = lengths.cbegin(); iter != lengths.cend(); ++iter)
     *maxreadlen = max(*maxreadlen, (unsigned int)(iter - lengths.cbegin()));
-  }
-
-  uint64_t cumul=0;
-  int num=0;
-  for(auto iter = lenstats.crbegin(); iter != lenstats.crend() && num < 3; ++iter, ++num) {
-    cumul+=iter->first;
-    (*g_log) << cumul*100.0/totalReads<<"% covered after indexing "<<iter->second<<endl;
-    recommendIndex->push_back(iter->second);
-    if(cumul > 0.99*totalReads)
-      break;
-  }
   fastq.seek(0);
 
   fprintf(jsfp, "var kmerstats=[");
@@ -1062,8 +1422,6 @@ void doInitialReadStatistics(FILE* jsfp, const string& fname, StereoFASTQReader&
       (*g_log)<<"Put the begin trim at: "<<n+1<<endl;
       if(recommendBeginSnip) {
 	*recommendBeginSnip=n+1;
-	for(auto& i: *recommendIndex)
-	  i-=*recommendBeginSnip;
 	*maxreadlen-=*recommendBeginSnip;
       }
       break;
@@ -1078,7 +1436,6 @@ try
 #ifdef __linux__
   feenableexcept(FE_DIVBYZERO | FE_INVALID); 
 #endif 
-  srand(time(0));  
   TCLAP::CmdLine cmd("Command description message", ' ', "g" + string(g_gitHash));
 
   TCLAP::MultiArg<std::string> annotationsArg("a","annotations","read annotations for reference genome from this file",false, "filename", cmd);
@@ -1099,10 +1456,15 @@ try
   TCLAP::SwitchArg skipVariableSwitch("","skip-variable","Do not emit variable regions", cmd, false);
   TCLAP::SwitchArg skipInsertsSwitch("","skip-inserts","Do not emit inserts", cmd, false);
   TCLAP::SwitchArg excludePhiXSwitch("p","exclude-phix","Exclude PhiX automatically",cmd, false);
+  TCLAP::SwitchArg noIndexFilesSwitch("","no-index-files","Do not read or write index files next to the reference FASTA and gzipped FASTQ", cmd, false);
+  TCLAP::ValueArg<int> threadsArg("t","threads","Number of threads to map reads with",false, 1,"threads", cmd);
+  TCLAP::ValueArg<uint64_t> scanPairsArg("","scan-pairs","Pick trims from the first this many read pairs instead of the whole input. 0 scans everything. Insert sizes are learned from the first "+to_string(c_primePairs)+" pairs regardless",false, 250000,"pairs", cmd);
+  TCLAP::ValueArg<unsigned int> seedArg("s","seed","Seed for picking between equally good mappings, for reproducible runs. Default is based on the time",false, 0,"seed", cmd);
 
   cmd.parse( argc, argv );
 
   unsigned int qlimit = qlimitArg.getValue();
+  uint32_t seed = seedArg.isSet() ? seedArg.getValue() : time(0);
 
   ostringstream jsonlog;  
   TeeDevice td(cerr, jsonlog);
@@ -1132,24 +1494,19 @@ try
   }
   //  (*g_log)<<"Current time: "<< std::put_time(std::localtime(&system_clock::now()), "%F %T")<<endl;
   
-  StereoFASTQReader fastq(fastq1Arg.getValue(), fastq2Arg.getValue(), qualityOffsetArg.getValue());
+  unsigned int numThreads = max(1, threadsArg.getValue());
+  // BGZF inputs get --threads inflate workers in all, half for each file
+  StereoFASTQReader fastq(fastq1Arg.getValue(), fastq2Arg.getValue(), qualityOffsetArg.getValue(), !noIndexFilesSwitch.getValue(),
+			  max(1U, numThreads/2));
 
   (*g_log)<<"FASTQ Input from '"<<fastq1Arg.getValue()<<"' and '"<<fastq2Arg.getValue()<<"'"<<endl;
   unique_ptr<FILE, int(*)(FILE*)> jsfp(fopen("data.js","w"), fclose);
-  vector<unsigned int> indexLengths;
   unsigned int maxreadsize=0;
   unsigned int beginTrim=beginSnipArg.getValue(), endTrim= endSnipArg.getValue();
-  doInitialReadStatistics(jsfp.get(), fastq1Arg.getValue(), fastq, &indexLengths, &maxreadsize, beginTrim ? 0 :&beginTrim, endTrim ? 0 : &endTrim);
+  doInitialReadStatistics(jsfp.get(), fastq1Arg.getValue(), fastq, scanPairsArg.getValue(), &maxreadsize, beginTrim ? 0 :&beginTrim, endTrim ? 0 : &endTrim);
   fastq.setTrim(beginTrim, endTrim);
   (*g_log)<<"Trimming "<<beginTrim<<" from beginning of reads, "<<endTrim<<" from end of reads"<<endl;
 
-  unsigned int bytes=0;
-  FastQRead fqfrag1, fqfrag2;
-
-
-  bytes=fastq.getReadPair(&fqfrag1, &fqfrag2); // get a read to index based on its size
-  int keylen=11;
-
   fputs("var genomes=[];\n", jsfp.get());
 
   vector<unique_ptr<ReferenceChromosome> > refgens;
@@ -1159,9 +1516,8 @@ try
     double genomeGCRatio = 1.0*(rg->d_cCount + rg->d_gCount)/(rg->d_cCount + rg->d_gCount + rg->d_aCount + rg->d_tCount);
 
     (*g_log)<<"Read FASTA reference genome of '"<<rg->d_fullname<<"', "<<rg->size()<<" nucleotides from '"<<fname<<"' (GC = "<<genomeGCRatio<<")"<<endl;
-    for(auto i : indexLengths)
-      rg->index(i);
-    rg->index(keylen);
+    rg->setMaxReadLength(maxreadsize);
+    rg->index(!noIndexFilesSwitch.getValue(), numThreads);
     fprintf(jsfp.get(), "var genomeGCRatio=%f;\n", genomeGCRatio); // XXXmulti
 
     if(annotations != annotationsArg.getValue().end()) {
@@ -1179,8 +1535,8 @@ try
     auto rg = ReferenceChromosome::makeFromString(phiXFastA);
     double genomeGCRatio = 1.0*(rg->d_cCount + rg->d_gCount)/(rg->d_cCount + rg->d_gCount + rg->d_aCount + rg->d_tCount);
     (*g_log)<<"Read FASTA reference genome of '"<<rg->d_fullname<<"', "<<rg->size()<<" nucleotides from builtin (GC = "<<genomeGCRatio<<")"<<endl;
-    rg->index(maxreadsize);
-    rg->index(keylen);
+    rg->setMaxReadLength(maxreadsize);
+    rg->index(false, numThreads);
 
     auto gar = new GeneAnnotationReader("./phix.gff");
     (*g_log)<<"Done reading "<<gar->size()<<" annotations from builtin"<<endl;
@@ -1201,157 +1557,131 @@ try
   }
   else if(duplimit > 0)
     (*g_log)<<"Duplicate reads filtered beyond "<<duplimit<<" copies"<<endl;
+  if(duplimit > 254) {
+    (*g_log)<<"Duplicate filter counts up to 255 copies, so filtering beyond 254"<<endl;
+    duplimit = 254;
+  }
+
+  uint64_t primed;
+  InsertSizeModel insertModel = primeInsertSizes(refgens, fastq, &primed);
+  if(insertModel.learned())
+    (*g_log) << (boost::format("Pairing mates by insert size %d (%d - %d), learned from %d pairs\n") % insertModel.median() % insertModel.low() % insertModel.high() % primed).str();
+  else
+    (*g_log) << "Only "<<primed<<" pairs to learn insert sizes from, pairing mates up to "<<insertModel.high()<<" apart"<<endl;
 
   g_log->flush();
-  dnapos_t pos;
 
-  uint64_t withAny=0, found=0, total=0, tooFrequent=0, goodPairMatches=0, badPairMatches=0,
-    qualityExcluded=0;
+  uint64_t tooFrequent=0, qualityExcluded=0;
 
   BAMWriter sbw(bamFileArg.getValue(), (*refgens.begin())->d_name, (*refgens.begin())->size()); // XXXmulti
 
-  (*g_log)<<"Performing matches of reads to reference genome"<<endl;
+  vector<unique_ptr<ReadMapper> > mappers;
+  for(unsigned int n = 0; n < numThreads; ++n)
+    mappers.emplace_back(new ReadMapper(refgens, insertModel, maxreadsize, qlimit, sbw.enabled(), seed));
+
+  (*g_log)<<"Performing matches of reads to reference genome";
+  if(numThreads > 1)
+    (*g_log)<<" using "<<numThreads<<" threads";
+  (*g_log)<<endl;
   boost::progress_display show_progress(filesize(fastq1Arg.getValue().c_str()), cerr);
- 
-
-  qstats_t qstats;
-  qstats.resize(maxreadsize);
-  VarMeanEstimator qstat;
-  vector<unsigned int> qcounts(256);
-  vector<uint64_t> unfoundReads;
-  vector<qtally> qqcounts(256);
-  vector<dnapos_t> gchisto(maxreadsize+1);
-
-  DuplicateCounter dc;
-  uint32_t theHash;
-  map<uint32_t, uint32_t> seenAlready;
-  vector<uint32_t> pairdisthisto;
-  vector<uint32_t> readlengths;
-  signal(SIGINT, pleaseQuitHandler);
 
-  do { 
-    if(g_pleaseQuit) 
-      break;
-    show_progress += bytes;
-    vector<ReferenceChromosome::MatchDescriptor > pairpositions[2];
-    bool dup1(false), dup2(false);
-    safeIncVec(readlengths, fqfrag1.d_nucleotides.length());
-    safeIncVec(readlengths, fqfrag2.d_nucleotides.length());
-    for(unsigned int paircount=0; paircount < 2; ++paircount) {
-      FastQRead& fqfrag(paircount ? fqfrag2 : fqfrag1);
-      total++;
-      for(string::size_type pos = 0 ; pos < fqfrag.d_quality.size(); ++pos) {
-	int i = fqfrag.d_quality[pos];
-	double err = qToErr(i);
-	qstat(err);
-	qstats[pos](err);
-	qcounts[i]++;
-      }
-      dc.feedString(fqfrag.d_nucleotides);
-      if(duplimit) {
-	theHash=qhash(fqfrag.d_nucleotides.c_str(), fqfrag.d_nucleotides.size(), 0);
-	if(++seenAlready[theHash] > (unsigned int)duplimit) {
-	  if(paircount)
-	    dup2=true;
-	  else
-	    dup1=true;
-	  tooFrequent++;
-	  continue;
-	}
-      }
-      
-      gchisto[round(fqfrag.d_nucleotides.size()*getGCContent(fqfrag.d_nucleotides))]++;
-      
-      if(fqfrag.d_nucleotides.find('N') != string::npos) {
-	// unfoundReads.push_back(fqfrag.position); // will fail elsewhere and get filed there
-	withAny++;
-	continue;
-      }
-      if((pairpositions[paircount]=getAllReadPosBoth(refgens, indexLengths, &fqfrag)).empty()) {
-	pairpositions[paircount]=fuzzyFind(&fqfrag, refgens, keylen, qlimit);
-      } 
-    }
-    
-    map<int, vector<pair<ReferenceChromosome::MatchDescriptor,ReferenceChromosome::MatchDescriptor> > > potMatch;
-    unsigned int matchCount=0;
-    for(auto& match1 : pairpositions[0]) {
-      for(auto& match2 : pairpositions[1]) {
-	if(match1.reverse != match2.reverse &&  abs((int64_t) match1.pos - (int64_t)match2.pos) < 1400) {
-	  potMatch[match1.score + match2.score].push_back({match1, match2});
-	  matchCount++;
-	}
-      }
-    }
-   
-    if(!potMatch.empty()) {
-      const auto& chosen = pickRandom(potMatch.begin()->second);
-      goodPairMatches++;
-      int distance = chosen.second.reverse ? 
-	(fqfrag1.d_nucleotides.length() + (int64_t) chosen.second.pos - (int64_t) chosen.first.pos) :
-	(fqfrag1.d_nucleotides.length() + (int64_t) chosen.first.pos - (int64_t) chosen.second.pos);
-
-      if(distance >= 0)
-	safeIncVec(pairdisthisto, distance);
-      for(int paircount = 0 ; paircount < 2; ++paircount) {
-	auto fqfrag = paircount ? &fqfrag2 : &fqfrag1;
-	auto dup = paircount ? dup2 : dup1,
-	  otherDup = paircount? dup1 : dup2;
-	pos = paircount ? chosen.second.pos : chosen.first.pos;
-
-
-	if((paircount ? chosen.second.reverse : chosen.first.reverse) != fqfrag->reversed)
-	  fqfrag->reverse();
-
-	if(otherDup && !dup) {
-	  MapToReference(*chosen.second.rg, pos, *fqfrag, qlimit, &sbw, &qqcounts);
-	}
-	else if(!otherDup && !dup) {
-	  int indel; 
-	  // XXX add amount here
-	  if(MapToReference(*chosen.second.rg, pos, *fqfrag, qlimit, 0, &qqcounts, &indel)) {
-	    sbw.qwrite(pos, *fqfrag, indel, 3 + (paircount ? 0x80 : 0x40),
-		     "=", 
-		     paircount ? chosen.first.pos : chosen.second.pos, 
-		       (chosen.first.reverse ^ (bool)paircount) ? -distance : distance);
+  BatchQueue batches(2*numThreads);
+  vector<std::thread> workers;
+  vector<std::exception_ptr> errors(numThreads);
+  if(numThreads > 1) {
+    for(unsigned int n = 0; n < numThreads; ++n) {
+      workers.emplace_back([&batches, &mappers, &errors, n]() {
+	  while(auto batch = batches.pop()) {
+	    if(errors[n]) // keep draining so the reader does not block
+	      continue;
+	    try {
+	      mappers[n]->mapBatch(*batch);
+	    }
+	    catch(...) {
+	      errors[n] = std::current_exception();
+	    }
+	    batches.recycle(move(batch));
 	  }
-	}
-	found++;
-      }
+	});
     }
+  }
+
+  const unsigned int batchSize=1024;
+  uint64_t batchNumber=0;
+  unique_ptr<ReadPairBatch> batch;
+  unsigned int used=0; // pairs of batch we read into, recycled batches have more
+  auto dispatch = [&]() {
+    batch->pairs.resize(used);
+    if(numThreads > 1)
+      batches.push(move(batch));
     else {
-      //      cout<<"No pair matches, need to map individually: "<<endl;
-      badPairMatches++;
-      for(unsigned int paircount = 0; paircount < 2; ++paircount) {
-	if(paircount ? dup2 : dup1)
-	  continue;
-	
-	map<int, vector<ReferenceChromosome::MatchDescriptor>> scores;
-	for(auto match: pairpositions[paircount]) {
-	  scores[match.score].push_back(match);
-	  //	  cout<<"\t"<<paircount<<"\t"<<match.pos<<" "<<match.reverse<<", score: "<<match.score<<endl;
-	}
-	FastQRead* fqfrag = paircount ? &fqfrag2 : &fqfrag1;
-	if(scores.empty()) {
-	  unfoundReads.push_back(fqfrag->position);
-	  continue;
-	}
-	auto pick = pickRandom(scores.begin()->second);
+      mappers[0]->mapBatch(*batch);
+      batches.recycle(move(batch));
+    }
+    batch.reset();
+    used=0;
+  };
+
+  unique_ptr<CountingHashTable<uint64_t> > seenAlready;
+  if(duplimit)
+    seenAlready.reset(new CountingHashTable<uint64_t>(fastq.estimateReads() + fastq.estimateReads()/4)); // estimates are rough
+  signal(SIGINT, pleaseQuitHandler);
 
-	if(fqfrag->reversed != pick.reverse)
-	  fqfrag->reverse();
+  // records are parsed in place, and copied once, into the strings the pair in the batch already has
+  auto readPair = [&](const FastQRecordView& view1, const FastQRecordView& view2) {
+    show_progress += view1.size;
+    if(!batch) {
+      batch = batches.spare();
+      batch->number = batchNumber++;
+      batch->pairs.reserve(batchSize);
+    }
+    if(used == batch->pairs.size())
+      batch->pairs.emplace_back();
+    auto& rp = batch->pairs[used++];
 
-	MapToReference(*pick.rg, pick.pos, *fqfrag, qlimit, &sbw, &qqcounts);
-	found++;
+    // the duplicate filter depends on the order of reads, so we do it here and not in the mapping threads.
+    // Duplicates get materialized too, their lengths and qualities still go into the read statistics
+    const FastQRecordView* views[2] = {&view1, &view2};
+    for(unsigned int paircount=0; paircount < 2; ++paircount) {
+      rp.dup[paircount] = false;
+      if(seenAlready) {
+	auto nucleotides = fastq.nucleotides(*views[paircount]);
+	if(seenAlready->increment(hash64(nucleotides.data(), nucleotides.size(), 0)) > duplimit) {
+	  rp.dup[paircount]=true;
+	  tooFrequent++;
+	}
       }
-    } 
-  } while((bytes=fastq.getReadPair(&fqfrag1, &fqfrag2)));
+      fastq.materialize(*views[paircount], &rp.fqfrag[paircount]);
+    }
+    if(used == batchSize)
+      dispatch();
+  };
+  while(!g_pleaseQuit && fastq.forEachPair(batchSize, readPair))
+    ;
   signal(SIGINT, SIG_DFL);
+  if(batch)
+    dispatch();
+  batches.close();
+  for(auto& w : workers)
+    w.join();
+  for(auto& e : errors)
+    if(e)
+      std::rethrow_exception(e);
+
+  for(auto iter = next(mappers.begin()); iter != mappers.end(); ++iter) 
+    mappers[0]->merge(**iter);
+  mappers.resize(1);
+  ReadMapper& mapped = *mappers[0];
+  mapped.commit(sbw);
+  auto unfoundReads = mapped.getUnfoundReads();
   
+  auto pairdisthisto = mapped.inserts.histogram();
   pairdisthisto.resize(1500); // outliers mess us up otherwise
   fputs(jsonVector(pairdisthisto, "var pairdisthisto").c_str(), jsfp.get());
-  fputs(jsonVector(readlengths, "var readlengths").c_str(), jsfp.get());
+  fputs(jsonVector(mapped.stats.readLengths(), "var readlengths").c_str(), jsfp.get());
 
-  uint64_t totNucleotides=total*maxreadsize; // XXX very wrong
+  uint64_t totNucleotides=mapped.total*maxreadsize; // XXX very wrong
+  auto qcounts = mapped.stats.qualityCounts();
   fprintf(jsfp.get(), "qhisto=[");
   for(int c=0; c < 50; ++c) {
     fprintf(jsfp.get(), "%s[%d,%f]", c ? "," : "", (int)c, 1.0*qcounts[c]/totNucleotides);
@@ -1359,23 +1689,23 @@ try
   fprintf(jsfp.get(),"];\n");
 
   fprintf(jsfp.get(), "var dupcounts=[");
-  auto duplicates = dc.getCounts();
+  auto duplicates = mapped.stats.duplicates().getCounts();
   for(auto iter = duplicates.begin(); iter != duplicates.end(); ++iter) {
-    fprintf(jsfp.get(), "%s[%" PRIu64 ",%f]", (iter!=duplicates.begin()) ? "," : "", iter->first, 1.0*iter->second/total);
+    fprintf(jsfp.get(), "%s[%" PRIu64 ",%f]", (iter!=duplicates.begin()) ? "," : "", iter->first, 1.0*iter->second/mapped.total);
   }
   fprintf(jsfp.get(),"];\n");
-  dc.clear(); // might save some memory..
 
-  dnapos_t totalhisto= accumulate(gchisto.begin(), gchisto.end(), 0);
+  const auto& gchisto = mapped.stats.gcHistogram();
+  uint64_t totalhisto= accumulate(gchisto.begin(), gchisto.end(), (uint64_t)0);
   fputs(jsonVector(gchisto, "var gcreadhisto",  
-		   [totalhisto](dnapos_t c){return 1.0*c/totalhisto;},
+		   [totalhisto](uint64_t c){return 1.0*c/totalhisto;},
 		   [&maxreadsize](int i) { return 100.0*i/maxreadsize;}   ).c_str(),  // XXX wrong scaling
 	jsfp.get());
 
   unsigned int numRef=0;
   for(auto& rg : refgens) {
     fprintf(jsfp.get(), "genomes[%d]={};\n", numRef);
-    fputs(jsonVector(rg->getGCHisto(), ("genomes["+lexical_cast<string>(numRef)+"].gcrefhisto").c_str(),  
+    fputs(jsonVector(rg->getGCHisto(maxreadsize), ("genomes["+lexical_cast<string>(numRef)+"].gcrefhisto").c_str(),  
 		     [&maxreadsize,&rg](dnapos_t c){return 1.0*c/(rg->size()/maxreadsize);},
 		     [&maxreadsize](int i) { return 100.0*i/maxreadsize;}   ).c_str(),  // XXX wrong scaling
 	  jsfp.get());
@@ -1384,31 +1714,46 @@ try
     numRef++;
   }
 
-  (*g_log) << (boost::format("Total reads: %|40t| %10d (%.2f gigabps)") % total % (totNucleotides/1000000000.0)).str() <<endl;
+  (*g_log) << (boost::format("Total reads: %|40t| %10d (%.2f gigabps)") % mapped.total % (totNucleotides/1000000000.0)).str() <<endl;
   (*g_log) << (boost::format("Quality excluded: %|40t|-%10d") % qualityExcluded).str() <<endl;
-  (*g_log) << (boost::format("Ignored reads with N: %|40t|-%10d") % withAny).str()<<endl;
+  (*g_log) << (boost::format("Ignored reads with N: %|40t|-%10d") % mapped.withAny).str()<<endl;
   if(duplimit)
-    (*g_log) << (boost::format("Too frequent reads: %|40t| %10d (%.02f%%)") % tooFrequent % (100.0*tooFrequent/total)).str() <<endl;
-  (*g_log) << (boost::format("Full matches: %|40t|-%10d (%.02f%%)\n") % found % (100.0*found/total)).str();
-  (*g_log) << (boost::format(" Reads matched in a good pair: %|40t| %10d\n") % (goodPairMatches*2)).str();
-  (*g_log) << (boost::format(" Reads not matched, bad pair: %|40t| %10d\n") % (badPairMatches*2)).str();
-
-  (*g_log) << (boost::format("Not fully matched: %|40t|=%10d (%.02f%%)\n") % unfoundReads.size() % (unfoundReads.size()*100.0/total)).str();
-  (*g_log) << (boost::format("Mean Q: %|40t|    %10.2f +- %.2f\n") % (-10.0*log10(mean(qstat))) 
-	       % sqrt(-10.0*log10(variance(qstat)) )).str();
+    (*g_log) << (boost::format("Too frequent reads: %|40t| %10d (%.02f%%)") % tooFrequent % (100.0*tooFrequent/mapped.total)).str() <<endl;
+  if(seenAlready && seenAlready->overflowed())
+    (*g_log) << (boost::format("Duplicate filter full, reads not filtered: %|40t| %10d") % seenAlready->overflowed()).str() <<endl;
+  (*g_log) << (boost::format("Full matches: %|40t|-%10d (%.02f%%)\n") % mapped.found % (100.0*mapped.found/mapped.total)).str();
+  (*g_log) << (boost::format(" Reads matched in a good pair: %|40t| %10d\n") % (mapped.goodPairMatches*2)).str();
+  (*g_log) << (boost::format("  Of which rescued next to their mate: %|40t| %10d\n") % mapped.rescued).str();
+  if(mapped.inserts.learned())
+    (*g_log) << (boost::format(" Insert size median, range: %|40t| %10d (%d - %d)\n") % mapped.inserts.median() % mapped.inserts.low() % mapped.inserts.high()).str();
+  (*g_log) << (boost::format(" Reads not matched, bad pair: %|40t| %10d\n") % (mapped.badPairMatches*2)).str();
+
+  (*g_log) << (boost::format("Not fully matched: %|40t|=%10d (%.02f%%)\n") % unfoundReads.size() % (unfoundReads.size()*100.0/mapped.total)).str();
+  auto qerrors = mapped.stats.errors();
+  (*g_log) << (boost::format("Mean Q: %|40t|    %10.2f +- %.2f\n") % (-10.0*log10(mean(qerrors))) 
+	       % sqrt(-10.0*log10(variance(qerrors)) )).str();
+  const auto& dupsketch = mapped.stats.duplicates();
+  (*g_log) << (boost::format("Distinct reads (estimate): %|40t| %10.0f (%.02f%%)\n") % dupsketch.distinct() % (100.0*dupsketch.distinct()/dupsketch.total())).str();
+  unsigned int shown = 0;
+  for(const auto& hh : dupsketch.heavyHitters()) {
+    if(hh.count*1000 < dupsketch.total() || ++shown > 5) // only reads that make up more than 0.1%
+      break;
+    (*g_log) << (boost::format(" Frequent read, seen at least: %|40t| %10d %s\n") % hh.count % hh.nucleotides).str();
+  }
 
-  seenAlready.clear();
+  seenAlready.reset();
 
   for(auto& rg : refgens) {  // XXXmulti - the 'found' should be per GC, not global!
     for(auto& i : rg->d_correctMappings) {
-      i=found;
+      i=mapped.found;
     }
   }
-  printQualities(jsfp.get(), qstats);
+  printQualities(jsfp.get(), mapped.stats.errorsPerPosition());
+  fastq.advise(LineReader::Access::Random); // from here on we only fetch reads by position
 
   if(!bamFileArg.getValue().empty()) {
     (*g_log) << "Writing sorted & indexed BAM file to '"<< bamFileArg.getValue()<<"'"<<endl;
-    sbw.runQueue(fastq);
+    sbw.runQueue(fastq, numThreads);
   }
   if(unmatchedDumpSwitch.getValue())
     writeUnmatchedReads(unfoundReads, fastq);
@@ -1427,14 +1772,14 @@ try
     }
     else {
       for(auto unmCl : cl.d_clusters) {
-	string report=makeReport(*rg, pos, rg->d_locimap[pos], -1);
+	string report=makeReport(*rg, unmCl.getBegin(), -1);
 	emitRegion(jsfp.get(), *rg, fastq, "Undermatched", index++, unmCl.getBegin()-100, unmCl.getEnd()+100, report);
       }
     }
     printCorrectMappings(jsfp.get(), *rg, "genomes["+lexical_cast<string>(numRef)+"].referenceQ");
     fprintf(jsfp.get(), "genomes[%d].qqdata=[", numRef);
     bool printedYet=false;
-    for(auto coinco = qqcounts.begin() ; coinco != qqcounts.end(); ++coinco) {
+    for(auto coinco = mapped.qqcounts.begin() ; coinco != mapped.qqcounts.end(); ++coinco) {
       if(coinco->incorrect || coinco->correct) {
 	double qscore;
 	if(coinco->incorrect && coinco->correct)
@@ -1446,7 +1791,7 @@ try
 	
 	fprintf(jsfp.get(), "%s[%u, %f, %" PRIu64 "]", 
 		printedYet ?  "," : "", 
-		(unsigned int)(coinco - qqcounts.begin()), qscore,
+		(unsigned int)(coinco - mapped.qqcounts.begin()), qscore,
 		coinco->incorrect + coinco->correct);
 	printedYet=true;
       }
@@ -1458,12 +1803,15 @@ try
       bool operator()(const unsigned int&a, const unsigned int&b) const
       { return a > b;} 
     };
-    (*g_log)<<"Found "<<rg->d_insertCounts.size()<<" loci with at least one insert in a read"<<endl;
+    (*g_log)<<"Found "<<rg->d_inserts.size()<<" loci with at least one insert in a read"<<endl;
     map<unsigned int, vector<dnapos_t>, revsort> topInserts;
     unsigned int significantInserts=0;
-    for(const auto& insloc : rg->d_insertCounts) {
-      topInserts[insloc.second].push_back(insloc.first);
-      if(insloc.second > 4)
+    for(const auto& insloc : rg->d_inserts) {
+      unsigned int count=0;
+      for(const auto& insert : insloc.second)
+	count += insert.second;
+      topInserts[count].push_back(insloc.first);
+      if(count > 4)
 	significantInserts++;
     }
     (*g_log)<<"Found "<<significantInserts<<" significant inserts"<<endl;
@@ -1483,12 +1831,12 @@ try
 	int maxVarcount=0;
 	for(auto& locus : cluster.d_members) {
 	  double fraction=0;
-	  int varcount=variabilityCount(*rg, locus.pos, locus.locistat, &fraction);
+	  int varcount=variabilityCount(*rg, locus.pos, &fraction);
 	  maxVarcount = max(varcount, maxVarcount);
 	  //if(varcount < 3) 
 	  //  continue;
 	  significantlyVariable++;
-	  string report = makeReport(*rg, locus.pos, locus.locistat, fraction);
+	  string report = makeReport(*rg, locus.pos, fraction);
 	  reports.push_back({report, locus.pos});  
 	}
 	if(!reports.empty()) {
@@ -1514,7 +1862,7 @@ try
 	if(insert.first < 3)
 	  break;
 	for(const auto& position : insert.second) {
-	  auto theReport = makeReport(*rg, position, rg->d_locimap[position], 0);
+	  auto theReport = makeReport(*rg, position, 0);
 	  emitRegion(jsfp.get(), *rg, fastq, "Insert", index++, position, theReport);
 	}
       }
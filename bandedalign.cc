@@ -0,0 +1,179 @@
+#include "bandedalign.hh"
+#include "dnamisc.hh"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+using std::string;
+
+namespace {
+/* One 64 row block of a column of Myers' algorithm. Pv and Mv are the positive and negative vertical deltas
+   of the previous column, and become those of this column. hin is the horizontal delta coming in at the
+   top of the block, we return the one going out at the bottom. Also returns the horizontal deltas of the
+   rows in this block in ph and mh, bit i being the delta of row i+1 */
+inline int advanceBlock(uint64_t* pv, uint64_t* mv, uint64_t eq, int hin, uint64_t* ph, uint64_t* mh)
+{
+  const uint64_t hinNeg = hin < 0 ? 1 : 0;
+  uint64_t xv = eq | *mv;
+  eq |= hinNeg;
+  uint64_t xh = (((eq & *pv) + *pv) ^ *pv) | eq;
+  *ph = *mv | ~(xh | *pv);
+  *mh = *pv & xh;
+  int hout = (*ph >> 63) - (*mh >> 63);
+  uint64_t phs = (*ph << 1) | (hin > 0 ? 1 : 0);
+  uint64_t mhs = (*mh << 1) | hinNeg;
+  *pv = mhs | ~(xv | phs);
+  *mv = phs & xv;
+  return hout;
+}
+
+inline bool sameNucleotide(char a, char b)
+{
+  int code = nucleotideCode(a);
+  return code >= 0 && code == nucleotideCode(b);
+}
+}
+
+//! edit distance of the first row nucleotides of the read to the best alignment ending at this column
+int BandedAligner::score(unsigned int row, unsigned int column) const
+{
+  const uint64_t* pv = &d_pv[column * d_words];
+  const uint64_t* mv = &d_mv[column * d_words];
+  int ret = 0;
+  unsigned int w = 0;
+  for(; w < row / 64; ++w)
+    ret += __builtin_popcountll(pv[w]) - __builtin_popcountll(mv[w]);
+  if(row % 64) {
+    uint64_t mask = (1ULL << (row % 64)) - 1;
+    ret += __builtin_popcountll(pv[w] & mask) - __builtin_popcountll(mv[w] & mask);
+  }
+  return ret;
+}
+
+unsigned int BandedAligner::align(const std::string& read, const std::string& reference, unsigned int expectedStart)
+{
+  const unsigned int m = read.size(), n = reference.size();
+  d_script.clear();
+  d_start = 0;
+  if(!m) {
+    d_distance = 0;
+    return 0;
+  }
+
+  d_words = (m + 63) / 64;
+  d_peq.assign(5 * d_words, 0); // code 4 matches nothing, not even an N
+  for(unsigned int i = 0; i < m; ++i) {
+    int code = nucleotideCode(read[i]);
+    if(code >= 0)
+      d_peq[code * d_words + i / 64] |= 1ULL << (i % 64);
+  }
+
+  if(d_pv.size() < (n + 1) * d_words) {
+    d_pv.resize((n + 1) * d_words);
+    d_mv.resize((n + 1) * d_words);
+  }
+  std::fill(d_pv.begin(), d_pv.begin() + d_words, ~0ULL); // before the reference, row i costs i
+  std::fill(d_mv.begin(), d_mv.begin() + d_words, 0);
+
+  const uint64_t lastBit = 1ULL << ((m - 1) % 64);
+  const int64_t expectedEnd = (int64_t)expectedStart + m;
+  int current = m, best = m;
+  unsigned int bestColumn = 0;
+  uint64_t ph = 0, mh = 0;
+  for(unsigned int j = 1; j <= n; ++j) {
+    int code = nucleotideCode(reference[j - 1]);
+    const uint64_t* eq = &d_peq[(code < 0 ? 4 : code) * d_words];
+    uint64_t* pv = &d_pv[j * d_words];
+    uint64_t* mv = &d_mv[j * d_words];
+    const uint64_t* prevPv = pv - d_words;
+    const uint64_t* prevMv = mv - d_words;
+    int hin = 0; // the read may start anywhere, so row 0 is free
+    for(unsigned int w = 0; w < d_words; ++w) {
+      pv[w] = prevPv[w];
+      mv[w] = prevMv[w];
+      hin = advanceBlock(&pv[w], &mv[w], eq[w], hin, &ph, &mh);
+    }
+    // ph and mh are still those of the last word
+    if(ph & lastBit)
+      ++current;
+    else if(mh & lastBit)
+      --current;
+    if(current < best || (current == best && llabs((int64_t)j - expectedEnd) < llabs((int64_t)bestColumn - expectedEnd))) {
+      best = current;
+      bestColumn = j;
+    }
+  }
+  d_distance = best;
+
+  // trace back from the best column. We extend gaps we are in, and otherwise prefer diagonals, so indels
+  // come out as few gaps as we can, pushed to the start of the read
+  unsigned int i = m, j = bestColumn;
+  int cost = best;
+  auto push = [this](Edit::Op op) {
+    if(!d_script.empty() && d_script.back().op == op)
+      d_script.back().length++;
+    else
+      d_script.push_back({op, 1});
+  };
+  auto inGap = [this](Edit::Op op) { return !d_script.empty() && d_script.back().op == op; };
+  while(i > 0) {
+    if(inGap(Edit::Delete) && j > 0 && score(i, j - 1) + 1 == cost) {
+      push(Edit::Delete);
+      --j;
+      --cost;
+      continue;
+    }
+    if(inGap(Edit::Insert) && score(i - 1, j) + 1 == cost) {
+      push(Edit::Insert);
+      --i;
+      --cost;
+      continue;
+    }
+    if(j > 0) {
+      bool same = sameNucleotide(read[i - 1], reference[j - 1]);
+      if(score(i - 1, j - 1) + (same ? 0 : 1) == cost) {
+        push(same ? Edit::Match : Edit::Mismatch);
+        cost -= same ? 0 : 1;
+        --i;
+        --j;
+        continue;
+      }
+    }
+    if(score(i - 1, j) + 1 == cost) {
+      push(Edit::Insert);
+      --i;
+    }
+    else {
+      push(Edit::Delete);
+      --j;
+    }
+    --cost;
+  }
+  d_start = j;
+  std::reverse(d_script.begin(), d_script.end());
+  return d_distance;
+}
+
+unsigned int BandedAligner::referenceLength() const
+{
+  unsigned int ret = 0;
+  for(const auto& e : d_script)
+    if(e.op != Edit::Insert)
+      ret += e.length;
+  return ret;
+}
+
+void BandedAligner::cigar(std::string* out) const
+{
+  out->clear();
+  char buf[16];
+  auto cigarOp = [](const Edit& e) { return e.op == Edit::Insert || e.op == Edit::Delete ? (char)e.op : 'M'; };
+  for(auto iter = d_script.begin(); iter != d_script.end(); ) {
+    char op = cigarOp(*iter);
+    uint32_t length = 0;
+    for(; iter != d_script.end() && cigarOp(*iter) == op; ++iter)
+      length += iter->length;
+    int len = snprintf(buf, sizeof(buf), "%u%c", length, op);
+    out->append(buf, len);
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/** Bit-parallel edit distance alignment of a read against a window of reference, after Myers (1999) and
+    Hyyrö's multi-word extension. All of the read is aligned, but it may start and end anywhere in the window, 
+    so handing us the reference from a band of nucleotides before where you expect the read to a band beyond 
+    it finds indels of up to that band. The only band is that window: we do not restrict ourselves to diagonals
+    near expectedStart, every column of the window gets computed, a full semi-global alignment.
+
+    So a call costs n * ceil(m/64) word steps for a read of m against a window of n nucleotides, and keeps all
+    of those columns, 16 bytes per word, to trace back from. For a 150 nucleotide read that is 3 words per
+    reference nucleotide, or some 67KB for the 1400 nucleotides of a mate rescue window. 
+
+    After align() there is an edit script from which we make a CIGAR string. An aligner keeps its buffers
+    between calls, so keep one around (per thread) and alignments do not allocate. */
+class BandedAligner
+{
+public:
+  //! A run of identical edit operations. Insert means the read has nucleotides the reference does not have
+  struct Edit
+  {
+    enum Op : char { Match='=', Mismatch='X', Insert='I', Delete='D' };
+    Op op;
+    uint32_t length;
+  };
+
+  //! aligns all of read to part of reference, returns the edit distance. Ties go to the alignment that starts closest to expectedStart
+  unsigned int align(const std::string& read, const std::string& reference, unsigned int expectedStart=0);
+  unsigned int distance() const { return d_distance; }
+  //! offset in the reference where the alignment starts
+  unsigned int start() const { return d_start; }
+  //! how many reference nucleotides the alignment spans
+  unsigned int referenceLength() const;
+  //! the alignment, from start() in the reference and the start of the read
+  const std::vector<Edit>& script() const { return d_script; }
+  //! the SAM CIGAR string of our script, where matches and mismatches both are 'M'
+  void cigar(std::string* out) const;
+
+private:
+  int score(unsigned int row, unsigned int column) const;
+
+  std::vector<uint64_t> d_peq;    // per nucleotide code (A, C, G, T, anything else), the rows of the read it matches
+  std::vector<uint64_t> d_pv, d_mv; // per reference column, the positive and negative vertical deltas, column 0 is before the reference
+  std::vector<Edit> d_script;
+  unsigned int d_words{0};
+  unsigned int d_distance{0};
+  unsigned int d_start{0};
+};
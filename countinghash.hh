@@ -0,0 +1,101 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <boost/utility.hpp>
+
+/** Counts how often we see each key, in an open addressing table of Key (uint32_t or uint64_t) with saturating
+    8 bit counters, so 5 or 9 bytes per slot instead of a std::map node per key. The table does not grow: size it
+    for the number of distinct keys you expect, we allocate twice that rounded up to a power of two.
+
+    Safe to share between threads: slots are claimed with a compare-and-swap, counters are bumped atomically.
+    Should the table fill up anyway, keys we have no room for count as seen once, and overflowed() tells you how
+    often that happened. Counts saturate at 255. */
+template<typename Key>
+class CountingHashTable : boost::noncopyable
+{
+public:
+  explicit CountingHashTable(uint64_t expected)
+  {
+    uint64_t slots = 1024;
+    d_shift = 64 - 10;
+    while(slots < 2 * expected) {
+      slots *= 2;
+      --d_shift;
+    }
+    d_mask = slots - 1;
+    d_limit = slots - slots / 8; // keep empty slots around, or missing keys would never stop probing
+    d_keys.reset(new std::atomic<Key>[slots]());
+    d_counts.reset(new std::atomic<uint8_t>[slots]());
+  }
+
+  //! counts key, returns how often we have seen it now
+  uint8_t increment(Key key)
+  {
+    if(!key) // 0 marks empty slots
+      return bump(d_zero);
+    for(uint64_t slot = home(key); ; slot = (slot + 1) & d_mask) {
+      Key found = d_keys[slot].load(std::memory_order_relaxed);
+      if(!found) {
+        if(d_used.load(std::memory_order_relaxed) >= d_limit) {
+          d_overflowed.fetch_add(1, std::memory_order_relaxed);
+          return 1;
+        }
+        if(d_keys[slot].compare_exchange_strong(found, key, std::memory_order_relaxed)) {
+          d_used.fetch_add(1, std::memory_order_relaxed);
+          return bump(d_counts[slot]);
+        }
+        // someone else got this slot first, found now has their key
+      }
+      if(found == key)
+        return bump(d_counts[slot]);
+    }
+  }
+
+  //! how often we have seen key
+  uint8_t count(Key key) const
+  {
+    if(!key)
+      return d_zero.load(std::memory_order_relaxed);
+    for(uint64_t slot = home(key); ; slot = (slot + 1) & d_mask) {
+      Key found = d_keys[slot].load(std::memory_order_relaxed);
+      if(!found)
+        return 0;
+      if(found == key)
+        return d_counts[slot].load(std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t size() const //!< distinct keys, except the ones we had no room for
+  {
+    return d_used.load(std::memory_order_relaxed) + (d_zero.load(std::memory_order_relaxed) ? 1 : 0);
+  }
+  uint64_t overflowed() const //!< keys we had no room for, counted as seen once
+  {
+    return d_overflowed.load(std::memory_order_relaxed);
+  }
+  uint64_t memoryUsage() const //!< in bytes
+  {
+    return (d_mask + 1) * (sizeof(Key) + 1);
+  }
+
+private:
+  uint64_t home(Key key) const
+  {
+    return ((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> d_shift; // top bits, which all bits of the key mix into
+  }
+  static uint8_t bump(std::atomic<uint8_t>& counter)
+  {
+    uint8_t count = counter.load(std::memory_order_relaxed);
+    while(count != 255 && !counter.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+      ;
+    return count == 255 ? 255 : count + 1;
+  }
+
+  std::unique_ptr<std::atomic<Key>[]> d_keys;
+  std::unique_ptr<std::atomic<uint8_t>[]> d_counts;
+  std::atomic<uint8_t> d_zero{0};
+  std::atomic<uint64_t> d_used{0}, d_overflowed{0};
+  uint64_t d_mask, d_limit;
+  unsigned int d_shift;
+};
@@ -1,5 +1,6 @@
 #include "dnamisc.hh"
 #include "antonie.hh"
+#include "radixsort.hh"
 #include <vector>
 #include <stdexcept>
 #include <math.h>
@@ -7,7 +8,11 @@ extern "C" {
 #include "hash.h"
 }
 #include <algorithm>
+#include <string.h>
 #include <boost/lexical_cast.hpp>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 dnapos_t dnanpos = (dnapos_t) -1;
 using std::vector;
 using std::runtime_error;
@@ -30,13 +35,13 @@ double getGCContent(const std::string& str)
 
 double qToErr(unsigned int i) 
 {
-  static vector<double> answers;
-  
-  if(answers.empty()) {
+  static const vector<double> answers = []() { // thread safe initialization
+    vector<double> ret;
     for(int n = 0; n < 60 ; ++n) {
-      answers.push_back(pow(10.0, -n/10.0));
+      ret.push_back(pow(10.0, -n/10.0));
     }
-  }
+    return ret;
+  }();
   if(i > answers.size()) {
     throw runtime_error("Can't calculate error rate for Q "+boost::lexical_cast<std::string>(i));
   }
@@ -195,31 +200,332 @@ char DNAToAminoAcid(const char* s)
   return '?';
 }
 
-void DuplicateCounter::feedString(const std::string& str)
+namespace {
+  // 0-3 for ACGT (either case), 4 for anything else
+  const uint8_t* packCodes()
+  {
+    static const vector<uint8_t> codes = []() { // thread safe initialization
+      vector<uint8_t> ret(256, 4);
+      for(int c = 0; c < 256; ++c) {
+        int code = nucleotideCode(toupper(c));
+        if(code >= 0)
+          ret[c] = code;
+      }
+      return ret;
+    }();
+    return &codes[0];
+  }
+
+  // one bit per differing nucleotide in x, the XOR of two packed words
+  inline uint64_t diffBits(uint64_t x)
+  {
+    x = (x | (x >> 1)) & 0x5555555555555555ULL;
+    x = (x | (x >> 1)) & 0x3333333333333333ULL;
+    x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x >> 4)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x >> 8)) & 0x0000ffff0000ffffULL;
+    x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+    return x;
+  }
+
+  // 32 nucleotides of a read, with their qualities
+  struct ReadBlock
+  {
+    uint64_t codes; // packed like PackedNucleotides does, anything but ACGT as A
+    uint32_t odd;   // a bit for each nucleotide that is not ACGT
+    uint32_t good;  // a bit for each quality over the limit
+  };
+  typedef void (*packblock_t)(const char* s, const char* quality, int qlimit, ReadBlock* rb);
+
+  void packBlockScalar(const char* s, const char* quality, int qlimit, ReadBlock* rb)
+  {
+    const uint8_t* codes = packCodes();
+    rb->codes = 0;
+    rb->odd = rb->good = 0;
+    for(unsigned int i = 0; i < 32; ++i) {
+      uint8_t code = codes[(uint8_t)s[i]];
+      if(code < 4)
+        rb->codes |= (uint64_t)code << 2*i;
+      else
+        rb->odd |= 1U << i;
+      if(quality && quality[i] > qlimit)
+        rb->good |= 1U << i;
+    }
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  /* For ACGT and acgt, ((c >> 1) ^ (c >> 2)) & 3 is the 2-bit code. maddubs and madd then fold every 4 codes
+     into the low byte of a 32 bit lane, and a shuffle gathers those. Qualities are signed chars, like
+     the scalar comparison */
+  __attribute__((target("avx2"))) void packBlockAVX2(const char* s, const char* quality, int qlimit, ReadBlock* rb)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)s);
+    __m256i codes = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi16(v, 1), _mm256_srli_epi16(v, 2)), _mm256_set1_epi8(3));
+    __m256i upper = _mm256_and_si256(v, _mm256_set1_epi8((char)0xdf));
+    __m256i acgt = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(upper, _mm256_set1_epi8('A')), _mm256_cmpeq_epi8(upper, _mm256_set1_epi8('C'))),
+                                   _mm256_or_si256(_mm256_cmpeq_epi8(upper, _mm256_set1_epi8('G')), _mm256_cmpeq_epi8(upper, _mm256_set1_epi8('T'))));
+    codes = _mm256_and_si256(codes, acgt);
+    rb->odd = ~(uint32_t)_mm256_movemask_epi8(acgt);
+
+    __m256i pairs = _mm256_maddubs_epi16(codes, _mm256_set1_epi16(0x0401));
+    __m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00100001));
+    __m256i bytes = _mm256_shuffle_epi8(quads, _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                                0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+    rb->codes = (uint32_t)_mm256_extract_epi32(bytes, 0) | ((uint64_t)(uint32_t)_mm256_extract_epi32(bytes, 4) << 32);
+
+    rb->good = 0;
+    if(quality) {
+      __m256i q = _mm256_loadu_si256((const __m256i*)quality);
+      rb->good = _mm256_movemask_epi8(_mm256_cmpgt_epi8(q, _mm256_set1_epi8(qlimit)));
+    }
+  }
+
+  // the same, 16 at a time
+  __attribute__((target("sse4.2"))) void packBlockSSE42(const char* s, const char* quality, int qlimit, ReadBlock* rb)
+  {
+    rb->codes = 0;
+    rb->odd = rb->good = 0;
+    for(unsigned int half = 0; half < 2; ++half) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(s + 16*half));
+      __m128i codes = _mm_and_si128(_mm_xor_si128(_mm_srli_epi16(v, 1), _mm_srli_epi16(v, 2)), _mm_set1_epi8(3));
+      __m128i upper = _mm_and_si128(v, _mm_set1_epi8((char)0xdf));
+      __m128i acgt = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(upper, _mm_set1_epi8('A')), _mm_cmpeq_epi8(upper, _mm_set1_epi8('C'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(upper, _mm_set1_epi8('G')), _mm_cmpeq_epi8(upper, _mm_set1_epi8('T'))));
+      codes = _mm_and_si128(codes, acgt);
+      rb->odd |= (uint32_t)(~_mm_movemask_epi8(acgt) & 0xffff) << 16*half;
+
+      __m128i pairs = _mm_maddubs_epi16(codes, _mm_set1_epi16(0x0401));
+      __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00100001));
+      __m128i bytes = _mm_shuffle_epi8(quads, _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+      rb->codes |= (uint64_t)(uint32_t)_mm_cvtsi128_si32(bytes) << 32*half;
+
+      if(quality) {
+        __m128i q = _mm_loadu_si128((const __m128i*)(quality + 16*half));
+        rb->good |= (uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi8(q, _mm_set1_epi8(qlimit))) << 16*half;
+      }
+    }
+  }
+#endif
+
+  packblock_t choosePackBlock()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+      return packBlockAVX2;
+    if(__builtin_cpu_supports("sse4.2"))
+      return packBlockSSE42;
+#endif
+    return packBlockScalar;
+  }
+  packblock_t packBlock = choosePackBlock();
+}
+
+bool PackedNucleotides::useKernel(Kernel kernel)
 {
-  uint32_t hashval = qhash(str.c_str(), str.length(), 0);
-  d_hashes.push_back(hashval);
+  switch(kernel) {
+  case Kernel::Scalar:
+    packBlock = packBlockScalar;
+    return true;
+#if defined(__x86_64__) || defined(__i386__)
+  case Kernel::SSE42:
+    if(!__builtin_cpu_supports("sse4.2"))
+      return false;
+    packBlock = packBlockSSE42;
+    return true;
+  case Kernel::AVX2:
+    if(!__builtin_cpu_supports("avx2"))
+      return false;
+    packBlock = packBlockAVX2;
+    return true;
+#endif
+  default:
+    return false;
+  }
 }
 
-DuplicateCounter::counts_t DuplicateCounter::getCounts()
+void PackedNucleotides::append(const char* s, size_t len)
 {
-  counts_t ret;
-  sort(d_hashes.begin(), d_hashes.end());
-  uint64_t repeatCount=1;
-  for(auto iter = next(d_hashes.begin()) ; iter != d_hashes.end(); ++iter) {
-    if(*prev(iter) != *iter) {
-      ret[std::min(repeatCount, (decltype(repeatCount))20)]+=repeatCount; 
-      repeatCount=1;
-    }
+  const uint8_t* codes = packCodes();
+  for(size_t i = 0; i < len; ++i) {
+    if(!(d_size % 32))
+      d_words.push_back(0);
+    uint8_t code = codes[(uint8_t)s[i]];
+    if(code < 4)
+      d_words.back() |= (uint64_t)code << 2*(d_size % 32);
+    else if(!d_runs.empty() && d_runs.back().c == s[i] && d_runs.back().pos + d_runs.back().length == d_size)
+      d_runs.back().length++;
     else
-      repeatCount++;
+      d_runs.push_back({d_size, 1, s[i]});
+    ++d_size;
   }
-  ret[repeatCount]+=repeatCount;
+}
+
+vector<PackedNucleotides::Run>::const_iterator PackedNucleotides::firstRun(size_t pos) const
+{
+  return std::upper_bound(d_runs.begin(), d_runs.end(), pos, [](size_t p, const Run& r) {
+      return p < r.pos + r.length;
+    });
+}
+
+char PackedNucleotides::get(size_t pos) const
+{
+  auto run = firstRun(pos);
+  if(run != d_runs.end() && run->pos <= pos)
+    return run->c;
+  return "ACGT"[(d_words[pos/32] >> 2*(pos%32)) & 3];
+}
+
+std::string PackedNucleotides::substr(size_t pos, size_t len) const
+{
+  std::string ret;
+  substr(pos, len, &ret);
   return ret;
 }
 
-void DuplicateCounter::clear()
+void PackedNucleotides::substr(size_t pos, size_t len, std::string* out) const
+{
+  if(pos > d_size)
+    throw std::out_of_range("substr at "+boost::lexical_cast<std::string>(pos)+" of "+boost::lexical_cast<std::string>(d_size)+" nucleotides");
+  len = std::min(len, d_size - pos);
+  out->assign(len, 'A');
+  for(size_t i = 0; i < len; ++i)
+    (*out)[i] = "ACGT"[(d_words[(pos+i)/32] >> 2*((pos+i)%32)) & 3];
+  for(auto run = firstRun(pos); run != d_runs.end() && run->pos < pos + len; ++run) {
+    size_t begin = std::max(run->pos, pos), end = std::min(run->pos + run->length, pos + len);
+    std::fill(out->begin() + (begin - pos), out->begin() + (end - pos), run->c);
+  }
+}
+
+uint64_t PackedNucleotides::extract(size_t pos, unsigned int n) const
 {
-  d_hashes.clear();
-  d_hashes.shrink_to_fit();
+  size_t word = pos/32;
+  unsigned int shift = 2*(pos%32);
+  uint64_t ret = d_words[word] >> shift;
+  if(shift && word + 1 < d_words.size())
+    ret |= d_words[word+1] << (64 - shift);
+  return n < 32 ? ret & ((1ULL << 2*n) - 1) : ret;
+}
+
+uint64_t PackedNucleotides::pack(const char* s, unsigned int n, uint64_t* odd)
+{
+  const uint8_t* codes = packCodes();
+  uint64_t ret = 0;
+  *odd = 0;
+  for(unsigned int i = 0; i < n; ++i) {
+    uint8_t code = codes[(uint8_t)s[i]];
+    if(code < 4)
+      ret |= (uint64_t)code << 2*i;
+    else
+      *odd |= 1ULL << i;
+  }
+  return ret;
+}
+
+PackedNucleotides::View::Mismatches PackedNucleotides::View::mismatches(const std::string& s, const std::string& quality, int qlimit, 
+                                                                        vector<uint64_t>* mask, unsigned int maxGood) const
+{
+  if(quality.size() < s.size())
+    throw runtime_error("Fewer qualities than nucleotides in a mismatch count");
+  return compare(s, quality.c_str(), qlimit, maxGood, mask);
+}
+
+PackedNucleotides::View::Mismatches PackedNucleotides::View::compare(const std::string& s, const char* quality, int qlimit, 
+                                                                     unsigned int maxGood, vector<uint64_t>* mask) const
+{
+  Mismatches ret;
+  mask->assign((s.size() + 63)/64, 0);
+  size_t len = std::min(s.size(), d_len);
+  qlimit = std::max(-128, std::min(127, qlimit)); // qualities are chars
+  auto run = d_store->firstRun(d_pos);
+  
+  for(size_t i = 0; i < len; i += 32) {
+    unsigned int n = std::min<size_t>(32, len - i);
+    const char* sp = s.c_str() + i;
+    const char* qp = quality ? quality + i : 0;
+    char sbuf[32] = {0}, qbuf[32] = {0};
+    if(n < 32) { // our kernels always read 32, whatever is past n gets masked off
+      memcpy(sbuf, sp, n);
+      sp = sbuf;
+      if(qp) {
+        memcpy(qbuf, qp, n);
+        qp = qbuf;
+      }
+    }
+    ReadBlock rb;
+    packBlock(sp, qp, qlimit, &rb);
+    uint64_t valid = n < 32 ? (1ULL << n) - 1 : 0xffffffffULL;
+    uint64_t diff = diffBits(rb.codes ^ d_store->extract(d_pos + i, n)) & valid;
+
+    auto setBit = [&diff](unsigned int j, bool differs) {
+      diff = (diff & ~(1ULL << j)) | ((uint64_t)differs << j);
+    };
+    for(uint64_t odd = rb.odd & valid; odd; odd &= odd - 1) { // packed as A, so compare these by hand
+      unsigned int j = __builtin_ctzll(odd);
+      setBit(j, sp[j] != (*this)[i + j]);
+    }
+    // and so are our runs
+    size_t blockBegin = d_pos + i, blockEnd = blockBegin + n;
+    while(run != d_store->d_runs.end() && run->pos < blockEnd) {
+      size_t end = std::min(run->pos + run->length, blockEnd);
+      for(size_t p = std::max(run->pos, blockBegin); p < end; ++p)
+        setBit(p - blockBegin, sp[p - blockBegin] != run->c);
+      if(run->pos + run->length > blockEnd) // continues in the next block
+        break;
+      ++run;
+    }
+
+    (*mask)[i/64] |= diff << (i % 64);
+    ret.good += __builtin_popcountll(diff & rb.good);
+    ret.poor += __builtin_popcountll(diff & ~(uint64_t)rb.good);
+    if(ret.good >= maxGood && i + n < len) {
+      ret.stopped = true;
+      break;
+    }
+  }
+  return ret;
+}
+
+double PackedNucleotides::View::gcContent() const
+{
+  // C is 01 and G is 10, so the two bits of a nucleotide differ for GC. Runs are packed as A
+  size_t gc = 0, total = d_len;
+  for(size_t i = 0; i < d_len; i += 32) {
+    uint64_t w = d_store->extract(d_pos + i, std::min<size_t>(32, d_len - i));
+    gc += __builtin_popcountll((w ^ (w >> 1)) & 0x5555555555555555ULL);
+  }
+  for(auto run = d_store->firstRun(d_pos); run != d_store->d_runs.end() && run->pos < d_pos + d_len; ++run) {
+    if(run->c != 'N') // getGCContent counts N, but nothing else
+      total -= std::min(run->pos + run->length, d_pos + d_len) - std::max(run->pos, d_pos);
+  }
+  if(!total)
+    return 0.0;
+  return 1.0*gc/(1.0*total);
+}
+
+bool PackedNucleotides::equal(size_t pos, const char* s, size_t len) const
+{
+  if(pos + len > d_size)
+    return false;
+  auto run = firstRun(pos);
+  if(run != d_runs.end() && run->pos < pos + len)
+    return substr(pos, len).compare(0, len, s, len) == 0;
+  
+  for(size_t i = 0; i < len; i += 32) {
+    unsigned int n = std::min<size_t>(32, len - i);
+    uint64_t odd;
+    if(pack(s + i, n, &odd) != extract(pos + i, n) || odd)
+      return false;
+  }
+  return true;
+}
+
+uint32_t PackedNucleotides::hash() const
+{
+  uint32_t ret = qhash(d_words.data(), d_words.size(), d_size);
+  for(const auto& run : d_runs) {
+    uint64_t fields[3] = {run.pos, run.length, (uint64_t)run.c};
+    ret = qhash(fields, 3, ret);
+  }
+  return ret;
 }
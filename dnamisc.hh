@@ -3,9 +3,11 @@
 #include <vector>
 #include <functional>
 #include <stdlib.h>
+#include <limits.h>
 #include <sstream> 
 #include <iomanip>
 #include <map>
+#include <algorithm>
 #include "antonie.hh"
 
 extern const char* g_gitHash;
@@ -120,11 +122,30 @@ inline void acgtxDo(char c, acgt_t aDo, acgt_t cDo, acgt_t gDo, acgt_t tDo, acgt
 }
 
 
-//! Little utility to pick a random element from a container
-template<typename T>
-const typename T::value_type& pickRandom(const T& t)
+/** Stateless stand-in for rand() when picking between equally good candidates. Seed it with something
+    that identifies what is being placed, like FastQRead::getChoiceKey(), and the same read gets the same 
+    choice on any thread, in any order. No shared state, so no locks either */
+class KeyedRandom
+{
+public:
+  explicit KeyedRandom(uint64_t key, uint32_t seed=0) : d_state(key ^ (0x9E3779B97F4A7C15ULL * (seed+1ULL)))
+  {}
+  uint32_t operator()() //!< splitmix64
+  {
+    uint64_t z = (d_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (z ^ (z >> 31)) >> 32;
+  }
+private:
+  uint64_t d_state;
+};
+
+//! Little utility to pick a random element from a container, using a random generator like KeyedRandom
+template<typename T, typename R>
+const typename T::value_type& pickRandom(const T& t, R& rng)
 {
-  return t[rand() % t.size()];
+  return t[rng() % t.size()];
 }
 
 inline std::string jsonVectorPair(const std::vector<std::pair<double, double> >& in) 
@@ -201,28 +222,172 @@ std::string jsonVectorX(const std::vector<T>& v,
 }
 
 
-//! maps 'len' nucleotides from 'str' at offset offset to a 32 bit string. At most 16 nuclotides therefore!
-uint32_t kmerMapper(const std::string& str, int offset, int unsigned len);
-
-char DNAToAminoAcid(const char* s);
-const char* AminoAcidName(char c);
+//! 2-bit code of a nucleotide (A=0, C=1, G=2, T=3, so the complement is 3-code), -1 for anything else
+inline int nucleotideCode(char c)
+{
+  switch(c) {
+  case 'A':
+    return 0;
+  case 'C':
+    return 1;
+  case 'G':
+    return 2;
+  case 'T':
+    return 3;
+  }
+  return -1;
+}
 
+/** Rolls a window of k (at most 32) nucleotides along a sequence, one push() per nucleotide. Keeps the
+    2-bit packed key of the window (first nucleotide in the most significant bits) and that of its
+    reverse complement up to date in O(1) per step. A window with anything but ACGT in it is not valid */
+class KmerIterator
+{
+public:
+  explicit KmerIterator(unsigned int k) : d_k(k), d_mask(k < 32 ? (1ULL << 2*k) - 1 : ~0ULL)
+  {}
+  //! add the next nucleotide, returns valid()
+  bool push(char c)
+  {
+    int code = nucleotideCode(c);
+    if(code < 0) {
+      d_valid = 0;
+      return false;
+    }
+    d_forward = ((d_forward << 2) | code) & d_mask;
+    d_reverse = (d_reverse >> 2) | ((uint64_t)(3 - code) << 2*(d_k - 1));
+    if(d_valid < d_k)
+      ++d_valid;
+    return d_valid == d_k;
+  }
+  bool valid() const
+  {
+    return d_valid == d_k;
+  }
+  uint64_t forward() const
+  {
+    return d_forward;
+  }
+  uint64_t reverse() const //!< key of the reverse complement
+  {
+    return d_reverse;
+  }
+  uint64_t canonical() const //!< the same for a k-mer and its reverse complement
+  {
+    return std::min(d_forward, d_reverse);
+  }
+  bool isReverse() const //!< true if canonical() is the key of our reverse complement
+  {
+    return d_reverse < d_forward;
+  }
+  void reset()
+  {
+    d_valid = 0;
+  }
+private:
+  unsigned int d_k;
+  uint64_t d_mask;
+  uint64_t d_forward{0}, d_reverse{0};
+  unsigned int d_valid{0};
+};
 
-//! Very simple duplicate count estimator using a 32 bit hash. Also provides statistics
-class DuplicateCounter
+/** Nucleotides at 2 bits each, 32 to a 64 bit word, 4x smaller than a string. Anything that is not ACGT
+    (runs of N, IUPAC codes) lives in a sorted side table of runs. Lowercase acgt is stored as uppercase.
+    Compares against unpacked nucleotides a word at a time */
+class PackedNucleotides
 {
 public:
-  DuplicateCounter(int estimate=1000000)
+  void reserve(size_t size)
+  {
+    d_words.reserve(size/32 + 1);
+  }
+  void append(const char* s, size_t len);
+  void append(const std::string& s)
   {
-    d_hashes.reserve(estimate);
+    append(s.c_str(), s.length());
+  }
+  size_t size() const
+  {
+    return d_size;
+  }
+  char get(size_t pos) const;
+  std::string substr(size_t pos, size_t len = std::string::npos) const; //!< like std::string::substr
+  void substr(size_t pos, size_t len, std::string* out) const; //!< same, into out, reusing its storage
+  bool equal(size_t pos, const char* s, size_t len) const; //!< are we s at pos
+  uint32_t hash() const;
+
+  //! How View::mismatches() packs reads. The default is the fastest one this CPU has
+  enum class Kernel { Scalar, SSE42, AVX2 };
+  static bool useKernel(Kernel kernel); //!< false if this build or CPU lacks kernel. Not while other threads compare
+
+  //! A stretch of a PackedNucleotides, read in place like a string_view. Never allocates
+  class View
+  {
+  public:
+    View(const PackedNucleotides& store, size_t pos, size_t len) : d_store(&store), d_pos(pos), d_len(len)
+    {}
+    size_t size() const
+    {
+      return d_len;
+    }
+    char operator[](size_t i) const
+    {
+      return d_store->get(d_pos + i);
+    }
+    std::string str() const
+    {
+      return d_store->substr(d_pos, d_len);
+    }
+    void str(std::string* out) const //!< into out, reusing its storage
+    {
+      d_store->substr(d_pos, d_len, out);
+    }
+    //! What mismatches() found
+    struct Mismatches
+    {
+      unsigned int good{0}; //!< mismatches at a quality over the limit
+      unsigned int poor{0}; //!< mismatches at a lower quality
+      bool stopped{false};  //!< we had maxGood good ones and gave up, the mask is incomplete
+    };
+    /** Sets bit i%64 of (*mask)[i/64] if s[i] differs from us, past our end bits stay 0. Reuses mask's 
+        storage. Also counts the mismatches by quality[i] > qlimit. Works on 32 nucleotides at a time, 
+        with AVX2 or SSE4.2 if the CPU has them */
+    Mismatches mismatches(const std::string& s, const std::string& quality, int qlimit, std::vector<uint64_t>* mask, 
+                          unsigned int maxGood = UINT_MAX) const;
+    void mismatches(const std::string& s, std::vector<uint64_t>* mask) const //!< same, without qualities
+    {
+      compare(s, 0, 0, UINT_MAX, mask);
+    }
+    double gcContent() const; //!< same as getGCContent(str())
+  private:
+    Mismatches compare(const std::string& s, const char* quality, int qlimit, unsigned int maxGood, std::vector<uint64_t>* mask) const;
+    const PackedNucleotides* d_store;
+    size_t d_pos, d_len;
+  };
+  View view(size_t pos, size_t len = std::string::npos) const //!< clamped to our size, like substr
+  {
+    pos = std::min(pos, d_size);
+    return View(*this, pos, std::min(len, d_size - pos));
   }
-  void feedString(const std::string& str); //! do statistics on str
-  void clear(); //! clean ourselves up
-  typedef std::map<uint64_t,uint64_t> counts_t;
 
-  counts_t getCounts(); //! in position 0, everyone with no duplicates, in position 1 single duplicates etc
 private:
-  std::vector<uint32_t> d_hashes;
+  struct Run
+  {
+    size_t pos;
+    size_t length;
+    char c;
+  };
+  std::vector<Run>::const_iterator firstRun(size_t pos) const; //!< first run that ends after pos
+  uint64_t extract(size_t pos, unsigned int n) const; //!< n <= 32 nucleotides from pos, packed like d_words
+  static uint64_t pack(const char* s, unsigned int n, uint64_t* odd); //!< odd gets a bit for each non-ACGT
+
+  std::vector<uint64_t> d_words; //!< nucleotide i in bits 2*(i%32) of word i/32, runs are stored as A
+  std::vector<Run> d_runs;
+  size_t d_size{0};
 };
 
+//! maps 'len' nucleotides from 'str' at offset offset to a 32 bit string. At most 16 nuclotides therefore!
+uint32_t kmerMapper(const std::string& str, int offset, int unsigned len);
 
+char DNAToAminoAcid(const char* s);
+const char* AminoAcidName(char c);
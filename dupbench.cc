@@ -0,0 +1,90 @@
+// microbenchmark of the duplicate filter: counting read hashes in the std::map<uint32_t, uint32_t> antonie used
+// to have against a CountingHashTable with 32 and 64 bit keys, also shared by several threads
+// usage: dupbench [distinct reads] [threads]
+#include <map>
+#include <vector>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include "countinghash.hh"
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace std;
+
+namespace {
+//! bytes the heap has handed out, where we can tell
+uint64_t heapInUse()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+template<typename F>
+double nsPerKey(const vector<uint64_t>& keys, F func)
+{
+  auto start = chrono::steady_clock::now();
+  func();
+  return 1.0*chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count() / keys.size();
+}
+}
+
+int main(int argc, char** argv)
+{
+  uint64_t distinct = argc > 1 ? atoll(argv[1]) : 5000000;
+  unsigned int numThreads = argc > 2 ? atoi(argv[2]) : max(1U, thread::hardware_concurrency());
+
+  // reads in the order they come in, a tenth of them again somewhere later
+  mt19937_64 rng(42);
+  vector<uint64_t> keys;
+  for(uint64_t n = 0; n < distinct; ++n) {
+    keys.push_back(rng());
+    if(!(rng() % 10))
+      keys.push_back(keys[rng() % keys.size()]);
+  }
+  cout<<keys.size()<<" reads, "<<distinct<<" distinct"<<endl;
+
+  uint64_t before = heapInUse(), dups = 0;
+  map<uint32_t, uint32_t> seenAlready;
+  double ns = nsPerKey(keys, [&]() {
+      for(auto key : keys)
+        dups += ++seenAlready[(uint32_t)key] > 1;
+    });
+  cout<<"std::map<uint32_t,uint32_t>:     "<<ns<<" ns/read, "<<(heapInUse() - before)/1048576<<" MB, "<<dups<<" dups"<<endl;
+  seenAlready.clear();
+
+  CountingHashTable<uint32_t> cht32(keys.size());
+  dups = 0;
+  ns = nsPerKey(keys, [&]() {
+      for(auto key : keys)
+        dups += cht32.increment(key) > 1;
+    });
+  cout<<"CountingHashTable<uint32_t>:     "<<ns<<" ns/read, "<<cht32.memoryUsage()/1048576<<" MB, "<<dups<<" dups"<<endl;
+
+  CountingHashTable<uint64_t> cht64(keys.size());
+  dups = 0;
+  ns = nsPerKey(keys, [&]() {
+      for(auto key : keys)
+        dups += cht64.increment(key) > 1;
+    });
+  cout<<"CountingHashTable<uint64_t>:     "<<ns<<" ns/read, "<<cht64.memoryUsage()/1048576<<" MB, "<<dups<<" dups"<<endl;
+
+  CountingHashTable<uint64_t> shared(keys.size());
+  ns = nsPerKey(keys, [&]() {
+      vector<thread> threads;
+      for(unsigned int t = 0; t < numThreads; ++t)
+        threads.emplace_back([&, t]() {
+            for(uint64_t n = keys.size()*t/numThreads; n < keys.size()*(t+1)/numThreads; ++n)
+              shared.increment(keys[n]);
+          });
+      for(auto& t : threads)
+        t.join();
+    });
+  cout<<"CountingHashTable<uint64_t>, "<<numThreads<<" threads: "<<ns<<" ns/read, "<<shared.size()<<" distinct"<<endl;
+}
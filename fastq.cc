@@ -4,12 +4,15 @@
 #include <string.h>
 #include "misc.hh"
 #include <boost/lexical_cast.hpp>
+extern "C" {
+#include "hash.h"
+}
 using namespace std;
 
 uint64_t StereoFASTQReader::s_mask= ~(1ULL<<63);
 
-FASTQReader::FASTQReader(const std::string& str, unsigned int qoffset) 
-  : d_snipLeft(0), d_snipRight(0), d_reader(LineReader::make(str))
+FASTQReader::FASTQReader(const std::string& str, unsigned int qoffset, bool useIndexFile, unsigned int workers) 
+  : d_snipLeft(0), d_snipRight(0), d_reader(LineReader::make(str, useIndexFile, workers))
 {
   d_qoffset=qoffset;
 }
@@ -40,6 +43,11 @@ void FastQRead::reverse()
   reversed = !reversed;
 }
 
+uint64_t FastQRead::getChoiceKey() const
+{
+  return position ^ ((uint64_t)qhash(d_header.c_str(), d_header.length(), 0) << 31);
+}
+
 std::string FastQRead::getNameFromHeader() const
 {
   string name;
@@ -51,48 +59,132 @@ std::string FastQRead::getNameFromHeader() const
   return name;
 }
 
-unsigned int FASTQReader::getRead(FastQRead* fq)
-{
-  uint64_t pos = d_reader->getUncPos();
-  char line[1024]="";
-  if(!d_reader->fgets(line, sizeof(line)))
-    return 0;
-  if(line[0] != '@')
-    throw runtime_error("Input not FASTQ, line: '"+string(line)+"'");
-
-  chomp(line);
-  fq->d_header.assign(line+1);
+namespace {
+  /** The record at the start of [p, e), returns how many bytes it takes or 0 if it does not end before e. At eof, the last
+      line does not need a newline */
+  size_t parseRecord(const char* p, const char* e, bool eof, FastQRecordView* view)
+  {
+    std::string_view lines[4];
+    const char* cur = p;
+    for(auto& line : lines) {
+      auto newline = (const char*)memchr(cur, '\n', e - cur);
+      if(!newline) {
+        if(!eof)
+          return 0;
+        if(cur == e)
+          throw runtime_error("Truncated FASTQ record at end of file");
+        newline = e;
+      }
+      line = std::string_view(cur, newline - cur);
+      if(!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+      cur = newline == e ? e : newline + 1;
+    }
+    if(lines[0].empty() || lines[0][0] != '@')
+      throw runtime_error("Input not FASTQ, line: '"+string(lines[0])+"'");
+    view->header = lines[0].substr(1);
+    view->nucleotides = lines[1];
+    view->quality = lines[3];
+    return cur - p;
+  }
 
-  d_reader->fgets(line, sizeof(line));
-  chomp(line);
-  
-  if((d_snipLeft || d_snipRight) && (d_snipLeft + d_snipRight < strlen(line)))
-    fq->d_nucleotides.assign(line + d_snipLeft, strlen(line) -d_snipLeft-d_snipRight);
-  else
-    fq->d_nucleotides.assign(line);
-  d_reader->fgets(line, sizeof(line));
-  d_reader->fgets(line, sizeof(line));
+  std::string_view trim(std::string_view str, unsigned int left, unsigned int right)
+  {
+    if((left || right) && left + right < str.size())
+      return str.substr(left, str.size() - left - right);
+    return str;
+  }
+}
 
-  chomp(line);
+//! Records in the buffer of d_reader are returned as they are. Only if the first one does not fit there, we collect it in d_carry,
+//! taking from the next buffers no more than up to its fourth newline
+unsigned int FASTQReader::getRecords(std::vector<FastQRecordView>* views, unsigned int max)
+{
+  views->clear();
+  uint64_t pos = d_reader->getUncPos();
+  std::string_view buf = d_reader->buffered();
+  const char* p = buf.data(), *e = buf.data() + buf.size();
+  FastQRecordView view;
+  while(views->size() < max && p != e) {
+    size_t len = parseRecord(p, e, false, &view);
+    if(!len)
+      break;
+    view.position = pos;
+    view.size = len;
+    views->push_back(view);
+    pos += len;
+    p += len;
+  }
+  if(!views->empty()) {
+    d_reader->consume(p - buf.data());
+    return views->size();
+  }
 
-  if((d_snipLeft || d_snipRight) && (d_snipLeft + d_snipRight < strlen(line)))
-    fq->d_quality.assign(line + d_snipLeft, strlen(line)-d_snipLeft-d_snipRight);
-  else
-    fq->d_quality.assign(line);
+  d_carry.clear();
+  unsigned int newlines = 0;
+  while(newlines < 4) {
+    buf = d_reader->buffered();
+    if(buf.empty()) {
+      if(d_carry.empty())
+        return 0;
+      break; // parseRecord tells a last line without newline from a truncated record
+    }
+    p = buf.data();
+    e = buf.data() + buf.size();
+    while(newlines < 4 && p != e) {
+      auto newline = (const char*)memchr(p, '\n', e - p);
+      p = newline ? newline + 1 : e;
+      newlines += newline ? 1 : 0;
+    }
+    d_carry.append(buf.data(), p - buf.data());
+    d_reader->consume(p - buf.data());
+  }
+  size_t len = parseRecord(d_carry.c_str(), d_carry.c_str() + d_carry.size(), true, &view);
+  view.position = pos;
+  view.size = len;
+  views->push_back(view);
+  return 1;
+}
 
-  for(auto& c : fq->d_quality) {
-    if((unsigned int)c < d_qoffset)
-      throw runtime_error("Attempting to parse a quality code of val "+boost::lexical_cast<string>((int)c)+" which is < our quality offset");
-    c -= d_qoffset;
+//! Written so the compiler vectorizes the loop: we check the lowest quality afterwards, instead of every character
+void FASTQReader::materialize(const FastQRecordView& view, FastQRead* fq) const
+{
+  fq->d_header.assign(view.header);
+  fq->d_nucleotides.assign(trim(view.nucleotides, d_snipLeft, d_snipRight));
+
+  std::string_view quality = trim(view.quality, d_snipLeft, d_snipRight);
+  fq->d_quality.resize(quality.size());
+  const uint8_t* in = (const uint8_t*)quality.data();
+  uint8_t* out = (uint8_t*)&fq->d_quality[0];
+  uint8_t lowest = 0xff, offset = d_qoffset;
+  for(size_t n = 0; n < quality.size(); ++n) {
+    lowest = min(lowest, in[n]);
+    out[n] = in[n] - offset;
   }
+  if(lowest < d_qoffset)
+    throw runtime_error("Attempting to parse a quality code of val "+boost::lexical_cast<string>((int)lowest)+" which is < our quality offset");
 
   fq->reversed=0;
-  fq->position=pos;
-  return d_reader->getUncPos() - pos;
+  fq->position=view.position;
+}
+
+std::string_view FASTQReader::nucleotides(const FastQRecordView& view) const
+{
+  return trim(view.nucleotides, d_snipLeft, d_snipRight);
+}
+
+unsigned int FASTQReader::getRead(FastQRead* fq)
+{
+  if(!getRecords(&d_views, 1))
+    return 0;
+  materialize(d_views[0], fq);
+  return d_views[0].size;
 }
 
 uint64_t FASTQReader::estimateReads()
 {
+  if(uint64_t lines = d_reader->lineCount()) // exact if the reader indexed the file
+    return lines / 4;
   uint64_t pos = d_reader->getUncPos();
   FastQRead fqr;
   auto size = getRead(&fqr);
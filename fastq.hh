@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include <string_view>
+#include <vector>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdexcept>
@@ -16,6 +18,7 @@ struct FastQRead
   bool exceedsQuality(unsigned int);
   std::string getSangerQualityString() const;
   void reverse();
+  uint64_t getChoiceKey() const; //!< identifies this read no matter its orientation, for reproducible choices (see KeyedRandom)
   bool reversed;
   uint64_t position; //!< Position in the source file. The 64 bits may encode the file too, it is not a number for the end user to use. Feed it to a FastQReader.
 
@@ -27,11 +30,21 @@ struct FastQRead
 
 };
 
+//! A FASTQ record as it is in the file: untrimmed, quality offset not applied. Points into the buffers of the FASTQReader that returned it
+struct FastQRecordView
+{
+  std::string_view header; //!< without the '@'
+  std::string_view nucleotides;
+  std::string_view quality;
+  uint64_t position;       //!< of the record in the (uncompressed) file
+  unsigned int size;       //!< bytes the record takes in the file
+};
+
 //! Reads a single FASTQ file, and can seek in it. Does adapation of quality scores (Sanger by default) and and can also snip off first n or last n bases.
 class FASTQReader
 {
 public:
-  FASTQReader(const std::string& str, unsigned int qoffset);
+  FASTQReader(const std::string& str, unsigned int qoffset, bool useIndexFile=true, unsigned int workers=0); //!< useIndexFile, workers: see LineReader::make
   void setTrim(unsigned int trimLeft, unsigned int trimRight)
   {
     d_snipLeft = trimLeft;
@@ -41,12 +54,24 @@ public:
   {
     d_reader->seek(pos);
   }
+  void advise(LineReader::Access access) //!< see LineReader::advise
+  {
+    d_reader->advise(access);
+  }
   uint64_t estimateReads();
   unsigned int getRead(FastQRead* fq); //!< Get a FastQRead, return number of bytes read
+
+  /** Parses up to max records straight from the buffers of our LineReader, returns how many, 0 on EOF. The views are valid 
+      until the next call on this FASTQReader. Records of any length are fine */
+  unsigned int getRecords(std::vector<FastQRecordView>* views, unsigned int max);
+  void materialize(const FastQRecordView& view, FastQRead* fq) const; //!< trims, and applies the quality offset
+  std::string_view nucleotides(const FastQRecordView& view) const; //!< trimmed, as materialize() would give them
 private:
   unsigned int d_qoffset;
   unsigned int d_snipLeft, d_snipRight;
   std::unique_ptr<LineReader> d_reader;
+  std::string d_carry; // a record that did not fit in one buffer of d_reader
+  std::vector<FastQRecordView> d_views;
 };
 
 //! Reads FASTQs from two (synchronised) files at a time. Does magic with 64 bits offsets to encode which of the two FASTQReader to read from.
@@ -54,15 +79,51 @@ class StereoFASTQReader
 {
 public:
   StereoFASTQReader(const std::string& name1, const std::string& name2, 
-		    unsigned int qoffset) : d_fq1(name1, qoffset), d_fq2(name2, qoffset) 
+		    unsigned int qoffset, bool useIndexFiles=true, unsigned int workers=0) 
+    : d_fq1(name1, qoffset, useIndexFiles, workers), d_fq2(name2, qoffset, useIndexFiles, workers) 
   {}
 
   void setTrim(unsigned int trimLeft, unsigned int trimRight);
   void seek(uint64_t pos);
+  void advise(LineReader::Access access)
+  {
+    d_fq1.advise(access);
+    d_fq2.advise(access);
+  }
   uint64_t estimateReads();
   unsigned int getRead(uint64_t pos, FastQRead* fq2);
   unsigned int getReadPair(FastQRead* fq1, FastQRead* fq2);
+
+  /** Parses up to max pairs straight from the buffers of both files, and calls func(view1, view2) for each of them.
+      Returns how many pairs, 0 once either file ends. The views are only valid during the call, and position of
+      view2 has the bit set that getRead() wants. Turn the ones you keep into FastQRead s with materialize() */
+  template<typename F>
+  unsigned int forEachPair(unsigned int max, F func)
+  {
+    unsigned int n1 = d_fq1.getRecords(&d_views1, max), done = 0;
+    // the second file may cut its batches elsewhere, so we ask it for the rest of ours until it has given all of it
+    while(done < n1) {
+      unsigned int n2 = d_fq2.getRecords(&d_views2, n1 - done);
+      if(!n2)
+        break;
+      for(unsigned int n = 0; n < n2; ++n) {
+        d_views2[n].position |= (1ULL<<63);
+        func(d_views1[done + n], d_views2[n]);
+      }
+      done += n2;
+    }
+    return done;
+  }
+  void materialize(const FastQRecordView& view, FastQRead* fq) const
+  {
+    (view.position & (1ULL<<63) ? d_fq2 : d_fq1).materialize(view, fq);
+  }
+  std::string_view nucleotides(const FastQRecordView& view) const
+  {
+    return d_fq1.nucleotides(view); // both have the same trims
+  }
 private:
   FASTQReader d_fq1, d_fq2;
+  std::vector<FastQRecordView> d_views1, d_views2;
   static uint64_t s_mask;
 };
@@ -1,5 +1,6 @@
 #include "fastqindex.hh"
 #include "misc.hh"
+#include "radixsort.hh"
 #include <boost/lexical_cast.hpp>
 #include <iostream>
 #include <set>
@@ -37,7 +38,7 @@ unique_ptr<vector<HashedPos> > indexFASTQ(FASTQReader* fqreader, const std::stri
     h = qhash(fqr.d_nucleotides.c_str(), chunklen, 0);
     hpos->push_back({h, fqr.position});
   }
-  std::sort(hpos->begin(), hpos->end());
+  radixSort(*hpos, [](const HashedPos& hp) { return hp.hash; }, 1);
 
   fp=fopen((fname+".index").c_str(), "w");
   for(const auto& hpo : *hpos) {
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <vector>
 #include "misc.hh"
 #include "fastq.hh"
 using namespace std;
@@ -12,16 +13,21 @@ int main(int argc, char**argv)
   for(int n = 2 ; n < argc; ++n) {
     FASTQReader fqreader(argv[n], 33);
     FastQRead fqr;
+    vector<FastQRecordView> views;
 
-    while(fqreader.getRead(&fqr)) {
-      auto pos = fqr.d_nucleotides.find(search);
-      if(pos != string::npos) {
-	cout<<fqr.d_nucleotides.substr(pos)<<endl;
-      }
-      else if((pos=fqr.d_nucleotides.find(rsearch)) != string::npos) {
-	fqr.reverse();
-	pos = fqr.d_nucleotides.find(search);
-	cout<<fqr.d_nucleotides.substr(pos)<<endl;
+    // we only make a FastQRead of the reads that match
+    while(fqreader.getRecords(&views, 1024)) {
+      for(const auto& view : views) {
+	auto pos = view.nucleotides.find(search);
+	if(pos != string::npos) {
+	  cout<<view.nucleotides.substr(pos)<<endl;
+	}
+	else if(view.nucleotides.find(rsearch) != string::npos) {
+	  fqreader.materialize(view, &fqr);
+	  fqr.reverse();
+	  pos = fqr.d_nucleotides.find(search);
+	  cout<<fqr.d_nucleotides.substr(pos)<<endl;
+	}
       }
     }
   }
@@ -59,26 +59,32 @@ public:
 
   uint32_t count(const NucleotideStore& ns, const ReferenceGenome& rg) const;
   vector<pair<uint32_t,bool>> getPositions(const NucleotideStore& ns, const ReferenceGenome& rg, uint32_t before=std::numeric_limits<uint32_t>::max()) const;
-  void add(const NucleotideStore& ns, uint32_t pos);
-  
+  void add(uint64_t canonical, uint32_t pos); //!< canonical is KmerIterator::canonical() of the stretch at pos
+  static uint64_t canonicalKey(const NucleotideStore& ns);
+  uint32_t bin(uint64_t canonical) const
+  {
+    return ((canonical * 0x9E3779B97F4A7C15ULL) >> 32) % d_hashsize;
+  }
+
 } g_hashes;
 
-NucleotideStore g_allA, g_allC, g_allG, g_allT;
+NucleotideStore g_allA, g_allC;
+uint64_t g_allATKey, g_allCGKey; // canonical keys of the homopolymers
+
+uint64_t HashCollector::canonicalKey(const NucleotideStore& stretch)
+{
+  KmerIterator ki(stretch.size());
+  for(size_t n = 0; n < stretch.size(); ++n)
+    ki.push(stretch.get(n));
+  return ki.canonical();
+}
 
-void HashCollector::add(const NucleotideStore& stretch, uint32_t pos)
+void HashCollector::add(uint64_t canonical, uint32_t pos)
 {
-  //  
-  //  return;
-  // CG AT
-  uint32_t h;
-  if(!stretch.isCanonical())
-    h = stretch.getRC().hash() % d_hashsize;
-  else
-    h = stretch.hash() % d_hashsize;
+  uint32_t h = bin(canonical);
     
-  //  cout<<"Storing '"<<stretch<<"' at pos, h="<<h<<endl;
   std::lock_guard<std::mutex> l(*d_hashes[h].m);
-  if(stretch==g_allA || stretch==g_allC || stretch == g_allG || stretch == g_allT)
+  if(canonical == g_allATKey || canonical == g_allCGKey)
     if(d_hashes[h].pos.size() >= 100)
       return;
   d_hashes[h].pos.push_back(pos);  
@@ -86,13 +92,7 @@ void HashCollector::add(const NucleotideStore& stretch, uint32_t pos)
 
 uint32_t HashCollector::count(const NucleotideStore& stretch, const ReferenceGenome& rg) const
 {
-  uint32_t h;
-
-  if(stretch.isCanonical()) {
-    h = stretch.hash() % d_hashsize;
-  }
-  else
-    h = stretch.getRC().hash() % d_hashsize;
+  uint32_t h = bin(canonicalKey(stretch));
 
   uint32_t ret=0;
   std::lock_guard<std::mutex> l(*d_hashes[h].m);
@@ -112,14 +112,7 @@ vector<pair<uint32_t,bool>> HashCollector::getPositions(const NucleotideStore& s
 {
   vector<pair<uint32_t,bool>> ret;
 
-  uint32_t h;
-
-  if(stretch.isCanonical()) {
-    h = stretch.hash() % d_hashsize;
-  }
-  else
-    h = stretch.getRC().hash() % d_hashsize;
-
+  uint32_t h = bin(canonicalKey(stretch));
 
   std::lock_guard<std::mutex> l(*d_hashes[h].m);
   //  cout<<"Lookup "<<stretch<<", h="<<h<<", have "<<d_hashes[h].pos.size()<<" candidates"<<endl;
@@ -148,10 +141,11 @@ void indexChr(ReferenceGenome::Chromosome* chromosome, std::string name)
   prctl(PR_SET_NAME, string("Indexing "+name).c_str());
   auto size=chromosome->chromosome.size();
   cout<<"Starting index of '"<<name<<"' with "<<size<<" nucleotides"<<endl;
-  for(size_t pos =0; pos < size - g_unitsize; ++pos) {
-    auto stretch = chromosome->chromosome.getRange(pos,  g_unitsize);
-    g_hashes.add(stretch, chromosome->offset+pos);
-
+  KmerIterator ki(g_unitsize);
+  for(size_t pos = 0; pos < size - 1; ++pos) { // window ends at pos
+    ki.push(chromosome->chromosome.get(pos));
+    if(ki.valid())
+      g_hashes.add(ki.canonical(), chromosome->offset + pos + 1 - g_unitsize);
   }
   cout<<"Done with index of '"<<name<<"' with "<<size<<" nucleotides"<<endl;
 }
@@ -357,9 +351,9 @@ int main(int argc, char**argv)
   for(unsigned int n=0; n < g_unitsize;++n) {
     g_allA.append('A');
     g_allC.append('C');
-    g_allG.append('G');
-    g_allT.append('T');
   }
+  g_allATKey = HashCollector::canonicalKey(g_allA);
+  g_allCGKey = HashCollector::canonicalKey(g_allC);
   
   cout<<"Start reading genome"<<endl;
     
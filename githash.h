@@ -0,0 +1 @@
+#define GIT_HASH "e9f61a2+"
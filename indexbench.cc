@@ -0,0 +1,134 @@
+// microbenchmark of exact read lookups through ReferenceChromosome's minimizer index against the old
+// layout: a full index per read length, a sorted array of (qhash, position) searched with equal_range
+// and verified with memcmp
+// usage: indexbench [reference.fasta] [read length]
+#include <string>
+#include <vector>
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+#include "refgenome.hh"
+
+extern "C" {
+#include "hash.h"
+}
+
+using namespace std;
+
+namespace {
+struct OldIndex
+{
+  struct HashPos {
+    uint32_t d_hash;
+    dnapos_t d_pos;
+    bool operator<(const HashPos& rhs) const
+    {
+      return d_hash < rhs.d_hash;
+    }
+  };
+
+  OldIndex(const string& genome, unsigned int length) : d_genome(genome)
+  {
+    d_index.reserve(genome.length());
+    for(string::size_type pos = 0 ; pos < genome.length() - length; ++pos)
+      d_index.push_back({qhash(genome.c_str() + pos, length, 0), (dnapos_t)pos});
+    sort(d_index.begin(), d_index.end());
+  }
+
+  vector<dnapos_t> getReadPositions(const string& nucleotides) const
+  {
+    vector<dnapos_t> ret;
+    HashPos hp{qhash(nucleotides.c_str(), nucleotides.length(), 0), 0};
+    auto range = equal_range(d_index.begin(), d_index.end(), hp);
+    for(;range.first != range.second; range.first++) {
+      if(!memcmp(d_genome.c_str() + range.first->d_pos, nucleotides.c_str(), nucleotides.length()))
+        ret.push_back(range.first->d_pos);
+    }
+    sort(ret.begin(), ret.end());
+    return ret;
+  }
+
+  const string& d_genome;
+  vector<HashPos> d_index;
+};
+
+string randomFASTA(unsigned int size, mt19937& rng)
+{
+  string ret(">random\n");
+  for(unsigned int n = 0; n < size; ++n) {
+    ret.append(1, "ACGT"[rng() % 4]);
+    if(n % 70 == 69)
+      ret.append(1, '\n');
+  }
+  return ret;
+}
+
+template<typename T>
+double nsPerLookup(const vector<string>& queries, T func, uint64_t* hits)
+{
+  auto start = chrono::steady_clock::now();
+  *hits = 0;
+  for(const auto& q : queries)
+    *hits += func(q).size();
+  auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+  return 1.0*ns / queries.size();
+}
+}
+
+int main(int argc, char** argv)
+try
+{
+  mt19937 rng(42);
+  unique_ptr<ReferenceChromosome> rg;
+  if(argc > 1)
+    rg.reset(new ReferenceChromosome(argv[1]));
+  else
+    rg = ReferenceChromosome::makeFromString(randomFASTA(20000000, rng));
+  unsigned int length = argc > 2 ? atoi(argv[2]) : 100;
+
+  string genome = rg->snippet(0, rg->size() + 1); // includes our '*' padding, like the real index
+  auto start = chrono::steady_clock::now();
+  OldIndex old(genome, length);
+  cout<<"Old index built in "<<chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count()<<" ms"<<endl;
+  start = chrono::steady_clock::now();
+  rg->index(false, 1); // like the old index, on one thread
+  cout<<"New index built in "<<chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count()<<" ms"<<endl;
+  cout<<"Old index has "<<old.d_index.size()<<" entries, new one "<<rg->indexSize()<<endl;
+
+  // half of our queries come from the genome, the other half are random
+  vector<string> queries;
+  for(unsigned int n = 0; n < 1000000; ++n) {
+    if(n % 2)
+      queries.push_back(genome.substr(1 + rng() % (genome.length() - length - 1), length));
+    else {
+      string q;
+      for(unsigned int i = 0; i < length; ++i)
+        q.append(1, "ACGT"[rng() % 4]);
+      queries.push_back(q);
+    }
+  }
+
+  for(unsigned int n = 0; n < 1000; ++n) {
+    auto a = old.getReadPositions(queries[n]);
+    auto b = rg->getReadPositions(queries[n]);
+    sort(b.begin(), b.end());
+    if(a != b) {
+      cerr<<"Layouts disagree on "<<queries[n]<<endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  uint64_t oldHits, newHits;
+  double oldNs = nsPerLookup(queries, [&old](const string& q) { return old.getReadPositions(q); }, &oldHits);
+  double newNs = nsPerLookup(queries, [&rg](const string& q) { return rg->getReadPositions(q); }, &newHits);
+  cout<<"Genome of "<<rg->size()<<" nucleotides, reads of "<<length<<", "<<queries.size()<<" lookups"<<endl;
+  cout<<"Full index, equal_range: "<<oldNs<<" ns/lookup, "<<oldHits<<" hits"<<endl;
+  cout<<"Minimizer index:         "<<newNs<<" ns/lookup, "<<newHits<<" hits"<<endl;
+}
+catch(std::exception& e)
+{
+  cerr<<"Fatal error: "<<e.what()<<endl;
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,85 @@
+// microbenchmark of line reading: LineReader::make() (ReadAheadLineReader or BGZFLineReader for .gz, PlainLineReader otherwise) against
+// zlib's own gzgets, and FASTQ parsing on top of it with FASTQReader, one FastQRead or a batch of views at a time
+// usage: linebench file.fastq[.gz] [rounds]
+#include <string>
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "zstuff.hh"
+#include "fastq.hh"
+
+using namespace std;
+
+namespace {
+template<typename F>
+double secondsFor(unsigned int rounds, F func)
+{
+  auto start = chrono::steady_clock::now();
+  for(unsigned int n = 0; n < rounds; ++n)
+    func();
+  return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count() / 1000000.0 / rounds;
+}
+}
+
+int main(int argc, char** argv)
+{
+  if(argc < 2) {
+    cerr<<"usage: linebench file.fastq[.gz] [rounds]"<<endl;
+    return EXIT_FAILURE;
+  }
+  string fname = argv[1];
+  unsigned int rounds = argc > 2 ? atoi(argv[2]) : 3;
+
+  uint64_t bytes = 0, lines = 0;
+  char line[1024];
+  double secs = secondsFor(rounds, [&]() {
+      auto lr = LineReader::make(fname);
+      bytes = lines = 0;
+      while(lr->fgets(line, sizeof(line))) {
+        ++lines;
+        bytes += strlen(line);
+      }
+    });
+  cout<<"LineReader::fgets: "<<secs<<" s, "<<bytes/secs/1048576<<" MB/s, "<<lines<<" lines"<<endl;
+
+  secs = secondsFor(rounds, [&]() {
+      gzFile gz = gzopen(fname.c_str(), "rb");
+      gzbuffer(gz, 131072);
+      bytes = lines = 0;
+      while(gzgets(gz, line, sizeof(line))) {
+        ++lines;
+        bytes += strlen(line);
+      }
+      gzclose(gz);
+    });
+  cout<<"gzgets:            "<<secs<<" s, "<<bytes/secs/1048576<<" MB/s, "<<lines<<" lines"<<endl;
+
+  uint64_t reads = 0;
+  secs = secondsFor(rounds, [&]() {
+      FASTQReader fq(fname, 33);
+      FastQRead fqr;
+      reads = 0;
+      while(fq.getRead(&fqr))
+        ++reads;
+    });
+  cout<<"FASTQReader:       "<<secs<<" s, "<<reads/secs/1000000<<" M reads/s, "<<reads<<" reads"<<endl;
+
+  secs = secondsFor(rounds, [&]() {
+      FASTQReader fq(fname, 33);
+      vector<FastQRecordView> views;
+      reads = 0;
+      while(fq.getRecords(&views, 1024))
+        reads += views.size();
+    });
+  cout<<"getRecords:        "<<secs<<" s, "<<reads/secs/1000000<<" M reads/s, "<<reads<<" reads"<<endl;
+
+  secs = secondsFor(rounds, [&]() {
+      auto lr = LineReader::make(fname);
+      for(uint64_t pos = 0; pos + 4096 < bytes; pos += bytes / 64)
+        lr->seek(pos);
+    });
+  cout<<"64 forward seeks:  "<<secs<<" s"<<endl;
+}
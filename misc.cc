@@ -6,6 +6,12 @@ using namespace std;
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <boost/lexical_cast.hpp>
+#include <errno.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 //! read a line of text from a FILE* to a std::string, returns false on 'no data'
 bool stringfgets(FILE* fp, std::string* line)
@@ -90,6 +96,115 @@ void reverseNucleotides(std::string* nucleotides)
   }
 }
 
+void InsertSizeModel::operator()(unsigned int insert)
+{
+  if(insert >= d_histo.size())
+    d_histo.resize(insert+1);
+  d_histo[insert]++;
+  if(++d_count == d_nextRecalculation) {
+    recalculate();
+    d_nextRecalculation *= 2;
+  }
+}
+
+InsertSizeModel& InsertSizeModel::operator+=(const InsertSizeModel& rhs)
+{
+  if(rhs.d_histo.size() > d_histo.size())
+    d_histo.resize(rhs.d_histo.size());
+  for(vector<uint32_t>::size_type i = 0; i < rhs.d_histo.size(); ++i)
+    d_histo[i] += rhs.d_histo[i];
+  d_count += rhs.d_count;
+  if(learned()) {
+    recalculate();
+    while(d_nextRecalculation <= d_count)
+      d_nextRecalculation *= 2;
+  }
+  return *this;
+}
+
+void InsertSizeModel::recalculate()
+{
+  // the insert sizes at which 0.1%, 50% and 99.9% of our samples are covered
+  uint64_t cumul = 0;
+  unsigned int quantiles[3] = {0, 0, 0};
+  const double fractions[3] = {0.001, 0.5, 0.999};
+  unsigned int q = 0;
+  for(unsigned int insert = 0; insert < d_histo.size() && q < 3; ++insert) {
+    cumul += d_histo[insert];
+    for(; q < 3 && cumul > fractions[q]*d_count; ++q)
+      quantiles[q] = insert;
+  }
+  // the tails we cut off are thin but not empty, so leave some room
+  unsigned int margin = 16 + (quantiles[2] - quantiles[0])/8;
+  d_low = quantiles[0] > margin ? quantiles[0] - margin : 0;
+  d_high = std::min(d_priorMax, quantiles[2] + margin);
+  d_low = std::min(d_low, d_high);
+  d_median = std::min(quantiles[1], d_high);
+}
+
+MappedFile::MappedFile(const std::string& fname) : d_data(0), d_size(0)
+{
+#ifndef _WIN32
+  struct stat buf;
+  // a pipe or FIFO has no size to map, and would read as empty. Checked before opening, which blocks for a FIFO
+  if(stat(fname.c_str(), &buf) == 0 && !S_ISREG(buf.st_mode))
+    throw runtime_error("Unable to map '"+fname+"': not a regular file");
+  int fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0)
+    throw runtime_error("Unable to open '"+fname+"' for mapping: "+string(strerror(errno)));
+  if(fstat(fd, &buf) < 0) {
+    close(fd);
+    throw runtime_error("Unable to stat '"+fname+"' for mapping: "+string(strerror(errno)));
+  }
+  d_size = buf.st_size;
+  if(d_size) {
+    void* ptr = mmap(0, d_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(ptr == MAP_FAILED) {
+      close(fd);
+      throw runtime_error("Unable to map '"+fname+"': "+string(strerror(errno)));
+    }
+    d_data = (const char*)ptr;
+  }
+  close(fd); // the mapping stays
+#else
+  FILE* fp = fopen(fname.c_str(), "rb");
+  if(!fp)
+    throw runtime_error("Unable to open '"+fname+"' for mapping: "+string(strerror(errno)));
+  d_copy.resize(filesize(fname.c_str()));
+  if(fread(&d_copy[0], 1, d_copy.size(), fp) != d_copy.size()) {
+    fclose(fp);
+    throw runtime_error("Unable to read '"+fname+"' for mapping");
+  }
+  fclose(fp);
+  d_data = d_copy.c_str();
+  d_size = d_copy.size();
+#endif
+}
+
+void MappedFile::adviseSequential()
+{
+#ifndef _WIN32
+  if(d_size)
+    madvise((void*)d_data, d_size, MADV_SEQUENTIAL);
+#endif
+}
+
+void MappedFile::adviseRandom()
+{
+#ifndef _WIN32
+  if(d_size)
+    madvise((void*)d_data, d_size, MADV_RANDOM);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+  if(d_size)
+    munmap((void*)d_data, d_size);
+#endif
+}
+
 string compilerVersion()
 {
 #if defined(__clang__)
@@ -1,7 +1,9 @@
 #pragma once
 #include <stdio.h>
 #include <string>
+#include <vector>
 #include <stdint.h>
+#include <boost/utility.hpp>
 
 void chomp(char* line);
 char* sfgets(char* p, int num, FILE* fp);
@@ -22,10 +24,25 @@ public:
     xTot += val;
     x2Tot += val*val;
   }
+  //! count val as if we saw it count times
+  void operator()(double val, uint64_t count)
+  {
+    N += count;
+    xTot += val*count;
+    x2Tot += val*val*count;
+  }
   bool valid() const
   {
     return N>0;
   }
+  //! Fold in the values seen by another estimator
+  VarMeanEstimator& operator+=(const VarMeanEstimator& rhs)
+  {
+    N += rhs.N;
+    xTot += rhs.xTot;
+    x2Tot += rhs.x2Tot;
+    return *this;
+  }
   friend double mean(const VarMeanEstimator& vme);
   friend double variance(const VarMeanEstimator& vme);
 private:
@@ -46,5 +63,69 @@ inline double variance(const VarMeanEstimator& vme)
   return (vme.x2Tot - vme.xTot*vme.xTot/vme.N)/vme.N;
 }
 
+/** Distribution of the insert sizes of read pairs, learned as pairs get mapped. Until we have seen enough of them,
+    low() and high() span everything up to the prior maximum. After that, they cover the central 99.8% of what we
+    saw plus a margin, never exceeding the prior maximum. Bounds are only recalculated when the number of samples
+    doubles, so they settle quickly and adding is cheap */
+class InsertSizeModel
+{
+public:
+  explicit InsertSizeModel(unsigned int priorMax=1400) : d_low(0), d_high(priorMax), d_median(priorMax/2), d_priorMax(priorMax)
+  {}
+  void operator()(unsigned int insert); //!< learn of a pair with this insert size
+  InsertSizeModel& operator+=(const InsertSizeModel& rhs); //!< fold in what another model learned
+  bool learned() const
+  {
+    return d_count >= c_minSamples;
+  }
+  unsigned int low() const
+  {
+    return d_low;
+  }
+  unsigned int high() const
+  {
+    return d_high;
+  }
+  unsigned int median() const
+  {
+    return d_median;
+  }
+  //! how often we saw each insert size
+  const std::vector<uint32_t>& histogram() const
+  {
+    return d_histo;
+  }
+private:
+  void recalculate();
+  static const uint64_t c_minSamples = 1000;
+  std::vector<uint32_t> d_histo;
+  uint64_t d_count{0};
+  uint64_t d_nextRecalculation{c_minSamples};
+  unsigned int d_low, d_high, d_median;
+  unsigned int d_priorMax;
+};
+
+//! Read-only memory map of a whole file. Where mmap is not available, holds a copy of the file instead
+class MappedFile : boost::noncopyable
+{
+public:
+  explicit MappedFile(const std::string& fname); //!< throws if the file can not be opened or mapped, or is not a regular file
+  ~MappedFile();
+  const char* data() const
+  {
+    return d_data;
+  }
+  uint64_t size() const
+  {
+    return d_size;
+  }
+  void adviseSequential(); //!< we'll read it front to back, so the kernel can read ahead and drop what we passed
+  void adviseRandom();     //!< we'll jump around, reading ahead would be wasted
+private:
+  const char* d_data;
+  uint64_t d_size;
+  std::string d_copy;
+};
+
 std::string compilerVersion();
 void reverseNucleotides(std::string* nucleotides);
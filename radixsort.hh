@@ -0,0 +1,76 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <stdint.h>
+
+/** Stable LSD radix sort of data on key(element), an unsigned integer of up to 64 bits, 8 bits per pass.
+    Passes over bytes that are the same for all keys are skipped, so a small key in a wide type costs nothing extra.
+    Large inputs are counted and scattered by numThreads threads, each owning a contiguous
+    slice of the input, which keeps the sort stable. So to sort on (a, b), sort on b first, then on a.
+    T needs to be default constructible and movable. */
+template<typename T, typename K>
+void radixSort(std::vector<T>& data, K key, unsigned int numThreads)
+{
+  const size_t n = data.size();
+  if(n < 2)
+    return;
+  if(!numThreads || n < 65536) // not worth starting threads for
+    numThreads = 1;
+
+  auto forSlices = [n, numThreads](auto func) { // func(thread, begin, end)
+    if(numThreads == 1) {
+      func(0, 0, n);
+      return;
+    }
+    std::vector<std::thread> threads;
+    for(unsigned int t = 0; t < numThreads; ++t)
+      threads.emplace_back(func, t, n*t/numThreads, n*(t+1)/numThreads);
+    for(auto& t : threads)
+      t.join();
+  };
+
+  // find out which bits differ between the keys
+  std::vector<uint64_t> varying(numThreads);
+  const uint64_t first = key(data[0]);
+  forSlices([&](unsigned int t, size_t begin, size_t end) {
+      uint64_t v = 0;
+      for(size_t i = begin; i < end; ++i)
+        v |= first ^ (uint64_t)key(data[i]);
+      varying[t] = v;
+    });
+  uint64_t diff = 0;
+  for(auto v : varying)
+    diff |= v;
+
+  std::vector<T> tmp(n);
+  std::vector<size_t> offsets(numThreads * 256);
+  for(unsigned int shift = 0; shift < 64; shift += 8) {
+    if(!((diff >> shift) & 0xff))
+      continue;
+
+    forSlices([&](unsigned int t, size_t begin, size_t end) {
+        size_t* counts = &offsets[t*256];
+        std::fill(counts, counts + 256, 0);
+        for(size_t i = begin; i < end; ++i)
+          counts[((uint64_t)key(data[i]) >> shift) & 0xff]++;
+      });
+
+    // all of thread 0's 0s go before thread 1's 0s, etc
+    size_t pos = 0;
+    for(unsigned int digit = 0; digit < 256; ++digit) {
+      for(unsigned int t = 0; t < numThreads; ++t) {
+        size_t count = offsets[t*256 + digit];
+        offsets[t*256 + digit] = pos;
+        pos += count;
+      }
+    }
+
+    forSlices([&](unsigned int t, size_t begin, size_t end) {
+        size_t* out = &offsets[t*256];
+        for(size_t i = begin; i < end; ++i)
+          tmp[out[((uint64_t)key(data[i]) >> shift) & 0xff]++] = std::move(data[i]);
+      });
+    data.swap(tmp);
+  }
+}
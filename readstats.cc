@@ -0,0 +1,224 @@
+#include "readstats.hh"
+#include <algorithm>
+#include <math.h>
+#include "dnamisc.hh"
+extern "C" {
+#include "hash.h"
+}
+
+using namespace std;
+
+DuplicateSketch::DuplicateSketch() : d_registers(1U << c_hllBits), d_heavy(c_heavy)
+{
+  d_sample.reserve(c_maxSample + 1);
+}
+
+void DuplicateSketch::feed(const std::string& nucleotides)
+{
+  uint64_t hash = hash64(nucleotides.c_str(), nucleotides.size(), 0);
+  ++d_total;
+  feedHash(hash);
+  feedHeavy(hash, nucleotides);
+}
+
+void DuplicateSketch::feedHash(uint64_t hash)
+{
+  // HyperLogLog: the top bits pick a register, which remembers the longest run of zeroes it saw in the rest
+  uint64_t rest = hash << c_hllBits;
+  uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - c_hllBits + 1;
+  uint8_t& reg = d_registers[hash >> (64 - c_hllBits)];
+  if(rank > reg)
+    reg = rank;
+
+  if(hash & ((1ULL << d_level) - 1))
+    return;
+  d_sample[hash]++;
+  if(d_sample.size() > c_maxSample)
+    shrinkSample();
+}
+
+//! Misra-Gries: a read in the table gets counted, otherwise it takes a free slot, and if there is none everybody loses a count
+void DuplicateSketch::feedHeavy(uint64_t hash, const std::string& nucleotides)
+{
+  HeavyHitter* free = 0;
+  for(auto& hh : d_heavy) {
+    if(hh.count && hh.hash == hash) {
+      ++hh.count;
+      if(hh.nucleotides.empty())
+        hh.nucleotides = nucleotides; // only copied for reads we see again
+      return;
+    }
+    if(!hh.count && !free)
+      free = &hh;
+  }
+  if(free) {
+    free->hash = hash;
+    free->count = 1;
+    free->nucleotides.clear(); // keeps its capacity
+    return;
+  }
+  for(auto& hh : d_heavy)
+    --hh.count;
+}
+
+void DuplicateSketch::shrinkSample()
+{
+  while(d_sample.size() > c_maxSample) {
+    ++d_level;
+    dropUnsampled();
+  }
+}
+
+void DuplicateSketch::dropUnsampled()
+{
+  uint64_t mask = (1ULL << d_level) - 1;
+  for(auto iter = d_sample.begin(); iter != d_sample.end(); ) {
+    if(iter->first & mask)
+      iter = d_sample.erase(iter);
+    else
+      ++iter;
+  }
+}
+
+void DuplicateSketch::merge(const DuplicateSketch& rhs)
+{
+  d_total += rhs.d_total;
+  for(unsigned int n = 0; n < d_registers.size(); ++n)
+    d_registers[n] = max(d_registers[n], rhs.d_registers[n]);
+
+  if(rhs.d_level > d_level) { // sample at the lower rate of the two
+    d_level = rhs.d_level;
+    dropUnsampled();
+  }
+  uint64_t mask = (1ULL << d_level) - 1;
+  for(const auto& s : rhs.d_sample)
+    if(!(s.first & mask))
+      d_sample[s.first] += s.second;
+  shrinkSample();
+
+  // merged Misra-Gries: add up the counts, keep the c_heavy largest, less the count of the first one that did not make it
+  vector<HeavyHitter> all;
+  const vector<HeavyHitter>* tables[] = {&d_heavy, &rhs.d_heavy};
+  for(auto table : tables)
+    for(const auto& hh : *table) {
+      if(!hh.count)
+        continue;
+      auto iter = find_if(all.begin(), all.end(), [&hh](const HeavyHitter& a) { return a.hash == hh.hash; });
+      if(iter == all.end())
+        all.push_back(hh);
+      else {
+        iter->count += hh.count;
+        if(iter->nucleotides.empty())
+          iter->nucleotides = hh.nucleotides;
+      }
+    }
+  sort(all.begin(), all.end(), [](const HeavyHitter& a, const HeavyHitter& b) { return a.count > b.count; });
+  uint64_t cut = all.size() > c_heavy ? all[c_heavy].count : 0;
+  all.resize(min((size_t)c_heavy, all.size()));
+  for(auto& hh : all)
+    hh.count -= cut;
+  all.resize(c_heavy);
+  d_heavy.swap(all);
+}
+
+double DuplicateSketch::distinct() const
+{
+  const double m = d_registers.size();
+  double sum = 0;
+  unsigned int zeroes = 0;
+  for(auto reg : d_registers) {
+    sum += ldexp(1.0, -reg);
+    zeroes += !reg;
+  }
+  double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  if(estimate <= 2.5 * m && zeroes) // few reads, linear counting does better
+    estimate = m * log(m / zeroes);
+  return estimate;
+}
+
+std::map<uint64_t,uint64_t> DuplicateSketch::getCounts() const
+{
+  std::map<uint64_t,uint64_t> ret;
+  for(const auto& s : d_sample)
+    ret[min(s.second, 20U)] += (uint64_t)s.second << d_level;
+  return ret;
+}
+
+vector<DuplicateSketch::HeavyHitter> DuplicateSketch::heavyHitters() const
+{
+  vector<HeavyHitter> ret;
+  for(const auto& hh : d_heavy)
+    if(hh.count > 1 && !hh.nucleotides.empty())
+      ret.push_back(hh);
+  sort(ret.begin(), ret.end(), [](const HeavyHitter& a, const HeavyHitter& b) { return a.count > b.count; });
+  return ret;
+}
+
+ReadStatistics::ReadStatistics(unsigned int maxReadLength)
+  : d_maxReadLength(maxReadLength), d_qualities(maxReadLength * c_qualities), d_lengths(maxReadLength + 1), d_gc(maxReadLength + 1)
+{
+}
+
+void ReadStatistics::feed(const FastQRead& fq, bool duplicate)
+{
+  d_lengths[min((unsigned int)fq.d_nucleotides.size(), d_maxReadLength)]++;
+
+  unsigned int len = min((unsigned int)fq.d_quality.size(), d_maxReadLength);
+  const uint8_t* quality = (const uint8_t*)fq.d_quality.c_str();
+  uint64_t* counts = &d_qualities[0];
+  for(unsigned int pos = 0; pos < len; ++pos, counts += c_qualities)
+    counts[min(quality[pos], (uint8_t)(c_qualities - 1))]++;
+
+  d_dups.feed(fq.d_nucleotides);
+  if(duplicate)
+    return;
+
+  unsigned int gc = 0;
+  for(char c : fq.d_nucleotides)
+    gc += (c == 'G') | (c == 'C');
+  d_gc[min(gc, d_maxReadLength)]++;
+}
+
+void ReadStatistics::merge(const ReadStatistics& rhs)
+{
+  for(unsigned int n = 0; n < d_qualities.size() && n < rhs.d_qualities.size(); ++n)
+    d_qualities[n] += rhs.d_qualities[n];
+  for(unsigned int n = 0; n < d_lengths.size() && n < rhs.d_lengths.size(); ++n) {
+    d_lengths[n] += rhs.d_lengths[n];
+    d_gc[n] += rhs.d_gc[n];
+  }
+  d_dups.merge(rhs.d_dups);
+}
+
+vector<VarMeanEstimator> ReadStatistics::errorsPerPosition() const
+{
+  vector<VarMeanEstimator> ret(d_maxReadLength);
+  unsigned int used = 0;
+  for(unsigned int pos = 0; pos < d_maxReadLength; ++pos) {
+    for(unsigned int q = 0; q < c_qualities; ++q) {
+      uint64_t count = d_qualities[pos * c_qualities + q];
+      if(count)
+        ret[pos](qToErr(min(q, 59U)), count);
+    }
+    if(ret[pos].valid())
+      used = pos + 1;
+  }
+  ret.resize(used);
+  return ret;
+}
+
+VarMeanEstimator ReadStatistics::errors() const
+{
+  VarMeanEstimator ret;
+  for(const auto& vme : errorsPerPosition())
+    ret += vme;
+  return ret;
+}
+
+vector<uint64_t> ReadStatistics::qualityCounts() const
+{
+  vector<uint64_t> ret(c_qualities);
+  for(unsigned int n = 0; n < d_qualities.size(); ++n)
+    ret[n % c_qualities] += d_qualities[n];
+  return ret;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <stdint.h>
+#include "misc.hh"
+#include "fastq.hh"
+
+/** Duplicate statistics in fixed memory. A HyperLogLog sketch estimates how many distinct reads we saw, a small
+    Misra-Gries table keeps the reads we saw most often, and how many reads we saw once, twice etc comes from a
+    sample of the reads. That sample is picked by hash, so all copies of a read are in it or none are, and halves
+    whenever it gets too big. Sketches of several threads merge() into what one thread seeing all reads would have */
+class DuplicateSketch
+{
+public:
+  DuplicateSketch();
+  void feed(const std::string& nucleotides); //!< count a read
+  void merge(const DuplicateSketch& rhs);   //!< add the reads seen by rhs to ours
+
+  uint64_t total() const //!< reads we were fed
+  {
+    return d_total;
+  }
+  double distinct() const; //!< estimate of the number of distinct reads
+
+  //! in position n, roughly how many reads we saw n times, 20 or more are in 20. Same as the old exact count up to c_maxSample distinct reads
+  std::map<uint64_t,uint64_t> getCounts() const;
+
+  struct HeavyHitter
+  {
+    uint64_t hash;
+    uint64_t count;          //!< lower bound of how often we saw this read
+    std::string nucleotides; //!< only filled once we saw it twice
+  };
+  //! reads we saw more than once and that are still in our table, most frequent first
+  std::vector<HeavyHitter> heavyHitters() const;
+
+  static const unsigned int c_hllBits = 14;     //!< 16384 registers, about 1% standard error
+  static const unsigned int c_heavy = 32;       //!< size of the heavy hitter table
+  static const unsigned int c_maxSample = 1<<16; //!< reads in the sample before we halve it
+private:
+  void feedHash(uint64_t hash);
+  void feedHeavy(uint64_t hash, const std::string& nucleotides);
+  void shrinkSample();
+  void dropUnsampled();
+
+  std::vector<uint8_t> d_registers;
+  std::vector<HeavyHitter> d_heavy;
+  std::unordered_map<uint64_t, uint32_t> d_sample;
+  unsigned int d_level{0}; // we sample 1 in 2^d_level reads
+  uint64_t d_total{0};
+};
+
+/** Everything we learn from the reads themselves: qualities per position, read lengths, GC content and duplicates.
+    All of it lives in fixed size tables sized for maxReadLength, bases beyond that are not counted. Per base we only
+    bump a counter, error rates are calculated from the histograms at the end. Keep one per thread and merge() them */
+class ReadStatistics
+{
+public:
+  explicit ReadStatistics(unsigned int maxReadLength);
+  void feed(const FastQRead& fq, bool duplicate); //!< duplicates do count for everything but the GC histogram
+  void merge(const ReadStatistics& rhs);
+
+  std::vector<VarMeanEstimator> errorsPerPosition() const; //!< error rate per position in the read, up to the longest read
+  VarMeanEstimator errors() const;                        //!< error rate over all bases
+  std::vector<uint64_t> qualityCounts() const;            //!< how often we saw each quality, up to c_qualities
+  const std::vector<uint64_t>& readLengths() const
+  {
+    return d_lengths;
+  }
+  //! in position n, how many reads had n G or C nucleotides. Duplicates are not counted
+  const std::vector<uint64_t>& gcHistogram() const
+  {
+    return d_gc;
+  }
+  const DuplicateSketch& duplicates() const
+  {
+    return d_dups;
+  }
+
+  static const unsigned int c_qualities = 64; //!< higher qualities are counted as 63
+private:
+  unsigned int d_maxReadLength;
+  std::vector<uint64_t> d_qualities; // c_qualities per position
+  std::vector<uint64_t> d_lengths, d_gc;
+  DuplicateSketch d_dups;
+};
@@ -6,6 +6,8 @@
 #include <boost/algorithm/string.hpp>
 #include "misc.hh"
 #include "dnamisc.hh"
+#include "radixsort.hh"
+#include <unistd.h>
 
 extern "C" {
 #include "hash.h"
@@ -14,82 +16,415 @@ extern "C" {
 using boost::lexical_cast;
 using namespace std;
 
+namespace {
+  const uint32_t c_reverseBit = ReferenceChromosome::c_reverseBit;
+
+  //! orders seeds for minimizer selection, so we don't favour poly-A. Invertible, so no ties between different seeds
+  inline uint32_t seedOrder(uint32_t key)
+  {
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+    return key;
+  }
+
+  /* Calls f(key, offset) for each (w,k) minimizer of s: the smallest seed of every w consecutive valid ones,
+     the leftmost one if there is a tie. Because of that, identical stretches of sequence always select
+     identical minimizers, wherever they are. Seeds are canonical, the smaller of the k-mer and its reverse
+     complement, so a stretch and its reverse complement select the same minimizers too. Keys are the 2-bit
+     packed canonical seed, left aligned, with c_reverseBit set if that is the reverse complement of what is
+     in s at offset. Stops when f returns false */
+  template<typename F>
+  void forEachMinimizer(const char* s, size_t len, unsigned int k, unsigned int w, F f)
+  {
+    struct Seed {
+      uint64_t order; // 1<<32 for seeds with anything but ACGT in them
+      uint32_t key;
+      uint32_t offset;
+    };
+    const uint64_t invalid = 1ULL << 32;
+    Seed window[32]; // ring buffer of the last w seeds, w <= 32
+    unsigned int minSlot = 0;
+    uint32_t minOffset = 0;
+    uint32_t emitted = UINT32_MAX;
+    KmerIterator ki(k);
+
+    for(size_t pos = 0; pos < len; ++pos) {
+      ki.push(s[pos]);
+      if(pos + 1 < k)
+        continue;
+      uint32_t seedNum = pos + 1 - k; // also the offset of the seed
+      Seed& slot = window[seedNum % w];
+      slot.offset = seedNum;
+      if(ki.valid()) {
+        slot.key = (ki.canonical() << (32 - 2*k)) | (ki.isReverse() ? c_reverseBit : 0);
+        slot.order = seedOrder(ki.canonical());
+      }
+      else
+        slot.order = invalid;
+
+      if(seedNum + 1 < w) { // no full window yet
+        if(!seedNum || slot.order < window[minSlot].order) {
+          minSlot = seedNum % w;
+          minOffset = seedNum;
+        }
+        continue;
+      }
+      if(seedNum + 1 > w && minOffset + w <= seedNum) { // our minimum fell out, its slot now holds the new seed
+        minSlot = (seedNum + 1) % w; // oldest seed in the window
+        for(unsigned int n = 1; n < w; ++n) {
+          unsigned int cand = (seedNum + 1 + n) % w;
+          if(window[cand].order < window[minSlot].order)
+            minSlot = cand;
+        }
+      }
+      else if(slot.order < window[minSlot].order)
+        minSlot = seedNum % w;
+      minOffset = window[minSlot].offset;
+
+      const Seed& best = window[minSlot];
+      if(best.order != invalid && best.offset != emitted) {
+        if(!f(best.key, best.offset))
+          return;
+        emitted = best.offset;
+      }
+    }
+  }
+
+  /* Votes per diagonal bin and strand for the seed hits of one read, in an open addressing table. Slots are
+     stamped with the read they belong to, so starting on the next read does not need to wipe the table */
+  class DiagonalVotes
+  {
+  public:
+    struct Bin
+    {
+      int64_t bin;
+      int64_t diagonal;     // of the hit nearest to the start of the read
+      uint32_t offset;      // of that hit in the read
+      uint32_t votes;
+      uint32_t generation;
+      bool reverse;
+    };
+    void clear(size_t expected)
+    {
+      size_t size = 64;
+      while(size < 2*expected)
+        size *= 2;
+      if(d_slots.size() < size) {
+        d_slots.assign(size, Bin());
+        d_generation = 0;
+      }
+      if(!++d_generation) { // wrapped around, so old stamps might look current
+        for(auto& slot : d_slots)
+          slot.generation = 0;
+        d_generation = 1;
+      }
+      d_used.clear();
+    }
+    void vote(int64_t bin, bool reverse, int64_t diagonal, uint32_t offset)
+    {
+      Bin* slot = probe(bin, reverse);
+      if(slot->generation != d_generation) {
+        *slot = {bin, diagonal, offset, 0, d_generation, reverse};
+        d_used.push_back(slot - &d_slots[0]);
+      }
+      slot->votes++;
+      if(offset < slot->offset) {
+        slot->offset = offset;
+        slot->diagonal = diagonal;
+      }
+    }
+    const Bin* find(int64_t bin, bool reverse)
+    {
+      Bin* slot = probe(bin, reverse);
+      return slot->generation == d_generation ? slot : 0;
+    }
+    const vector<uint32_t>& used() const { return d_used; } //!< slots we voted in, in order of first vote
+    const Bin& operator[](uint32_t slot) const { return d_slots[slot]; }
+  private:
+    Bin* probe(int64_t bin, bool reverse) // the slot of this bin, or the empty one where it would go
+    {
+      const size_t mask = d_slots.size() - 1;
+      uint64_t h = ((uint64_t)bin * 2 + reverse) * 0x9e3779b97f4a7c15ULL;
+      for(size_t n = h >> 40;; ++n) {
+        Bin* slot = &d_slots[n & mask];
+        if(slot->generation != d_generation || (slot->bin == bin && slot->reverse == reverse))
+          return slot;
+      }
+    }
+    vector<Bin> d_slots;
+    vector<uint32_t> d_used;
+    uint32_t d_generation{0};
+  };
+}
+
 vector<dnapos_t> ReferenceChromosome::getReadPositions(const std::string& nucleotides)
 {
+  static thread_local vector<ReadPosition> positions;
+  getReadPositions(nucleotides, false, &positions);
   vector<dnapos_t> ret;
-  if(!d_indexes.count(nucleotides.length()))
-    throw runtime_error("Attempting to find a read of length we've not indexed for ("+boost::lexical_cast<string>(nucleotides.length())+")");
-  
-  auto& index = d_indexes[nucleotides.length()];
-  
-  uint32_t hashval = qhash(nucleotides.c_str(), nucleotides.length(), 0);
-  HashPos hp(hashval, 0);
-  pair<index_t::const_iterator, index_t::const_iterator> range = equal_range(index.begin(), index.end(), hp);
-  if(range.first == range.second)
-    return ret;
-  
-  for(;range.first != range.second; range.first++) {
-    if(!memcmp(d_genome.c_str() + range.first->d_pos, nucleotides.c_str(), nucleotides.length())) {
-      ret.push_back(range.first->d_pos);
+  for(const auto& rp : positions)
+    ret.push_back(rp.pos);
+  return ret;
+}
+
+void ReferenceChromosome::getReadPositions(const std::string& nucleotides, bool bothStrands, vector<ReadPosition>* ret)
+{
+  ret->clear();
+  // every exact occurrence has all of our minimizers, on either strand, so verifying the hits of any one of them will do
+  pair<const HashPos*, const HashPos*> rarest(0, 0);
+  uint32_t rarestKey = 0, rarestOffset = 0;
+  bool first = true;
+  forEachMinimizer(nucleotides.c_str(), nucleotides.length(), c_seedK, c_seedW, [&](uint32_t key, uint32_t offset) {
+      auto range = d_seeds.find(key);
+      if(first || range.second - range.first < rarest.second - rarest.first) {
+        rarest = range;
+        rarestKey = key;
+        rarestOffset = offset;
+        first = false;
+      }
+      return rarest.second - rarest.first > 4; // few enough to verify, no need to look any further
+    });
+
+  static thread_local string rc; // only made if a hit needs it
+  bool haveRC = false;
+  const uint32_t rcOffset = nucleotides.length() - c_seedK - rarestOffset; // of our seed in the reverse complement
+  for(; rarest.first != rarest.second; rarest.first++) {
+    bool reverse = (rarest.first->d_hash ^ rarestKey) & c_reverseBit;
+    uint32_t offset = reverse ? rcOffset : rarestOffset;
+    if((reverse && !bothStrands) || rarest.first->d_pos < offset)
+      continue;
+    dnapos_t pos = rarest.first->d_pos - offset;
+    if(reverse && !haveRC) {
+      rc = nucleotides;
+      reverseNucleotides(&rc);
+      haveRC = true;
     }
+    const string& s = reverse ? rc : nucleotides;
+    if(d_genome.equal(pos, s.c_str(), s.length()))
+      ret->push_back({pos, reverse});
   }
-  return ret;
+}
+
+void ReferenceChromosome::getSeedChains(const std::string& nucleotides, unsigned int maxChains, bool dense, vector<SeedChain>* ret)
+{
+  const unsigned int maxHits = 1000; // seeds more frequent than this are repeats that tell us nothing
+  const int64_t band = 16;           // diagonals per bin, so the largest indel we see as one chain
+
+  // look up non-overlapping minimizers, so one sequencing error costs at most one seed, unless we are asked
+  // to look at all of them. Our index is canonical, so each lookup finds hits on both strands
+  struct Lookup {
+    pair<const HashPos*, const HashPos*> range;
+    uint32_t key;
+    uint32_t offset;
+  };
+  static thread_local vector<Lookup> lookups; // so we don't allocate per read
+  static thread_local DiagonalVotes votes;
+  lookups.clear();
+  size_t hits = 0;
+  int64_t next = 0;
+  forEachMinimizer(nucleotides.c_str(), nucleotides.length(), c_seedK, c_seedW, [&](uint32_t key, uint32_t offset) {
+      if(!dense && offset < next)
+        return true;
+      next = offset + c_seedK;
+      auto range = d_seeds.find(key);
+      if(range.second - range.first <= maxHits) {
+        lookups.push_back({range, key, offset});
+        hits += range.second - range.first;
+      }
+      return true;
+    });
+
+  votes.clear(hits);
+  for(const auto& l : lookups)
+    for(auto hp = l.range.first; hp != l.range.second; ++hp) {
+      bool reverse = (hp->d_hash ^ l.key) & c_reverseBit;
+      uint32_t offset = reverse ? nucleotides.length() - c_seedK - l.offset : l.offset; // where our seed is in the read as it maps
+      int64_t diagonal = (int64_t)hp->d_pos - offset;
+      votes.vote(diagonal >= 0 ? diagonal / band : -1, reverse, diagonal, offset);
+    }
+
+  // an indel splits a chain over two neighbouring bins, we report the one with most votes (or the earliest seed), counting both
+  auto beats = [](const DiagonalVotes::Bin* a, const DiagonalVotes::Bin& b) {
+    return a && (a->votes > b.votes || (a->votes == b.votes && a->offset < b.offset));
+  };
+  static thread_local vector<SeedChain> chains;
+  static thread_local vector<uint64_t> order; // most seeds first, then in the order we found them
+  chains.clear();
+  for(auto slot : votes.used()) {
+    const auto& bin = votes[slot];
+    auto before = votes.find(bin.bin - 1, bin.reverse), after = votes.find(bin.bin + 1, bin.reverse);
+    if(bin.diagonal <= 0 || beats(before, bin) || beats(after, bin))
+      continue;
+    unsigned int seeds = bin.votes + max(before ? before->votes : 0, after ? after->votes : 0);
+    if(seeds >= 2)
+      chains.push_back({(dnapos_t)bin.diagonal, seeds, bin.reverse});
+  }
+  // a stable sort would allocate
+  order.clear();
+  for(uint32_t n = 0; n < chains.size(); ++n)
+    order.push_back(((uint64_t)~chains[n].seeds << 32) | n);
+  auto keep = min<size_t>(maxChains, order.size());
+  partial_sort(order.begin(), order.begin() + keep, order.end());
+  ret->clear();
+  for(auto iter = order.begin(); iter != order.begin() + keep; ++iter)
+    ret->push_back(chains[(uint32_t)*iter]);
 }
   
-dnapos_t ReferenceChromosome::getReadPosBoth(FastQRead* fq, int qlimit) // tries original & complement
+dnapos_t ReferenceChromosome::getReadPosBoth(FastQRead* fq, int qlimit, uint32_t seed) // tries original & complement
 {
-  vector<dnapos_t> positions;
+  static thread_local vector<ReadPosition> positions; // so we don't allocate per read
+  getReadPositions(fq->d_nucleotides, true, &positions);
+  if(positions.empty())
+    return dnanpos;
+
+  // like we always did, we prefer the original
+  bool reverse = std::find_if(positions.begin(), positions.end(), [](const ReadPosition& rp) { return !rp.reverse; }) == positions.end();
+  positions.erase(std::remove_if(positions.begin(), positions.end(), [reverse](const ReadPosition& rp) { return rp.reverse != reverse; }), positions.end());
+  KeyedRandom rng(fq->getChoiceKey(), seed);
+  auto pick = pickRandom(positions, rng);
+  if(reverse)
+    fq->reverse();
+  cover(pick.pos, fq->d_nucleotides.size(), fq->d_quality, qlimit);
+  return pick.pos;
+}
 
-  for(int tries = 0; tries < 2; ++tries) {
-    positions = getReadPositions(fq->d_nucleotides);
+void ReferenceChromosome::getAllReadPosBoth(const FastQRead& fq, vector<MatchDescriptor>* matches) // tries original & complement
+{
+  static thread_local vector<ReadPosition> positions; // so we don't allocate per read
+  getReadPositions(fq.d_nucleotides, true, &positions);
+  for(const auto& rp : positions)
+    matches->push_back({this, rp.pos, fq.reversed != rp.reverse, 0});
+}
 
-    if(!positions.empty()) {
-      auto pick = pickRandom(positions);
+int Pileup::baseCode(char nucleotide)
+{
+  return nucleotide == 'X' ? Del : nucleotideCode(nucleotide);
+}
 
-      cover(pick, fq->d_nucleotides.size(), fq->d_quality, qlimit);
+void Pileup::resize(dnapos_t size)
+{
+  d_size = size;
+  d_chunks.resize((size + c_chunkLoci - 1) / c_chunkLoci);
+  for(const auto& sample : d_log)
+    fold(sample);
+  d_log.clear();
+}
 
-      return pick;
+void Pileup::fold(const Sample& sample)
+{
+  if(sample.pos >= size())
+    return;
+  auto& c = d_chunks[sample.pos / c_chunkLoci];
+  if(!c)
+    c.reset(new Chunk()); // zeroed
+  unsigned int offset = sample.pos % c_chunkLoci;
+  c->counts[offset*NumBases + sample.base]++;
+  c->qualities[offset*NumBases + sample.base] += sample.quality;
+  if(sample.head)
+    c->heads[offset]++;
+}
+
+void Pileup::add(dnapos_t pos, char nucleotide, char quality, bool head)
+{
+  int base = baseCode(nucleotide);
+  if(base < 0)
+    return;
+  Sample sample{pos, (uint8_t)base, (uint8_t)quality, head};
+  if(!d_size)
+    d_log.push_back(sample);
+  else
+    fold(sample);
+}
+
+void Pileup::merge(Pileup& rhs)
+{
+  if(!d_size && rhs.d_size)
+    resize(rhs.size());
+  for(size_t n = 0; n < d_chunks.size() && n < rhs.d_chunks.size(); ++n) {
+    const Chunk* theirs = rhs.d_chunks[n].get();
+    if(!theirs)
+      continue;
+    auto& ours = d_chunks[n];
+    if(!ours) {
+      ours.reset(new Chunk(*theirs));
+      continue;
     }
-    fq->reverse();
+    for(unsigned int i = 0; i < c_chunkLoci*NumBases; ++i) {
+      ours->counts[i] += theirs->counts[i];
+      ours->qualities[i] += theirs->qualities[i];
+    }
+    for(unsigned int i = 0; i < c_chunkLoci; ++i)
+      ours->heads[i] += theirs->heads[i];
   }
-  return dnanpos;
+
+  if(!d_size)
+    d_log.insert(d_log.end(), rhs.d_log.begin(), rhs.d_log.end());
+  else
+    for(const auto& sample : rhs.d_log)
+      fold(sample);
+  rhs.d_log.clear();
 }
 
-vector<ReferenceChromosome::MatchDescriptor> ReferenceChromosome::getAllReadPosBoth(FastQRead* fq) // tries original & complement
+unsigned int Pileup::total(dnapos_t pos) const
 {
-  vector<MatchDescriptor > ret;
-  string nucleotides;
-  for(int tries = 0; tries < 2; ++tries) {
-    for(auto position : getReadPositions(fq->d_nucleotides)) 
-      ret.push_back({this, position, (bool)tries, 0});
-    fq->reverse();
-  }
+  const Chunk* c = chunk(pos);
+  if(!c)
+    return 0;
+  unsigned int ret = 0;
+  for(unsigned int base = 0; base < NumBases; ++base)
+    ret += c->counts[(pos % c_chunkLoci)*NumBases + base];
   return ret;
 }
 
-void ReferenceChromosome::cover(dnapos_t pos, unsigned int length, const std::string& quality, int limit) 
+void MappingTally::cover(dnapos_t pos, unsigned int length, const std::string& quality, int limit) 
 {
   const char* p = quality.c_str();
   for(unsigned int i = 0; i < length; ++i) {
     if(p[i] > limit)
-      d_mapping[pos+i].coverage++;
+      d_coverage[pos+i]++;
   }
 }
 
-void ReferenceChromosome::cover(dnapos_t pos, char quality, int limit) 
+void MappingTally::cover(dnapos_t pos, char quality, int limit) 
 {
   if(quality > (int) limit)
-    d_mapping[pos].coverage++;
+    d_coverage[pos]++;
+}
+
+void MappingTally::mapFastQ(dnapos_t pos, const FastQRead& fqfrag, int indel)
+{
+  d_placements.push_back({fqfrag.position, pos, indel, fqfrag.reversed});
+}
+
+void MappingTally::merge(MappingTally& rhs)
+{
+  for(dnapos_t pos = 0; pos < d_coverage.size() && pos < rhs.d_coverage.size(); ++pos) 
+    d_coverage[pos] += rhs.d_coverage[pos];
+  for(unsigned int i = 0; i < d_correctMappings.size() && i < rhs.d_correctMappings.size(); ++i) {
+    d_correctMappings[i] += rhs.d_correctMappings[i];
+    d_wrongMappings[i] += rhs.d_wrongMappings[i];
+  }
+  d_pileup.merge(rhs.d_pileup);
+  d_placements.insert(d_placements.end(), rhs.d_placements.begin(), rhs.d_placements.end());
+  rhs.d_placements.clear();
+  for(const auto& locus : rhs.d_inserts) {
+    auto& ours = d_inserts[locus.first];
+    for(const auto& insert : locus.second)
+      ours[insert.first] += insert.second;
+  }
+  rhs.d_inserts.clear();
 }
 
-void ReferenceChromosome::mapFastQ(dnapos_t pos, const FastQRead& fqfrag, int indel)
+MappingTally ReferenceChromosome::makeTally() const
 {
-  FASTQMapping fqm;
-  fqm.pos=fqfrag.position;
-  fqm.reverse = fqfrag.reversed;
-  fqm.indel = indel;
-  d_mapping[pos].d_fastqs.push_front(fqm);
-  //    cout<<"Adding mapping at pos "<<pos<<", indel = "<<indel<<", reverse= "<<fqm.reverse<<endl;
+  MappingTally ret;
+  ret.d_coverage.resize(d_coverage.size());
+  ret.d_correctMappings.resize(d_correctMappings.size());
+  ret.d_wrongMappings.resize(d_wrongMappings.size());
+  return ret;
 }
 
 
@@ -124,11 +459,13 @@ ReferenceChromosome::ReferenceChromosome(const string& fname)
     *spacepos=0;
   d_name=line+1;
   
-  d_genome="*"; // this gets all our offsets ""right""
+  d_genome.append("*"); // this gets all our offsets ""right""
   while(fgets(line, sizeof(line), fp)) {
     chomp(line);
     d_genome.append(line);
   }
+  fclose(fp);
+  d_fname=fname;
   
   initGenome();
 }
@@ -148,7 +485,7 @@ unique_ptr<ReferenceChromosome> ReferenceChromosome::makeFromString(const std::s
     ret->d_name=ret->d_name.substr(0, spacepos);
 
   string line;
-  ret->d_genome="*"; // this gets all our offsets ""right""
+  ret->d_genome.append("*"); // this gets all our offsets ""right""
   while(getline(istr, line)) {
     boost::trim_right(line);
     ret->d_genome.append(line);
@@ -161,34 +498,37 @@ unique_ptr<ReferenceChromosome> ReferenceChromosome::makeFromString(const std::s
 void ReferenceChromosome::initGenome()
 {
   d_aCount = d_cCount = d_gCount = d_tCount = 0;
-  for(const auto& c : d_genome) {
-    switch(c) {
-    case 'A':
-      ++d_aCount;
-      break;
-    case 'C':
-      ++d_cCount;
-      break;
-    case 'G':
-      ++d_gCount;
-      break;
-    case 'T':
-      ++d_tCount;
-      break;
+  const dnapos_t chunk = 1 << 20;
+  for(dnapos_t pos = 0; pos < d_genome.size(); pos += chunk) {
+    for(const auto& c : d_genome.substr(pos, chunk)) {
+      switch(c) {
+      case 'A':
+        ++d_aCount;
+        break;
+      case 'C':
+        ++d_cCount;
+        break;
+      case 'G':
+        ++d_gCount;
+        break;
+      case 'T':
+        ++d_tCount;
+        break;
+      }
     }
   }
 
-  d_mapping.resize(d_genome.size());
+  d_coverage.resize(d_genome.size());
+  d_pileup.resize(d_genome.size());
 }
 
-// returns as if we sampled once per index length, an array of index length bins
-vector<dnapos_t> ReferenceChromosome::getGCHisto()
+// returns as if we sampled once per window length, an array of window length bins
+vector<dnapos_t> ReferenceChromosome::getGCHisto(unsigned int indexlength)
 {
   vector<dnapos_t> ret;
-  unsigned int indexlength = d_indexes.rbegin()->first;
   ret.resize(indexlength); // biggest index
   for(dnapos_t pos = 0; pos < d_genome.size() ; pos += indexlength/4) {
-    ret[round(indexlength*getGCContent(snippet(pos, pos + indexlength)))]++;
+    ret[round(indexlength*view(pos, pos + indexlength).gcContent())]++;
   }
   for(auto& c : ret) {
     c/=4;
@@ -196,7 +536,108 @@ vector<dnapos_t> ReferenceChromosome::getGCHisto()
   return ret;
 }
 
-void ReferenceChromosome::index(unsigned int length)
+namespace {
+  //! On-disk header of an index file, followed by the directory and then 'count' HashPos entries
+  struct IndexFileHeader
+  {
+    char magic[8];
+    uint32_t version;  //!< bump when the seed selection or layout changes
+    uint16_t seedK;
+    uint16_t seedW;
+    uint64_t genomeSize;
+    uint32_t genomeChecksum;
+    uint32_t dirBits;
+    uint64_t count;
+  };
+  const char g_indexMagic[8]={'A','N','T','I','N','D','E','X'};
+  const uint32_t g_indexVersion=4;
+}
+
+// d_built must be sorted and d_dirBits set
+void ReferenceChromosome::Index::makeDirectory()
+{
+  d_begin = d_built.data();
+  d_end = d_begin + d_built.size();
+
+  d_builtDir.resize((1<<d_dirBits) + 1);
+  uint32_t offset = 0;
+  for(uint32_t b = 0; b < d_builtDir.size() - 1; ++b) {
+    d_builtDir[b] = offset;
+    while(offset < d_built.size() && (d_built[offset].d_hash >> (32 - d_dirBits)) == b)
+      ++offset;
+  }
+  d_builtDir.back() = offset;
+  d_dir = d_builtDir.data();
+}
+
+string ReferenceChromosome::indexFileName() const
+{
+  return d_fname+".k"+lexical_cast<string>(c_seedK)+"w"+lexical_cast<string>(c_seedW)+".index";
+}
+
+uint32_t ReferenceChromosome::genomeChecksum() const
+{
+  return d_genome.hash();
+}
+
+bool ReferenceChromosome::loadIndex(Index* index) const
+{
+  unique_ptr<MappedFile> mf;
+  try {
+    mf = unique_ptr<MappedFile>(new MappedFile(indexFileName()));
+  }
+  catch(std::exception& e) {
+    return false;
+  }
+  if(mf->size() < sizeof(IndexFileHeader))
+    return false;
+  IndexFileHeader ifh;
+  memcpy(&ifh, mf->data(), sizeof(ifh));
+  if(memcmp(ifh.magic, g_indexMagic, sizeof(ifh.magic)) || ifh.version != g_indexVersion || 
+     ifh.seedK != c_seedK || ifh.seedW != c_seedW ||
+     ifh.genomeSize != d_genome.size() || ifh.count > d_genome.size() ||
+     ifh.dirBits < 1 || ifh.dirBits > 2*c_seedK)
+    return false;
+  uint64_t dirSize = (1ULL << ifh.dirBits) + 1;
+  if(mf->size() != sizeof(ifh) + dirSize * sizeof(uint32_t) + ifh.count * sizeof(HashPos) || ifh.genomeChecksum != genomeChecksum())
+    return false;
+
+  index->d_dirBits = ifh.dirBits;
+  index->d_dir = (const uint32_t*)(mf->data() + sizeof(ifh));
+  index->d_begin = (const HashPos*)(index->d_dir + dirSize);
+  index->d_end = index->d_begin + ifh.count;
+  index->d_mapped = std::move(mf);
+  return true;
+}
+
+// failure to write is not fatal, we'll just index again next time
+void ReferenceChromosome::saveIndex(const Index& index) const
+{
+  IndexFileHeader ifh;
+  memset(&ifh, 0, sizeof(ifh));
+  memcpy(ifh.magic, g_indexMagic, sizeof(ifh.magic));
+  ifh.version = g_indexVersion;
+  ifh.seedK = c_seedK;
+  ifh.seedW = c_seedW;
+  ifh.genomeSize = d_genome.size();
+  ifh.genomeChecksum = genomeChecksum();
+  ifh.dirBits = index.d_dirBits;
+  ifh.count = index.size();
+
+  string fname = indexFileName();
+  string tmpname = fname + ".tmp" + lexical_cast<string>(getpid()); // rename is atomic, so concurrent runs never see a partial index
+  FILE* fp = fopen(tmpname.c_str(), "wb");
+  if(!fp)
+    return;
+  size_t dirSize = (1 << index.d_dirBits) + 1;
+  bool ok = fwrite(&ifh, sizeof(ifh), 1, fp) == 1 &&
+    fwrite(index.d_dir, sizeof(uint32_t), dirSize, fp) == dirSize &&
+    fwrite(index.begin(), sizeof(HashPos), index.size(), fp) == index.size();
+  if(fclose(fp) || !ok || rename(tmpname.c_str(), fname.c_str()))
+    unlink(tmpname.c_str());
+}
+
+void ReferenceChromosome::setMaxReadLength(unsigned int length)
 {
   if(length > d_correctMappings.size()) {
     d_correctMappings.resize(length);
@@ -204,24 +645,41 @@ void ReferenceChromosome::index(unsigned int length)
     d_taMappings.resize(length);
     d_gcMappings.resize(length);
   }
+}
 
-  auto& index = d_indexes[length];
-  index.reserve(d_genome.length());
-  
-  for(string::size_type pos = 0 ; pos < d_genome.length() - length; ++pos) {
-    uint32_t hashval = qhash(d_genome.c_str() + pos, length, 0);
-    index.push_back(HashPos(hashval, pos));
+void ReferenceChromosome::index(bool useFiles, unsigned int numThreads)
+{
+  if(d_seeds.size())
+    return;
+  useFiles = useFiles && !d_fname.empty();
+  if(useFiles && loadIndex(&d_seeds))
+    return;
+
+  auto& built = d_seeds.d_built;
+  built.reserve(2*d_genome.size()/(c_seedW+1) + 1); // expected minimizer density
+  // unpack a chunk at a time, overlapping by a window, and skip the minimizers we already had
+  const dnapos_t chunk = 1 << 20;
+  for(dnapos_t start = 0; start < d_genome.size(); start += chunk) {
+    string s = d_genome.substr(start, chunk + c_seedK + c_seedW - 2);
+    forEachMinimizer(s.c_str(), s.length(), c_seedK, c_seedW, [&built, start](uint32_t key, uint32_t offset) {
+        if(built.empty() || start + offset > built.back().d_pos)
+          built.push_back(HashPos(key, start + offset));
+        return true;
+      });
   }
 
-  sort(index.begin(), index.end());
-  uint64_t diff = 0;
+  // we built in order of position, and radixSort is stable, so this sorts on (seed, position), both strands mixed
+  radixSort(built, [](const HashPos& hp) { return hp.d_hash & ~c_reverseBit; }, numThreads);
 
-  for(auto iter = index.begin(); iter!= index.end() ; ++iter) {
-    if(iter != index.begin() && iter->d_hash != prev(iter)->d_hash) {
-      diff++;
-    }
-  }
-  // (*g_log)<<"Average fill in genome hash of length "<<length<<": "<<1.0*d_genome.length()/diff<<endl;
+  // aim for a few entries per bucket, within 8 to 24 bits
+  unsigned int bits = 8;
+  while(bits < 24 && (1ULL << bits) < built.size())
+    ++bits;
+  d_seeds.d_dirBits = bits;
+  d_seeds.makeDirectory();
+
+  if(useFiles)
+    saveIndex(d_seeds);
 }
 
 string ReferenceChromosome::getMatchingFastQs(dnapos_t pos, StereoFASTQReader& fastq)
@@ -237,12 +695,20 @@ string ReferenceChromosome::getMatchingFastQs(dnapos_t start, dnapos_t stop, Ste
   if(start > size())
     start = 1;
   string reference=snippet(start, stop);
+  vector<FASTQMapping> placements;
+  for(const auto& fqm : d_placements)
+    if(fqm.locus >= start && fqm.locus < stop)
+      placements.push_back(fqm);
+  radixSort(placements, [](const FASTQMapping& fqm) { return fqm.locus; }, 1);
+
   unsigned int insertPos=0;
+  auto place = placements.cbegin();
   for(unsigned int i = 0 ; i < stop - start; ++i) {
     if(i== (stop-start)/2)
       os << reference << endl;
     string spacer(i, ' ');
-    for(auto& fqm : d_mapping[start+i].d_fastqs) {
+    for(; place != placements.cend() && place->locus == start + i; ++place) {
+      const auto& fqm = *place;
       FastQRead fqr;
       fastq.getRead(fqm.pos, &fqr);
       if(fqm.reverse)
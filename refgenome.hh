@@ -2,36 +2,84 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
-#include <forward_list>
 #include <map>
+#include <algorithm>
+#include <memory>
 #include "geneannotated.hh"
 #include "antonie.hh"
 #include "fastq.hh"
+#include "misc.hh"
+#include "dnamisc.hh"
 
 using std::string;
 using std::vector;
 using std::unordered_map;
 using std::map;
-using std::forward_list; 
 using std::unique_ptr;
+using std::pair;
 
-//! Position of a FastQRead that is mapped here, and how (reverse complemented or with an indel, and where)
+//! Position of a FastQRead that is mapped to locus, and how (reverse complemented or with an indel, and where)
 struct FASTQMapping
 {
   uint64_t pos;
-  bool reverse;
-  int indel; // 0 = nothing, >0 means WE have an insert versus reference at pos
+  dnapos_t locus;
+  int indel; // the first one: 0 = nothing, >0 means WE have an insert versus reference at pos
              // <0 means WE have a delete versus reference at pos
+  bool reverse;
 };
 
-//! List of all FASTQMapping s that map to a locus, plus coverage statistic
-struct GenomeLocusMapping
+/** Per locus tally of the nucleotides in mapped reads that differ from the reference, one flat column per
+    statistic. The columns come in chunks of c_chunkLoci loci, allocated the first time a locus in them differs,
+    so loci no read covers cost nothing but a share of a pointer. A Pileup that was never sized, like the per
+    thread ones, just logs its samples. These get folded into the columns of the Pileup it is merged into */
+class Pileup
 {
-  GenomeLocusMapping() : coverage(0) {}
-  forward_list<FASTQMapping> d_fastqs;
-  unsigned int coverage;
-};
+public:
+  enum Base { A, C, G, T, Del, NumBases };
+  static int baseCode(char nucleotide); //!< Base for ACGT and X (deleted), -1 for anything else
+
+  void resize(dnapos_t size);
+  void add(dnapos_t pos, char nucleotide, char quality, bool head);
+  void merge(Pileup& rhs); //!< adds rhs to us, empties its log
+
+  unsigned int count(dnapos_t pos, Base base) const 
+  { 
+    const Chunk* c = chunk(pos);
+    return c ? c->counts[(pos % c_chunkLoci)*NumBases + base] : 0; 
+  }
+  unsigned int quality(dnapos_t pos, Base base) const //!< sum
+  { 
+    const Chunk* c = chunk(pos);
+    return c ? c->qualities[(pos % c_chunkLoci)*NumBases + base] : 0; 
+  }
+  unsigned int heads(dnapos_t pos) const //!< differences in the head of a read
+  { 
+    const Chunk* c = chunk(pos);
+    return c ? c->heads[pos % c_chunkLoci] : 0; 
+  }
+  unsigned int total(dnapos_t pos) const;
+  dnapos_t size() const { return d_size; }
+private:
+  static const dnapos_t c_chunkLoci = 1024;
+  struct Chunk
+  {
+    uint32_t counts[c_chunkLoci*NumBases], qualities[c_chunkLoci*NumBases]; // NumBases per locus
+    uint32_t heads[c_chunkLoci];
+  };
+  const Chunk* chunk(dnapos_t pos) const { return d_chunks[pos / c_chunkLoci].get(); }
+  struct Sample
+  {
+    dnapos_t pos;
+    uint8_t base;
+    uint8_t quality;
+    bool head;
+  };
+  void fold(const Sample& sample);
 
+  vector<std::unique_ptr<Chunk>> d_chunks; // empty where no locus differs
+  dnapos_t d_size{0};
+  vector<Sample> d_log;
+};
 
 //! A region with little coverage
 struct Unmatched
@@ -40,8 +88,24 @@ struct Unmatched
   dnapos_t pos;
 };
 
+//! Everything we learn while mapping reads to a ReferenceChromosome. Mapping threads each fill their own, which get merged afterwards
+struct MappingTally
+{
+  void cover(dnapos_t pos, char quality, int limit);
+  void cover(dnapos_t pos, unsigned int length, const std::string& quality, int limit) ;
+  void mapFastQ(dnapos_t pos, const FastQRead& fqfrag, int indel=0);
+  void merge(MappingTally& rhs); //!< adds rhs to us, empties its logs
+
+  vector<unsigned int> d_coverage;
+  vector<unsigned int> d_correctMappings, d_wrongMappings;
+  Pileup d_pileup;
+  vector<FASTQMapping> d_placements; //!< append only, in no particular order
+  typedef map<dnapos_t, map<string, unsigned int> > inserts_t;
+  inserts_t d_inserts; //!< per locus, how often we saw each inserted sequence
+};
+
 //! Represents a reference genome to be aligned against
-class ReferenceChromosome
+class ReferenceChromosome : public MappingTally
 {
 public:
   ReferenceChromosome(const string& fname); //!< Read reference from FASTA
@@ -60,46 +124,56 @@ public:
     bool reverse;
     int score;
   };
-  void mapFastQ(dnapos_t pos, const FastQRead& fqfrag, int indel=0);
-  void cover(dnapos_t pos, char quality, int limit);
-  void cover(dnapos_t pos, unsigned int length, const std::string& quality, int limit) ;
-  vector<MatchDescriptor> getAllReadPosBoth(FastQRead* fq); // tries original & complement
-  dnapos_t getReadPosBoth(FastQRead* fq, int qlimit); // tries original & complement
-  vector<dnapos_t> getReadPositions(const std::string& nucleotides);
+  void getAllReadPosBoth(const FastQRead& fq, vector<MatchDescriptor>* matches); // tries original & complement, without turning fq around, appends to matches
+  dnapos_t getReadPosBoth(FastQRead* fq, int qlimit, uint32_t seed=0); // tries original & complement, turns fq if that is what matched
+  vector<dnapos_t> getReadPositions(const std::string& nucleotides); //!< exact matches, any length of at least c_seedK+c_seedW-1
 
-  vector<dnapos_t> getGCHisto();
+  //! An exact match, reverse if it is the reverse complement of the read that matches at pos
+  struct ReadPosition
+  {
+    dnapos_t pos;
+    bool reverse;
+  };
+  void getReadPositions(const std::string& nucleotides, bool bothStrands, vector<ReadPosition>* positions); //!< with one pass over our index, replaces what was in positions
+
+  //! Seed hits on (nearly) the same diagonal, pos is where the read (reverse complemented if reverse) would start
+  struct SeedChain
+  {
+    dnapos_t pos;
+    unsigned int seeds;
+    bool reverse;
+  };
+  /** Looks up non-overlapping seeds of nucleotides and of its reverse complement, at most one per c_seedK nucleotides, and
+      has every hit vote for its diagonal. Returns the diagonals with most votes, best first. With dense, looks up
+      all our minimizers in the read, which costs more lookups but finds more divergent reads. Replaces what was in chains */
+  void getSeedChains(const std::string& nucleotides, unsigned int maxChains, bool dense, vector<SeedChain>* chains);
+
+  vector<dnapos_t> getGCHisto(unsigned int windowLength);
   string snippet(dnapos_t start, dnapos_t stop) const;
+  //! snippet() without the copy
+  PackedNucleotides::View view(dnapos_t start, dnapos_t stop) const
+  {
+    return d_genome.view(start, stop > start ? stop - start : 0);
+  }
 
   void printCoverage(FILE* jsfp, const std::string& fname);
-  void index(unsigned int length);
+  //! build our minimizer seed index on numThreads threads. With useFiles, reuse or write an index file next to the FASTA
+  void index(bool useFiles=false, unsigned int numThreads=1);
+
+  void setMaxReadLength(unsigned int length); //!< sizes our per read position statistics
+  size_t indexSize() const { return d_seeds.size(); } //!< number of seeds in our index
+
+  static const unsigned int c_seedK = 15; //!< nucleotides per seed
+  static const unsigned int c_seedW = 10; //!< we index the smallest of every c_seedW consecutive seeds
+  static const uint32_t c_reverseBit = 1; //!< set in a seed key if the canonical seed is the reverse complement of the sequence
 
   string getMatchingFastQs(dnapos_t pos, StereoFASTQReader& fastq); 
   string getMatchingFastQs(dnapos_t start, dnapos_t stop,  StereoFASTQReader& fastq); 
-  vector<GenomeLocusMapping> d_mapping;
-  vector<unsigned int> d_correctMappings, d_wrongMappings, d_gcMappings, d_taMappings;
+  MappingTally makeTally() const; //!< empty MappingTally sized for us
+  vector<unsigned int> d_gcMappings, d_taMappings;
 
   vector<Unmatched> d_unmRegions;
-  //! statistics for a locus
-  struct LociStats
-  {
-    //! A difference in this locus
-    struct Difference
-    {
-      char nucleotide;
-      char quality;
-      bool headOrTail;
-      string insert;
-      bool operator<(const Difference& b) const
-      {
-	return std::tie(nucleotide, quality) < std::tie(b.nucleotide, b.quality);
-      }
-    };
-    vector<Difference> samples; 
-  };
   dnapos_t d_aCount, d_cCount, d_gCount, d_tCount;
-  typedef unordered_map<dnapos_t, LociStats> locimap_t;
-  locimap_t d_locimap;
-  unordered_map<dnapos_t, unsigned int> d_insertCounts;
   string d_name;
   string d_fullname;
   unique_ptr<GeneAnnotationReader> d_gar;
@@ -110,7 +184,8 @@ public:
 private:
   ReferenceChromosome() = default;
   void initGenome();
-  string d_genome;
+  PackedNucleotides d_genome;
+  string d_fname; //!< FASTA we were read from, empty if made from a string
   struct HashPos {
     HashPos(uint32_t hash_, dnapos_t pos) : d_hash(hash_), d_pos(pos)
     {}
@@ -118,12 +193,46 @@ private:
     uint32_t d_hash;
     dnapos_t d_pos;
     
-    bool operator<(const HashPos& rhs) const 
+    bool operator<(const HashPos& rhs) const //!< both strands of a seed are equal
+    {
+      return (d_hash & ~c_reverseBit) < (rhs.d_hash & ~c_reverseBit);
+    }
+  };
+
+  /** Sorted HashPos array, either built in memory or mapped from an index file. The top d_dirBits of
+      a key select a bucket in d_dir, so a lookup only needs to search a handful of neighbouring entries.
+      Keys are 2-bit packed canonical seeds, left aligned, so there are no collisions to verify. Their c_reverseBit
+      says which strand of the genome has the canonical seed, entries of both strands sort together by position */
+  class Index
+  {
+  public:
+    vector<HashPos> d_built;
+    vector<uint32_t> d_builtDir;
+    unique_ptr<MappedFile> d_mapped;
+    const HashPos* d_begin{0};
+    const HashPos* d_end{0};
+    const uint32_t* d_dir{0}; //!< 2^d_dirBits + 1 offsets into our HashPos array
+    unsigned int d_dirBits{0};
+
+    const HashPos* begin() const { return d_begin; }
+    const HashPos* end() const { return d_end; }
+    size_t size() const { return d_end - d_begin; }
+    pair<const HashPos*, const HashPos*> bucket(uint32_t key) const
+    {
+      uint32_t b = key >> (32 - d_dirBits);
+      return std::make_pair(d_begin + d_dir[b], d_begin + d_dir[b+1]);
+    }
+    pair<const HashPos*, const HashPos*> find(uint32_t key) const
     {
-      return d_hash < rhs.d_hash;
+      auto range = bucket(key);
+      return std::equal_range(range.first, range.second, HashPos(key, 0));
     }
+    void makeDirectory();
   };
+  Index d_seeds; //!< (c_seedW, c_seedK) minimizers of d_genome
 
-  typedef vector<HashPos> index_t;
-  map<int, index_t> d_indexes;
+  string indexFileName() const;
+  uint32_t genomeChecksum() const;
+  bool loadIndex(Index* index) const;
+  void saveIndex(const Index& index) const;
 };
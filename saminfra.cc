@@ -1,5 +1,6 @@
 #include "saminfra.hh"
 #include "fastq.hh"
+#include "radixsort.hh"
 #include <stdexcept>
 #include <string.h>
 #include <string>
@@ -9,7 +10,6 @@
 #include <boost/progress.hpp>
 
 using std::string;
-using std::sort;
 using std::cout;
 using std::endl;
 using std::vector;
@@ -39,7 +39,7 @@ SAMWriter::SAMWriter(const std::string& fname, const std::string& genomeName, dn
   fprintf(d_fp, "@PG\tID:antonie\tPN:antonie\tVN:0.0.0\n");  
 }
 
-void SAMWriter::write(dnapos_t pos, const FastQRead& fqfrag, int indel, int flags, const std::string& rnext, dnapos_t pnext, int32_t tlen)
+void SAMWriter::write(dnapos_t pos, const FastQRead& fqfrag, const std::string& cigar, int flags, const std::string& rnext, dnapos_t pnext, int32_t tlen)
 {
   if(!d_fp) 
     return;
@@ -50,33 +50,16 @@ void SAMWriter::write(dnapos_t pos, const FastQRead& fqfrag, int indel, int flag
     c+=33; // we always output Sanger
   }
 
-  string cigar;
-  if(!indel) {
-    cigar = lexical_cast<string>(fqfrag.d_nucleotides.length());
-    cigar.append(1,'M');
-  }
-  else if(indel < 0) {
-    cigar = lexical_cast<string>(-indel);
-    cigar.append(1,'M');
-    cigar += "1D";
-    cigar += lexical_cast<string>(fqfrag.d_nucleotides.length()+indel);
-    cigar.append(1,'M');
-  }
-  else if(indel > 0) {
-    cigar = lexical_cast<string>(indel);
-    cigar.append(1,'M');
-    cigar += "1I";
-    cigar += lexical_cast<string>(fqfrag.d_nucleotides.length()-1-indel);
-    cigar.append(1,'M');
-
-  }
+  string fullMatch;
+  if(cigar.empty())
+    fullMatch = lexical_cast<string>(fqfrag.d_nucleotides.length()) + "M";
 	
   fprintf(d_fp, "%s\t%u\t%s\t%u\t42\t%s\t"
 	  "%s\t%u\t%d\t"
 	  "%s\t%s\n",
 	  name.c_str(), 
 	  flags + (fqfrag.reversed ? 0x10: 0),
-	  d_genomeName.c_str(), pos, cigar.c_str(),
+	  d_genomeName.c_str(), pos, cigar.empty() ? fullMatch.c_str() : cigar.c_str(),
 	  rnext.c_str(), pnext, tlen,
 	  fqfrag.d_nucleotides.c_str(), quality.c_str());  
 }
@@ -154,10 +137,50 @@ BAMWriter::BAMWriter(const std::string& fname, const std::string& refname, dnapo
   d_zw.write(block.c_str(), block.size());
 }
 
+string bamCigar(const std::string& cigar, unsigned int readLength, unsigned int* refLength)
+{
+  string ret;
+  bamCigar(cigar, readLength, refLength, &ret);
+  return ret;
+}
+
+void bamCigar(const std::string& cigar, unsigned int readLength, unsigned int* refLength, std::string* ret)
+{
+  uint32_t op;
+  if(cigar.empty()) {
+    op = readLength << 4; // "150M"
+    ret->append((const char*)&op, 4);
+    *refLength = readLength;
+    return;
+  }
+  *refLength = 0;
+  uint32_t length = 0;
+  for(auto c : cigar) {
+    if(isdigit(c)) {
+      length = length*10 + (c - '0');
+      continue;
+    }
+    const char* p = strchr("MIDNSHP=X", c);
+    if(!p || !c)
+      throw std::runtime_error("Invalid CIGAR string '"+cigar+"'");
+    op = (length << 4) | (p - "MIDNSHP=X");
+    ret->append((const char*)&op, 4);
+    if(c == 'M' || c == 'D' || c == 'N' || c == '=' || c == 'X')
+      *refLength += length;
+    length = 0;
+  }
+}
+
 string bamCompress(const std::string& dna)
 {
-  const char table[]="=ACMGRSVTWYHKDBN";
   string ret;
+  bamCompress(dna, &ret);
+  return ret;
+}
+
+void bamCompress(const std::string& dna, std::string* ret)
+{
+  const char table[]="=ACMGRSVTWYHKDBN";
   int offset=0;
 
   unsigned char emit=0;
@@ -172,7 +195,7 @@ string bamCompress(const std::string& dna)
 
     if(offset & 1) {// odd position
       emit |= val;
-      ret.append(1, (char) emit);
+      ret->append(1, (char) emit);
       emit=0;
     }
     else {
@@ -181,23 +204,37 @@ string bamCompress(const std::string& dna)
     offset++;
   }
   if(offset & 1) 
-    ret.append(1, (char) emit);
-  return ret;
+    ret->append(1, (char) emit);
 }
 
-void BAMWriter::qwrite(dnapos_t pos, const FastQRead& fqfrag, int indel, int flags, const std::string& rnext, dnapos_t pnext, int32_t tlen)
+void BAMWriter::qwrite(dnapos_t pos, const FastQRead& fqfrag, const std::string& cigar, int flags, const std::string& rnext, dnapos_t pnext, int32_t tlen)
 {
   if(d_fname.empty())
     return;
-  Write w{pos, fqfrag.position, fqfrag.reversed, indel, flags, rnext, pnext, tlen};
-  d_queue.push_back(w);
+  qwrite(&d_queue, pos, fqfrag, cigar, flags, rnext, pnext, tlen);
 }
 
-void BAMWriter::runQueue(StereoFASTQReader& sfq)
+void BAMWriter::qwrite(queue_t* queue, dnapos_t pos, const FastQRead& fqfrag, const std::string& cigar, int flags, const std::string& rnext, dnapos_t pnext, int32_t tlen)
+{
+  Write w{pos, fqfrag.position, fqfrag.reversed, cigar, flags, rnext, pnext, tlen};
+  queue->push_back(w);
+}
+
+void BAMWriter::mergeQueue(queue_t& queue)
 {
   if(d_fname.empty())
     return;
-  sort(d_queue.begin(), d_queue.end());
+  d_queue.insert(d_queue.end(), queue.begin(), queue.end());
+  queue.clear();
+}
+
+void BAMWriter::runQueue(StereoFASTQReader& sfq, unsigned int numThreads)
+{
+  if(d_fname.empty())
+    return;
+  // same order as Write::operator<, radixSort is stable
+  radixSort(d_queue, [](const Write& w) { return w.fpos; }, numThreads);
+  radixSort(d_queue, [](const Write& w) { return w.pos; }, numThreads);
   FastQRead fqfrag;
   std::map<unsigned int, std::vector<std::vector<Write>::iterator>> bins;
 
@@ -208,8 +245,11 @@ void BAMWriter::runQueue(StereoFASTQReader& sfq)
     sfq.getRead(iter->fpos, &fqfrag);
     if(iter->reversed)
       fqfrag.reverse();
-    iter->voffset = write(iter->pos, fqfrag, iter->indel, iter->flags, iter->rnext, iter->pnext, iter->tlen);
-    iter->bin=reg2bin(iter->pos, iter->pos +fqfrag.d_nucleotides.length());
+    iter->voffset = write(iter->pos, fqfrag, iter->cigar, iter->flags, iter->rnext, iter->pnext, iter->tlen);
+    unsigned int refLength;
+    d_cigar.clear();
+    bamCigar(iter->cigar, fqfrag.d_nucleotides.length(), &refLength, &d_cigar);
+    iter->bin=reg2bin(iter->pos, iter->pos + refLength);
     bins[iter->bin].push_back(iter);
   }
 
@@ -296,42 +336,23 @@ void BAMWriter::runQueue(StereoFASTQReader& sfq)
   d_queue.clear();
 }
 
-uint64_t BAMWriter::write(dnapos_t pos, const FastQRead& fqfrag, int indel, int flags, const std::string& rnext, dnapos_t pnext, int32_t tlen)
+uint64_t BAMWriter::write(dnapos_t pos, const FastQRead& fqfrag, const std::string& cigarText, int flags, const std::string& rnext, dnapos_t pnext, int32_t tlen)
 {
-  string block;
-
-  string cigar;
-  uint32_t i;
-  if(!indel) {
-    i=fqfrag.d_nucleotides.length()<<4;
-    cigar.assign((char*)&i, 4); // "150M"
-  }
-  else if(indel < 0) {
-    i=(-indel)<<4;
-    cigar.assign((char*)&i, 4); // first part M
-    i= (1<<4) | 2;              // 1D
-    cigar.append((char*)&i, 4); 
-    i=(fqfrag.d_nucleotides.length()+indel)<<4; // restM
-    cigar.append((char*)&i, 4); 
-  }
-  else if(indel > 0) {
-    i = indel <<4;
-    cigar.assign((char*)&i, 4); // "150M"
-    i= (1<<4) | 1;              // 1I
-    cigar.append((char*)&i, 4); 
-    
-    i=(fqfrag.d_nucleotides.length()-1-indel)<<4; // restM
-    cigar.append((char*)&i, 4); 
-  }
+  string& block = d_block;
+  block.clear();
+  unsigned int refLength;
+  d_cigar.clear();
+  bamCigar(cigarText, fqfrag.d_nucleotides.length(), &refLength, &d_cigar);
+  const string& cigar = d_cigar;
 
   BAMBuilder bb(&block);
   bb.write32(0); // length, placeholder
   bb.write32(0); // reference sequence ID
   bb.write32(pos-1); // 0-based!
-  auto bin = reg2bin(pos-1, pos+fqfrag.d_nucleotides.length()-1); // 0-based!
+  auto bin = reg2bin(pos-1, pos+refLength-1); // 0-based!
   int mapq=0;
-  string name = fqfrag.getNameFromHeader();
-  bb.write32((bin<<16) | (mapq<<8) | (name.length()+1));
+  auto nameLength = std::min(fqfrag.d_header.find(' '), fqfrag.d_header.length()); // like getNameFromHeader()
+  bb.write32((bin<<16) | (mapq<<8) | (nameLength+1));
   flags += (fqfrag.reversed ? 0x10: 0);
   bb.write32((flags << 16) | (cigar.length()/4)); // cigar ops
   bb.write32(fqfrag.d_nucleotides.length());
@@ -339,11 +360,11 @@ uint64_t BAMWriter::write(dnapos_t pos, const FastQRead& fqfrag, int indel, int
   bb.write32(pnext - 1);
   bb.write32(tlen);
 
-  bb.write(name.c_str(), name.length()+1);
+  bb.write(fqfrag.d_header.c_str(), nameLength);
+  bb.write("", 1);
   bb.write(cigar.c_str(), cigar.length());
 
-  string bamcompressed=bamCompress(fqfrag.d_nucleotides);
-  bb.write(bamcompressed.c_str(), bamcompressed.length());
+  bamCompress(fqfrag.d_nucleotides, &block);
   bb.write(fqfrag.d_quality.c_str(), fqfrag.d_quality.length());
   uint32_t len = block.length()-4;
   block.replace(0, 4, (char*)&len, 4);
@@ -6,13 +6,13 @@
 #include "fastq.hh"
 #include "zstuff.hh"
 
-//! Write SAM files, with support for paired-end read mappings
+//! Write SAM files, with support for paired-end read mappings. An empty cigar means all of the read matches
 class SAMWriter
 {
 public:
   SAMWriter(const std::string& fname, const std::string& genome, dnapos_t len);
   ~SAMWriter();
-  void write(dnapos_t pos, const FastQRead& fqfrag, int indel=0, int flags=0, const std::string& rnext="*", dnapos_t pnext=0, int32_t tlen=0 );
+  void write(dnapos_t pos, const FastQRead& fqfrag, const std::string& cigar="", int flags=0, const std::string& rnext="*", dnapos_t pnext=0, int32_t tlen=0 );
 private:
   FILE* d_fp;
   std::string d_fname;
@@ -20,31 +20,23 @@ private:
 };
 
 
-//! Write BAM files, with support for paired-end read mappings
+//! Write BAM files, with support for paired-end read mappings. CIGARs are as in SAM, empty means all of the read matches
 class BAMWriter
 {
 public:
   BAMWriter(const std::string& fname, const std::string& genome, dnapos_t len);
   ~BAMWriter();
-  uint64_t write(dnapos_t pos, const FastQRead& fqfrag, int indel=0, int flags=0, const std::string& rnext="*", dnapos_t pnext=0, int32_t tlen=0 );
-  void qwrite(dnapos_t pos, const FastQRead& fqfrag, int indel=0, int flags=0, const std::string& rnext="*", dnapos_t pnext=0, int32_t tlen=0 );
-  void runQueue(StereoFASTQReader& sfq);
-private:
-
-  std::string d_fname;
-  std::string d_genomeName;
-  BGZFWriter d_zw;
-  FILE* d_baifp;
+  //! A write we will do once our queue runs
   struct Write
   {
     bool operator<(const Write& rhs) const
     {
-      return pos < rhs.pos;
+      return std::tie(pos, fpos) < std::tie(rhs.pos, rhs.fpos);
     }
     dnapos_t pos;
     uint64_t fpos;
     bool reversed;
-    int indel;
+    std::string cigar;
     int flags;
     std::string rnext;
     dnapos_t pnext;
@@ -52,7 +44,30 @@ private:
     uint64_t voffset;
     unsigned int bin;
   };
-  std::vector<Write> d_queue;
+  typedef std::vector<Write> queue_t;
+
+  uint64_t write(dnapos_t pos, const FastQRead& fqfrag, const std::string& cigar="", int flags=0, const std::string& rnext="*", dnapos_t pnext=0, int32_t tlen=0 );
+  void qwrite(dnapos_t pos, const FastQRead& fqfrag, const std::string& cigar="", int flags=0, const std::string& rnext="*", dnapos_t pnext=0, int32_t tlen=0 );
+  //! queue a write on a queue of your own (for example, one per thread), hand it to us with mergeQueue()
+  static void qwrite(queue_t* queue, dnapos_t pos, const FastQRead& fqfrag, const std::string& cigar="", int flags=0, const std::string& rnext="*", dnapos_t pnext=0, int32_t tlen=0 );
+  void mergeQueue(queue_t& queue);
+  bool enabled() const
+  {
+    return !d_fname.empty();
+  }
+  void runQueue(StereoFASTQReader& sfq, unsigned int numThreads); //!< sorts our queue on numThreads threads, and writes it
+private:
+
+  std::string d_fname;
+  std::string d_genomeName;
+  BGZFWriter d_zw;
+  FILE* d_baifp;
+  queue_t d_queue;
+  std::string d_block, d_cigar; // scratch, so writes don't allocate
 };
 
 std::string bamCompress(const std::string& dna);
+void bamCompress(const std::string& dna, std::string* out); //!< appends to out
+//! the binary BAM version of a SAM cigar, which must be valid. Sets *refLength to the number of reference nucleotides it spans
+std::string bamCigar(const std::string& cigar, unsigned int readLength, unsigned int* refLength);
+void bamCigar(const std::string& cigar, unsigned int readLength, unsigned int* refLength, std::string* out); //!< appends to out
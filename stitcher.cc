@@ -53,6 +53,7 @@ int main(int argc, char**argv)
   for(int f = 4; f < argc; ++f) {
     fqreader = new FASTQReader(argv[f], 33);
     fhpos[fqreader]=indexFASTQ(fqreader, argv[f], chunklen);
+    fqreader->advise(LineReader::Access::Random); // getConsensusMatches seeks all over
   }
   setbuf(stdout, 0);
   doStitch(fhpos, startseed, endseed, 10000, chunklen, false);
@@ -0,0 +1,115 @@
+#include <boost/test/unit_test.hpp>
+#include "bandedalign.hh"
+#include <random>
+#include <algorithm>
+BOOST_AUTO_TEST_SUITE(bandedalign_cc)
+using std::string;
+
+namespace {
+// plain dynamic programming: the best edit distance of all of read to any part of reference
+unsigned int simpleDistance(const string& read, const string& reference)
+{
+  std::vector<unsigned int> prev(read.size() + 1), cur(read.size() + 1);
+  for(unsigned int i = 0; i <= read.size(); ++i)
+    prev[i] = i;
+  unsigned int best = prev[read.size()];
+  for(unsigned int j = 1; j <= reference.size(); ++j) {
+    cur[0] = 0;
+    for(unsigned int i = 1; i <= read.size(); ++i) {
+      unsigned int diag = prev[i-1] + (read[i-1] == reference[j-1] && read[i-1] != 'N' ? 0 : 1);
+      cur[i] = std::min({diag, prev[i] + 1, cur[i-1] + 1});
+    }
+    best = std::min(best, cur[read.size()]);
+    prev.swap(cur);
+  }
+  return best;
+}
+}
+
+BOOST_AUTO_TEST_CASE(test_BandedAligner) {
+  BandedAligner ba;
+  string cigar;
+  BOOST_CHECK_EQUAL(ba.align("ACGTACGT", "TTACGTACGTTT", 2), 0U);
+  BOOST_CHECK_EQUAL(ba.start(), 2U);
+  ba.cigar(&cigar);
+  BOOST_CHECK_EQUAL(cigar, "8M");
+
+  string reference = "GATTACAGATTACACCGGTTAACCGGTTAA";
+  string read = reference.substr(0, 12) + reference.substr(14); // misses "CA", which aligns as missing "AC" one earlier
+  BOOST_CHECK_EQUAL(ba.align(read, reference), 2U);
+  BOOST_CHECK_EQUAL(ba.referenceLength(), reference.size());
+  ba.cigar(&cigar);
+  BOOST_CHECK_EQUAL(cigar, "11M2D17M");
+
+  read = reference.substr(0, 15) + "TTT" + reference.substr(15);
+  BOOST_CHECK_EQUAL(ba.align(read, reference), 3U);
+  ba.cigar(&cigar);
+  BOOST_CHECK_EQUAL(cigar, "15M3I15M");
+
+  // "TG" missing is as cheap as a "T" and a "G" missing around a T, but we want one gap
+  reference = "ACGTAACGGATCAGAGTTGCGAGAATGCCATAG";
+  read = reference.substr(0, 17) + reference.substr(19);
+  BOOST_CHECK_EQUAL(ba.align(read, reference), 2U);
+  ba.cigar(&cigar);
+  BOOST_CHECK_EQUAL(cigar, "17M2D14M");
+
+  std::mt19937 rng(1);
+  for(unsigned int length : {30, 64, 100, 128, 150, 300}) {
+    for(unsigned int n = 0; n < 200; ++n) {
+      string genome;
+      for(unsigned int i = 0; i < length + 40; ++i)
+        genome.append(1, "ACGTN"[rng() % 41 / 10]);
+      string read = genome.substr(20, length);
+      for(unsigned int edits = rng() % 6; edits; --edits) {
+        unsigned int pos = rng() % read.size();
+        switch(rng() % 3) {
+        case 0:
+          read[pos] = "ACGT"[rng() % 4];
+          break;
+        case 1:
+          read.insert(pos, rng() % 4 + 1, "ACGT"[rng() % 4]);
+          break;
+        case 2:
+          read.erase(pos, rng() % 4 + 1);
+          break;
+        }
+      }
+      if(read.empty())
+        continue;
+      unsigned int distance = ba.align(read, genome, 20);
+      BOOST_CHECK_EQUAL(distance, simpleDistance(read, genome));
+
+      // replaying the script turns the read into the reference, at the cost the aligner claims
+      string replay;
+      unsigned int r = 0, cost = 0;
+      for(const auto& e : ba.script()) {
+        switch(e.op) {
+        case BandedAligner::Edit::Match:
+          BOOST_CHECK(read.compare(r, e.length, genome, ba.start() + replay.size(), e.length) == 0);
+          replay.append(read, r, e.length);
+          r += e.length;
+          break;
+        case BandedAligner::Edit::Mismatch:
+          replay.append(genome, ba.start() + replay.size(), e.length);
+          r += e.length;
+          cost += e.length;
+          break;
+        case BandedAligner::Edit::Insert:
+          r += e.length;
+          cost += e.length;
+          break;
+        case BandedAligner::Edit::Delete:
+          replay.append(genome, ba.start() + replay.size(), e.length);
+          cost += e.length;
+          break;
+        }
+      }
+      BOOST_CHECK_EQUAL(r, read.size());
+      BOOST_CHECK_EQUAL(cost, distance);
+      BOOST_CHECK_EQUAL(replay.size(), ba.referenceLength());
+      BOOST_CHECK_EQUAL(replay, genome.substr(ba.start(), ba.referenceLength()));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
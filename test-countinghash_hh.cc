@@ -0,0 +1,62 @@
+#include <boost/test/unit_test.hpp>
+#include "countinghash.hh"
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+BOOST_AUTO_TEST_SUITE(countinghash_hh)
+
+BOOST_AUTO_TEST_CASE(test_CountingHashTable) {
+	CountingHashTable<uint32_t> cht(1000);
+	BOOST_CHECK_EQUAL(cht.increment(42), 1);
+	BOOST_CHECK_EQUAL(cht.increment(42), 2);
+	BOOST_CHECK_EQUAL(cht.increment(0), 1);
+	BOOST_CHECK_EQUAL(cht.count(42), 2);
+	BOOST_CHECK_EQUAL(cht.count(0), 1);
+	BOOST_CHECK_EQUAL(cht.count(43), 0);
+	BOOST_CHECK_EQUAL(cht.size(), 2U);
+
+	for(unsigned int n = 0; n < 300; ++n)
+		cht.increment(7);
+	BOOST_CHECK_EQUAL(cht.count(7), 255); // saturates
+
+	// agrees with a map
+	std::mt19937_64 rng(1);
+	CountingHashTable<uint64_t> big(10000);
+	std::map<uint64_t, unsigned int> counts;
+	for(unsigned int n = 0; n < 20000; ++n) {
+		uint64_t key = rng() % 5000 * 0x1000000001ULL; // also keys that only differ in their top bits
+		BOOST_CHECK_EQUAL(big.increment(key), std::min(255U, ++counts[key]));
+	}
+	BOOST_CHECK_EQUAL(big.size(), counts.size());
+	BOOST_CHECK_EQUAL(big.overflowed(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_CountingHashTableFull) {
+	CountingHashTable<uint64_t> cht(10); // 1024 slots, of which we fill 896
+	for(uint64_t key = 1; key <= 2000; ++key)
+		cht.increment(key);
+	BOOST_CHECK_EQUAL(cht.size(), 896U);
+	BOOST_CHECK_EQUAL(cht.overflowed(), 2000U - 896U);
+	BOOST_CHECK_EQUAL(cht.count(1), 1);
+	BOOST_CHECK_EQUAL(cht.count(5000), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_CountingHashTableThreads) {
+	CountingHashTable<uint32_t> cht(100000);
+	std::vector<std::thread> threads;
+	for(unsigned int t = 0; t < 4; ++t)
+		threads.emplace_back([&cht]() {
+				for(uint32_t key = 1; key <= 50000; ++key)
+					cht.increment(key);
+			});
+	for(auto& t : threads)
+		t.join();
+	BOOST_CHECK_EQUAL(cht.size(), 50000U);
+	unsigned int wrong = 0;
+	for(uint32_t key = 1; key <= 50000; ++key)
+		wrong += cht.count(key) != 4;
+	BOOST_CHECK_EQUAL(wrong, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
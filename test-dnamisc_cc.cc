@@ -1,5 +1,7 @@
 #include <boost/test/unit_test.hpp>
+#include <tuple>
 #include "dnamisc.hh"
+#include "misc.hh"
 BOOST_AUTO_TEST_SUITE(misc_hh)
 
 BOOST_AUTO_TEST_CASE(test_kmerMapper) {
@@ -17,4 +19,117 @@ BOOST_AUTO_TEST_CASE(test_kmerMapper) {
   BOOST_CHECK_EQUAL(AminoAcidName('A'), "Alanine");
 }
 
+BOOST_AUTO_TEST_CASE(test_KmerIterator) {
+  std::string seq("ACGTTGCANGATTACAGATTACAGGGT");
+  for(unsigned int k : {4, 11}) {
+    KmerIterator ki(k);
+    for(unsigned int pos = 0; pos < seq.size(); ++pos) {
+      ki.push(seq[pos]);
+      if(pos + 1 < k) {
+        BOOST_CHECK(!ki.valid());
+        continue;
+      }
+      std::string kmer = seq.substr(pos + 1 - k, k), rc = kmer;
+      reverseNucleotides(&rc);
+      BOOST_CHECK_EQUAL(ki.valid(), kmer.find('N') == std::string::npos);
+      if(!ki.valid())
+        continue;
+      KmerIterator fresh(k), freshrc(k);
+      for(auto c : kmer)
+        fresh.push(c);
+      for(auto c : rc)
+        freshrc.push(c);
+      BOOST_CHECK_EQUAL(ki.forward(), fresh.forward());
+      BOOST_CHECK_EQUAL(ki.reverse(), freshrc.forward());
+      BOOST_CHECK_EQUAL(ki.canonical(), freshrc.canonical());
+      if(k == 4)
+        BOOST_CHECK_EQUAL(ki.forward(), kmerMapper(kmer, 0, 4));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PackedNucleotides) {
+  std::string seq("*ACGTTGCANNNNGATTACAGATTACAGGGTRCCATTAGGACCATTTAGACAGATTACAGATAGACCCCAGAGAAAGAGAGATTACAGGGA");
+  PackedNucleotides pn;
+  pn.append(seq.substr(0, 10));
+  pn.append(seq.substr(10));
+  BOOST_CHECK_EQUAL(pn.size(), seq.size());
+  BOOST_CHECK_EQUAL(pn.substr(0), seq);
+  for(unsigned int pos = 0; pos < seq.size(); ++pos) {
+    BOOST_CHECK_EQUAL(pn.get(pos), seq[pos]);
+    BOOST_CHECK_EQUAL(pn.substr(pos, 40), seq.substr(pos, 40));
+  }
+  BOOST_CHECK_THROW(pn.substr(seq.size() + 1), std::out_of_range);
+
+  // the same checks for every kernel we can run here, and they must agree on the mask, counts and early exit
+  std::vector<std::vector<std::tuple<std::vector<uint64_t>, unsigned int, unsigned int, bool> > > perKernel;
+  for(auto kernel : {PackedNucleotides::Kernel::Scalar, PackedNucleotides::Kernel::SSE42, PackedNucleotides::Kernel::AVX2}) {
+    if(!PackedNucleotides::useKernel(kernel))
+      continue;
+    perKernel.emplace_back();
+    auto& results = perKernel.back();
+    // a read with a mismatch, an N and an N that matches, compared everywhere
+    std::string read = seq.substr(5, 70);
+    read[2] = 'A';
+    read[20] = 'N';
+    for(unsigned int pos = 0; pos < seq.size(); ++pos) {
+      std::vector<uint64_t> mask;
+      pn.view(pos, read.size()).mismatches(read, &mask);
+      results.push_back({mask, 0, 0, false});
+      BOOST_REQUIRE_EQUAL(mask.size(), 2U);
+      for(unsigned int i = 0; i < read.size(); ++i) {
+        bool differs = pos + i < seq.size() && read[i] != seq[pos + i];
+        BOOST_CHECK_EQUAL((mask[i/64] >> (i%64)) & 1, differs);
+      }
+      BOOST_CHECK_EQUAL(pn.view(pos, 40).str(), seq.substr(pos, 40));
+      BOOST_CHECK_EQUAL(pn.view(pos, 40).gcContent(), getGCContent(seq.substr(pos, 40)));
+      BOOST_CHECK_EQUAL(pn.equal(pos, seq.c_str() + pos, std::min<size_t>(40, seq.size() - pos)), true);
+      BOOST_CHECK_EQUAL(pn.equal(pos, read.c_str(), std::min<size_t>(40, read.size())), 
+                        seq.compare(pos, 40, read, 0, 40) == 0);
+    }
+
+    // with qualities, long enough for full 32 nucleotide blocks, and in lowercase
+    std::string longRead = seq.substr(1, 80), quality;
+    for(unsigned int i = 0; i < longRead.size(); ++i) {
+      quality.append(1, (char)(i % 41));
+      if(i % 7 == 3)
+        longRead[i] = longRead[i] == 'A' ? 'c' : 'a';
+    }
+    longRead[40] = 'N';
+    for(unsigned int pos = 0; pos < seq.size(); ++pos) {
+      std::vector<uint64_t> mask;
+      auto view = pn.view(pos, longRead.size());
+      auto found = view.mismatches(longRead, quality, 20, &mask);
+      results.push_back({mask, found.good, found.poor, found.stopped});
+      unsigned int good = 0, poor = 0;
+      for(unsigned int i = 0; i < longRead.size(); ++i) {
+        bool differs = pos + i < seq.size() && toupper(longRead[i]) != seq[pos + i];
+        BOOST_CHECK_EQUAL((mask[i/64] >> (i%64)) & 1, differs);
+        if(differs)
+          (quality[i] > 20 ? good : poor)++;
+      }
+      BOOST_CHECK_EQUAL(found.good, good);
+      BOOST_CHECK_EQUAL(found.poor, poor);
+      BOOST_CHECK(!found.stopped);
+    
+      found = view.mismatches(longRead, quality, 20, &mask, 1);
+      results.push_back({mask, found.good, found.poor, found.stopped});
+      if(found.stopped)
+        BOOST_CHECK(found.good >= 1 && found.good <= good);
+      else
+        BOOST_CHECK_EQUAL(found.good, good);
+    }
+  }
+  BOOST_CHECK(!perKernel.empty());
+  for(const auto& results : perKernel)
+    BOOST_CHECK(results == perKernel[0]);
+  // back to the default, the fastest
+  PackedNucleotides::useKernel(PackedNucleotides::Kernel::AVX2) || PackedNucleotides::useKernel(PackedNucleotides::Kernel::SSE42);
+
+  PackedNucleotides lower;
+  lower.append("*acgtTGCANNNNgattacagattacagggtRCCATTAGGACCATTTAGACAGATTACAGATAGACCCCAGAGAAAGAGAGATTACAGGGA");
+  BOOST_CHECK_EQUAL(lower.substr(0), seq);
+  BOOST_CHECK_EQUAL(lower.hash(), pn.hash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
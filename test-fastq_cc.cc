@@ -0,0 +1,164 @@
+#include <boost/test/unit_test.hpp>
+#include "fastq.hh"
+#include <random>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+BOOST_AUTO_TEST_SUITE(fastq_cc)
+
+namespace {
+	struct Record
+	{
+		std::string header, nucleotides, quality;
+		uint64_t position;
+	};
+
+	// reads of all lengths, some longer than any buffer, so records straddle buffer boundaries everywhere
+	std::vector<Record> makeRecords(std::string* content, const char* eol)
+	{
+		std::mt19937 rng(5);
+		std::vector<Record> ret;
+		for(unsigned int n = 0; content->size() < 3000000; ++n) {
+			Record r;
+			r.header = "read" + std::to_string(n) + " extra";
+			unsigned int len = n % 97 ? 1 + rng() % 300 : 1000 + rng() % 400000;
+			for(unsigned int i = 0; i < len; ++i) {
+				r.nucleotides.append(1, "ACGT"[rng() % 4]);
+				r.quality.append(1, '!' + rng() % 42);
+			}
+			r.position = content->size();
+			*content += "@" + r.header + eol + r.nucleotides + eol + "+" + eol + r.quality + eol;
+			ret.push_back(r);
+		}
+		return ret;
+	}
+
+	void writeFile(const std::string& fname, const std::string& content)
+	{
+		if(fname.size() > 3 && fname.substr(fname.size() - 3) == ".gz") {
+			gzFile gz = gzopen(fname.c_str(), "wb");
+			gzwrite(gz, content.c_str(), content.size());
+			gzclose(gz);
+		}
+		else {
+			FILE* fp = fopen(fname.c_str(), "w");
+			fwrite(content.c_str(), 1, content.size(), fp);
+			fclose(fp);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_getRecords) {
+	char dir[] = "/tmp/test-fastqXXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir));
+	for(const char* eol : {"\n", "\r\n"}) {
+		std::string content;
+		auto records = makeRecords(&content, eol);
+		for(const char* name : {"/reads.fastq", "/reads.fastq.gz"}) {
+			std::string fname = std::string(dir) + name;
+			writeFile(fname, content);
+			FASTQReader fq(fname, 33, false);
+			std::vector<FastQRecordView> views;
+			unsigned int n = 0;
+			while(fq.getRecords(&views, 100)) {
+				for(const auto& view : views) {
+					BOOST_REQUIRE(n < records.size());
+					BOOST_CHECK(view.header == records[n].header);
+					BOOST_CHECK(view.nucleotides == records[n].nucleotides);
+					BOOST_CHECK(view.quality == records[n].quality);
+					BOOST_CHECK_EQUAL(view.position, records[n].position);
+					++n;
+				}
+			}
+			BOOST_CHECK_EQUAL(n, records.size());
+
+			// and the same one at a time, after seeking back
+			FastQRead fqr;
+			fq.seek(records[96].position);
+			BOOST_REQUIRE(fq.getRead(&fqr));
+			BOOST_CHECK_EQUAL(fqr.d_nucleotides, records[96].nucleotides);
+			BOOST_CHECK_EQUAL(fqr.position, records[96].position);
+			BOOST_REQUIRE(fq.getRead(&fqr));
+			BOOST_CHECK_EQUAL(fqr.d_header, records[97].header);
+			BOOST_CHECK_EQUAL(fqr.d_nucleotides.size(), records[97].nucleotides.size());
+			unlink(fname.c_str());
+		}
+	}
+	rmdir(dir);
+}
+
+BOOST_AUTO_TEST_CASE(test_forEachPair) {
+	// the same records in a plain and a gzipped file, whose readers cut their batches in different places
+	char dir[] = "/tmp/test-fastqXXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir));
+	std::string content;
+	auto records = makeRecords(&content, "\n");
+	std::string name1 = std::string(dir) + "/reads_1.fastq", name2 = std::string(dir) + "/reads_2.fastq.gz";
+	writeFile(name1, content);
+	writeFile(name2, content);
+	{
+		StereoFASTQReader fastq(name1, name2, 33, false);
+		fastq.setTrim(1, 0);
+		unsigned int n = 0;
+		FastQRead fqr;
+		auto check = [&](const FastQRecordView& view1, const FastQRecordView& view2) {
+			BOOST_REQUIRE(n < records.size());
+			BOOST_CHECK(view1.header == records[n].header);
+			BOOST_CHECK(view2.header == records[n].header);
+			BOOST_CHECK_EQUAL(view1.position, records[n].position);
+			BOOST_CHECK_EQUAL(view2.position, records[n].position | (1ULL<<63));
+			BOOST_CHECK(fastq.nucleotides(view2) == records[n].nucleotides.substr(records[n].nucleotides.size() > 1 ? 1 : 0));
+			fastq.materialize(view2, &fqr);
+			BOOST_CHECK(fqr.d_nucleotides == fastq.nucleotides(view2));
+			BOOST_CHECK_EQUAL(fqr.position, view2.position);
+			++n;
+		};
+		while(fastq.forEachPair(100, check))
+			;
+		BOOST_CHECK_EQUAL(n, records.size());
+	}
+	unlink(name1.c_str());
+	unlink(name2.c_str());
+	rmdir(dir);
+}
+
+BOOST_AUTO_TEST_CASE(test_materialize) {
+	char dir[] = "/tmp/test-fastqXXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir));
+	std::string fname = std::string(dir) + "/short.fastq", gzname = fname + ".gz";
+	FastQRead fqr;
+	for(const auto& name : {fname, gzname}) {
+		writeFile(name, "@one\nACGTACGT\n+\nABCDEFGH\n@two\nTTTT\n+\n!!!!"); // no newline at the end
+		FASTQReader fq(name, 33, false);
+		fq.setTrim(1, 2);
+		BOOST_REQUIRE_EQUAL(fq.getRead(&fqr), 25U);
+		BOOST_CHECK_EQUAL(fqr.d_header, "one");
+		BOOST_CHECK_EQUAL(fqr.d_nucleotides, "CGTAC");
+		BOOST_CHECK_EQUAL(fqr.d_quality, std::string("!\"#$%"));
+		BOOST_REQUIRE_EQUAL(fq.getRead(&fqr), 16U);
+		BOOST_CHECK_EQUAL(fqr.d_nucleotides, "T");
+		BOOST_CHECK_EQUAL(fqr.d_quality, std::string(1, 0));
+		BOOST_CHECK_EQUAL(fq.getRead(&fqr), 0U);
+
+		writeFile(name, "@one\nACGTACGT\n+\nABCDEFGH\n@two\nTTTT\n");
+		FASTQReader truncated(name, 33, false);
+		BOOST_REQUIRE(truncated.getRead(&fqr));
+		BOOST_CHECK_THROW(truncated.getRead(&fqr), std::runtime_error);
+	}
+	unlink(gzname.c_str());
+
+	// qualities below the offset are an error
+	FASTQReader fq66(fname, 66);
+	BOOST_CHECK_THROW(fq66.getRead(&fqr), std::runtime_error);
+
+	writeFile(fname, "ACGT\n");
+	FASTQReader notfq(fname, 33);
+	BOOST_CHECK_THROW(notfq.getRead(&fqr), std::runtime_error);
+	unlink(fname.c_str());
+	rmdir(dir);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
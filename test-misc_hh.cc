@@ -23,4 +23,39 @@ BOOST_AUTO_TEST_CASE(test_reverseNucleotides) {
 	BOOST_CHECK_EQUAL(tst, "");	
 }
 
+BOOST_AUTO_TEST_CASE(test_InsertSizeModel) {
+	InsertSizeModel ism(1400);
+	BOOST_CHECK(!ism.learned());
+	BOOST_CHECK_EQUAL(ism.low(), 0U);
+	BOOST_CHECK_EQUAL(ism.high(), 1400U);
+
+	// triangular around 300, from 200 to 400
+	for(unsigned int n = 0; n < 20; ++n)
+		for(unsigned int i = 0; i <= 100; ++i)
+			for(unsigned int j = 0; j < 100 - i + 1; ++j) {
+				ism(300 + i);
+				if(i)
+					ism(300 - i);
+			}
+	BOOST_CHECK(ism.learned());
+	BOOST_CHECK_EQUAL(ism.median(), 300U);
+	BOOST_CHECK(ism.low() < 205 && ism.low() > 150);
+	BOOST_CHECK(ism.high() > 395 && ism.high() < 450);
+	BOOST_CHECK_EQUAL(ism.histogram().size(), 401U);
+	BOOST_CHECK_EQUAL(ism.histogram()[300], 20*101U);
+
+	InsertSizeModel other(1400);
+	for(unsigned int i = 0; i < 10; ++i)
+		other(1000);
+	other += ism;
+	BOOST_CHECK(other.learned());
+	BOOST_CHECK_EQUAL(other.median(), 300U);
+	BOOST_CHECK_EQUAL(other.histogram()[1000], 10U);
+
+	InsertSizeModel tight(400);
+	for(unsigned int i = 0; i < 2000; ++i)
+		tight(390 + i % 20);
+	BOOST_CHECK_EQUAL(tight.high(), 400U); // never beyond the prior
+}
+
 BOOST_AUTO_TEST_SUITE_END()
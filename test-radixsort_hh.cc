@@ -0,0 +1,31 @@
+#include <boost/test/unit_test.hpp>
+#include "radixsort.hh"
+#include <random>
+#include <utility>
+BOOST_AUTO_TEST_SUITE(radixsort_hh)
+
+BOOST_AUTO_TEST_CASE(test_radixSort) {
+	typedef std::pair<uint64_t, uint32_t> rec_t; // key, original position
+	std::mt19937_64 rng(1);
+	for(unsigned int threads : {1, 4}) {
+		for(uint64_t range : {10ULL, 100000ULL, ~0ULL}) {
+			std::vector<rec_t> data, expected;
+			for(uint32_t n = 0; n < 200000; ++n)
+				data.push_back({rng() % range, n});
+			expected = data;
+			std::stable_sort(expected.begin(), expected.end(), [](const rec_t& a, const rec_t& b) {
+					return a.first < b.first;
+				});
+			radixSort(data, [](const rec_t& r) { return r.first; }, threads);
+			BOOST_CHECK(data == expected);
+		}
+	}
+
+	std::vector<uint32_t> small{3, 1, 2}, empty;
+	radixSort(small, [](uint32_t v) { return v; }, 1);
+	BOOST_CHECK(small == std::vector<uint32_t>({1, 2, 3}));
+	radixSort(empty, [](uint32_t v) { return v; }, 1);
+	BOOST_CHECK(empty.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
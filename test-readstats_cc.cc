@@ -0,0 +1,99 @@
+#include <boost/test/unit_test.hpp>
+#include "readstats.hh"
+#include "dnamisc.hh"
+#include <random>
+BOOST_AUTO_TEST_SUITE(readstats_cc)
+
+namespace {
+	std::string randomRead(std::mt19937& rng, unsigned int len)
+	{
+		std::string ret;
+		for(unsigned int n = 0; n < len; ++n)
+			ret.append(1, "ACGT"[rng() % 4]);
+		return ret;
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_DuplicateSketch) {
+	std::mt19937 rng(1);
+	DuplicateSketch ds;
+	std::vector<std::string> reads;
+	for(unsigned int n = 0; n < 1000; ++n)
+		reads.push_back(randomRead(rng, 50));
+	for(const auto& r : reads)
+		ds.feed(r);
+	for(unsigned int n = 0; n < 100; ++n) // seen twice
+		ds.feed(reads[n]);
+	for(unsigned int n = 0; n < 50; ++n) // seen 52 times
+		ds.feed(reads[999]);
+
+	BOOST_CHECK_EQUAL(ds.total(), 1150U);
+	BOOST_CHECK_CLOSE(ds.distinct(), 1000.0, 3);
+	auto counts = ds.getCounts(); // exact this small
+	BOOST_CHECK_EQUAL(counts[1], 899U);
+	BOOST_CHECK_EQUAL(counts[2], 200U);
+	BOOST_CHECK_EQUAL(counts[20], 51U);
+	auto heavy = ds.heavyHitters();
+	BOOST_REQUIRE(!heavy.empty());
+	BOOST_CHECK_EQUAL(heavy[0].nucleotides, reads[999]);
+	BOOST_CHECK(heavy[0].count > 1 && heavy[0].count <= 51);
+}
+
+BOOST_AUTO_TEST_CASE(test_DuplicateSketchMerge) {
+	// two halves merged give the same sample and distinct count as one sketch seeing everything, also once sampling kicks in
+	std::mt19937 rng(2);
+	DuplicateSketch all, first, second;
+	for(unsigned int n = 0; n < 3 * DuplicateSketch::c_maxSample; ++n) {
+		std::string read = randomRead(rng, 40);
+		unsigned int copies = 1 + (n % 7 == 0);
+		for(unsigned int c = 0; c < copies; ++c) {
+			all.feed(read);
+			(n % 2 ? first : second).feed(read);
+		}
+	}
+	first.merge(second);
+	BOOST_CHECK_EQUAL(first.total(), all.total());
+	BOOST_CHECK_EQUAL(first.distinct(), all.distinct());
+	BOOST_CHECK(first.getCounts() == all.getCounts());
+	BOOST_CHECK_CLOSE(all.distinct(), 3.0 * DuplicateSketch::c_maxSample, 3);
+	auto counts = all.getCounts();
+	double twice = 2.0 * 3 * DuplicateSketch::c_maxSample / 7;
+	BOOST_CHECK_CLOSE(1.0 * counts[2], twice, 5);
+}
+
+BOOST_AUTO_TEST_CASE(test_ReadStatistics) {
+	ReadStatistics rs(10), other(10);
+	FastQRead fq;
+	fq.d_nucleotides = "ACGTGCAAAT"; // 4 GC
+	fq.d_quality = std::string(10, 30);
+	fq.d_quality[9] = 10;
+	rs.feed(fq, false);
+	fq.d_nucleotides = "GGGCC";
+	fq.d_quality = std::string(5, 20);
+	other.feed(fq, false);
+	other.feed(fq, true);
+	rs.merge(other);
+
+	BOOST_CHECK_EQUAL(rs.readLengths()[10], 1U);
+	BOOST_CHECK_EQUAL(rs.readLengths()[5], 2U);
+	BOOST_CHECK_EQUAL(rs.gcHistogram()[4], 1U);
+	BOOST_CHECK_EQUAL(rs.gcHistogram()[5], 1U); // the duplicate does not count
+	BOOST_CHECK_EQUAL(rs.qualityCounts()[30], 9U);
+	BOOST_CHECK_EQUAL(rs.qualityCounts()[20], 10U);
+	BOOST_CHECK_EQUAL(rs.duplicates().total(), 3U);
+
+	auto errors = rs.errorsPerPosition();
+	BOOST_REQUIRE_EQUAL(errors.size(), 10U);
+	BOOST_CHECK_CLOSE(mean(errors[0]), (qToErr(30) + 2 * qToErr(20)) / 3, 0.001);
+	BOOST_CHECK_CLOSE(mean(errors[9]), qToErr(10), 0.001);
+	BOOST_CHECK_CLOSE(mean(rs.errors()), (9 * qToErr(30) + 10 * qToErr(20) + qToErr(10)) / 20, 0.001);
+
+	fq.d_nucleotides = std::string(30, 'G'); // longer than we were sized for
+	fq.d_quality = std::string(30, 40);
+	rs.feed(fq, false);
+	BOOST_CHECK_EQUAL(rs.readLengths()[10], 2U);
+	BOOST_CHECK_EQUAL(rs.gcHistogram()[10], 1U);
+	BOOST_CHECK_EQUAL(rs.qualityCounts()[40], 10U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
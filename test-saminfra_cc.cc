@@ -1,5 +1,6 @@
 #include <boost/test/unit_test.hpp>
 #include "saminfra.hh"
+#include <stdexcept>
 BOOST_AUTO_TEST_SUITE(saminfra_hh)
 using std::string;
 
@@ -9,7 +10,21 @@ BOOST_AUTO_TEST_CASE(test_bamCompress) {
   BOOST_CHECK_EQUAL(bamCompress("ACACACAC"), string("\x12\x12\x12\x12", 4));
   BOOST_CHECK_EQUAL(bamCompress("NNNN"), string("\xff\xff", 2));
   BOOST_CHECK_EQUAL(bamCompress("PPPP"), string("\xff\xff", 2));
+  string out("x");
+  bamCompress("ACA", &out);
+  BOOST_CHECK_EQUAL(out, string("x\x12\x10", 3));
 }
 
+BOOST_AUTO_TEST_CASE(test_bamCigar) {
+  unsigned int refLength;
+  BOOST_CHECK_EQUAL(bamCigar("", 150, &refLength), string("\x60\x09\0\0", 4));
+  BOOST_CHECK_EQUAL(refLength, 150U);
+  BOOST_CHECK_EQUAL(bamCigar("40M2I8M1D50M", 100, &refLength), string("\x80\x02\0\0" "\x21\0\0\0" "\x80\0\0\0" "\x12\0\0\0" "\x20\x03\0\0", 20));
+  BOOST_CHECK_EQUAL(refLength, 99U);
+  string out("x");
+  bamCigar("8M", 8, &refLength, &out);
+  BOOST_CHECK_EQUAL(out, string("x\x80\0\0\0", 5));
+  BOOST_CHECK_THROW(bamCigar("40Q", 40, &refLength), std::runtime_error);
+}
 
 BOOST_AUTO_TEST_SUITE_END()
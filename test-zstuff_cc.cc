@@ -0,0 +1,243 @@
+#include <boost/test/unit_test.hpp>
+#include "zstuff.hh"
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+BOOST_AUTO_TEST_SUITE(zstuff_cc)
+
+namespace {
+	// a few MB of FASTQ-like lines, so we get several access points
+	std::string makeContent()
+	{
+		std::mt19937 rng(3);
+		std::string ret;
+		for(unsigned int n = 0; ret.size() < 3 * ZLineReader::c_span; ++n) {
+			ret += "@read" + std::to_string(n) + "\n";
+			for(unsigned int i = 0; i < 100; ++i)
+				ret.append(1, "ACGT"[rng() % 4]);
+			ret += "\n+\n" + std::string(100, 'I') + "\n";
+		}
+		return ret;
+	}
+
+	// writes content as one gzip stream, or as several concatenated ones
+	void writeGzip(const std::string& fname, const std::string& content, unsigned int streams)
+	{
+		unlink(fname.c_str());
+		for(unsigned int s = 0; s < streams; ++s) {
+			gzFile gz = gzopen(fname.c_str(), "ab");
+			size_t begin = content.size() * s / streams, end = content.size() * (s + 1) / streams;
+			gzwrite(gz, content.c_str() + begin, end - begin);
+			gzclose(gz);
+		}
+	}
+
+	// the line fgets should give us at pos
+	std::string lineAt(const std::string& content, uint64_t pos)
+	{
+		return content.substr(pos, content.find('\n', pos) - pos + 1);
+	}
+
+	void checkSeeks(LineReader& zlr, const std::string& content)
+	{
+		std::mt19937_64 rng(4);
+		char line[1024];
+		for(unsigned int n = 0; n < 50; ++n) {
+			uint64_t pos = rng() % (content.size() - 1);
+			zlr.seek(pos);
+			BOOST_REQUIRE(zlr.fgets(line, sizeof(line)));
+			BOOST_CHECK_EQUAL(line, lineAt(content, pos));
+			BOOST_CHECK_EQUAL(zlr.getUncPos(), pos + strlen(line));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_ZLineReaderIndex) {
+	char dir[] = "/tmp/test-zstuffXXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir));
+	std::string content = makeContent();
+	uint64_t lines = std::count(content.begin(), content.end(), '\n');
+
+	for(unsigned int streams : {1, 3}) {
+		std::string fname = std::string(dir) + "/reads.fastq.gz";
+		writeGzip(fname, content, streams);
+		unlink((fname + ".zindex").c_str());
+		{
+			// seeks before we know the whole file, going beyond what we inflated so far
+			ZLineReader zlr(fname, false);
+			BOOST_CHECK_EQUAL(zlr.lineCount(), 0U);
+			checkSeeks(zlr, content);
+		}
+		{
+			ZLineReader zlr(fname);
+			std::string read;
+			char line[1024];
+			while(zlr.fgets(line, sizeof(line)))
+				read += line;
+			BOOST_CHECK(read == content);
+			BOOST_CHECK_EQUAL(zlr.lineCount(), lines);
+			BOOST_CHECK_EQUAL(zlr.uncompressedSize(), content.size());
+		}
+		BOOST_REQUIRE_EQUAL(access((fname + ".zindex").c_str(), R_OK), 0);
+		{
+			// knows everything from the start now
+			ZLineReader zlr(fname);
+			BOOST_CHECK_EQUAL(zlr.lineCount(), lines);
+			BOOST_CHECK_EQUAL(zlr.uncompressedSize(), content.size());
+			checkSeeks(zlr, content);
+		}
+		unlink((fname + ".zindex").c_str());
+		unlink(fname.c_str());
+	}
+	rmdir(dir);
+}
+
+BOOST_AUTO_TEST_CASE(test_ThreadedLineReaders) {
+	char dir[] = "/tmp/test-zstuffXXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir));
+	std::string content = makeContent();
+	uint64_t lines = std::count(content.begin(), content.end(), '\n');
+
+	std::string plain = std::string(dir) + "/plain.fastq.gz", bgzf = std::string(dir) + "/bgzf.fastq.gz";
+	writeGzip(plain, content, 1);
+	{
+		BGZFWriter bw(bgzf);
+		for(std::string::size_type pos = 0; pos < content.size(); ) {
+			auto end = content.find('\n', pos) + 1;
+			bw.write(content.c_str() + pos, end - pos);
+			pos = end;
+		}
+	}
+	BOOST_CHECK(!BGZFLineReader::detect(plain));
+	BOOST_CHECK(BGZFLineReader::detect(bgzf));
+
+	for(const auto& fname : {plain, bgzf}) {
+		auto lr = LineReader::make(fname, false);
+		BOOST_CHECK(dynamic_cast<ThreadedLineReader*>(lr.get()));
+		// all of it twice, so the threads stop and start again
+		for(unsigned int round = 0; round < 2; ++round) {
+			lr->seek(0);
+			std::string read;
+			char line[1024];
+			while(lr->fgets(line, sizeof(line)))
+				read += line;
+			BOOST_CHECK(read == content);
+			BOOST_CHECK_EQUAL(lr->getUncPos(), content.size());
+		}
+		BOOST_CHECK_EQUAL(lr->lineCount(), lines);
+		BOOST_CHECK_EQUAL(lr->uncompressedSize(), content.size());
+		checkSeeks(*lr, content);
+	}
+	{
+		// seeks before we read all of it, with a single inflate worker
+		auto lr = LineReader::make(bgzf, true, 1);
+		checkSeeks(*lr, content);
+	}
+	{
+		// reading on at EOF, more often than it takes to start the threads
+		writeGzip(plain, "ab\ncd\n", 1);
+		auto lr = LineReader::make(plain, false);
+		char line[16];
+		BOOST_REQUIRE(lr->fgets(line, sizeof(line)));
+		BOOST_REQUIRE(lr->fgets(line, sizeof(line)));
+		for(unsigned int n = 0; n < 8; ++n) {
+			BOOST_CHECK(!lr->fgets(line, sizeof(line)));
+			BOOST_CHECK(lr->buffered().empty());
+			BOOST_CHECK_EQUAL(lr->getUncPos(), 6U);
+		}
+	}
+	std::string corrupt = std::string(dir) + "/corrupt.fastq.gz";
+	{
+		// a first block that claims to inflate to 4GB
+		FILE* fp = fopen(bgzf.c_str(), "r");
+		std::string data(65536, 0);
+		data.resize(fread(&data[0], 1, data.size(), fp));
+		fclose(fp);
+		unsigned int bsize = (unsigned char)data[16] | ((unsigned char)data[17] << 8);
+		BOOST_REQUIRE(bsize < data.size());
+		memset(&data[bsize + 1 - 4], 0xff, 4);
+		fp = fopen(corrupt.c_str(), "w");
+		fwrite(data.c_str(), 1, bsize + 1, fp);
+		fclose(fp);
+		BGZFLineReader br(corrupt, 1);
+		char line[1024];
+		// rejected while reading the header, not after allocating and inflating
+		BOOST_CHECK_EXCEPTION(br.fgets(line, sizeof(line)), std::runtime_error, [](const std::runtime_error& e) {
+				return strstr(e.what(), "No BGZF block");
+			});
+	}
+	unlink(corrupt.c_str());
+	unlink(plain.c_str());
+	unlink(bgzf.c_str());
+	rmdir(dir);
+}
+
+BOOST_AUTO_TEST_CASE(test_ZLineReaderShortLines) {
+	// fgets never writes more than num bytes, and continues where it left off
+	char dir[] = "/tmp/test-zstuffXXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir));
+	std::string fname = std::string(dir) + "/short.gz";
+	writeGzip(fname, "0123456789\nab\n", 1);
+	ZLineReader zlr(fname, false);
+	char line[5];
+	BOOST_REQUIRE(zlr.fgets(line, sizeof(line)));
+	BOOST_CHECK_EQUAL(line, "0123");
+	BOOST_REQUIRE(zlr.fgets(line, sizeof(line)));
+	BOOST_CHECK_EQUAL(line, "4567");
+	BOOST_REQUIRE(zlr.fgets(line, sizeof(line)));
+	BOOST_CHECK_EQUAL(line, "89\n");
+	BOOST_REQUIRE(zlr.fgets(line, sizeof(line)));
+	BOOST_CHECK_EQUAL(line, "ab\n");
+	BOOST_CHECK(!zlr.fgets(line, sizeof(line)));
+	unlink(fname.c_str());
+	rmdir(dir);
+}
+
+BOOST_AUTO_TEST_CASE(test_PlainLineReader) {
+	char dir[] = "/tmp/test-zstuffXXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir));
+	std::string fname = std::string(dir) + "/plain.txt", content = makeContent();
+	FILE* fp = fopen(fname.c_str(), "w");
+	fwrite(content.c_str(), 1, content.size(), fp);
+	fclose(fp);
+	{
+		PlainLineReader plr(fname);
+		BOOST_CHECK_EQUAL(plr.uncompressedSize(), content.size());
+		std::string read;
+		char line[1024];
+		while(plr.fgets(line, sizeof(line)))
+			read += line;
+		BOOST_CHECK(read == content);
+		plr.advise(LineReader::Access::Random);
+		checkSeeks(plr, content);
+		plr.seek(content.size() - 5);
+		BOOST_CHECK(plr.buffered() == content.substr(content.size() - 5));
+		plr.consume(5);
+		BOOST_CHECK(plr.buffered().empty());
+		BOOST_CHECK(!plr.fgets(line, sizeof(line)));
+		BOOST_CHECK_THROW(plr.seek(content.size() + 1), std::runtime_error);
+	}
+	fp = fopen(fname.c_str(), "w");
+	fclose(fp);
+	{
+		PlainLineReader empty(fname);
+		char line[5];
+		BOOST_CHECK(!empty.fgets(line, sizeof(line)));
+		BOOST_CHECK(empty.buffered().empty());
+	}
+	unlink(fname.c_str());
+	// a FIFO, like <(zcat x.gz), can't be mapped, and must not read as empty
+	BOOST_REQUIRE(mkfifo(fname.c_str(), 0600) == 0);
+	BOOST_CHECK_THROW(PlainLineReader fifo(fname), std::runtime_error);
+	unlink(fname.c_str());
+	rmdir(dir);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
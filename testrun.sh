@@ -19,5 +19,23 @@ else
 	exit 1
 fi
 
+# with a fixed seed, mapping may not depend on how many threads do it
+for threads in 1 4
+do
+	rm -rf threads-$threads
+	mkdir threads-$threads
+	(cd threads-$threads && ../antonie -1 ../sbw25/P1-1-35_S5_L001_R1_001.fastq -2 ../sbw25/P1-1-35_S5_L001_R2_001.fastq -r ../sbw25/NC_012660.fna -s 1 -t $threads -w out.bam -u > log 2>&1) || exit 1
+	grep -v "^var antonieLog=" threads-$threads/data.js > threads-$threads/data.nolog.js
+done
+for f in data.nolog.js out.bam out.bam.bai unfound.fastq
+do
+	if cmp -s threads-1/$f threads-4/$f
+	then
+		echo Same $f with 1 and 4 threads
+	else
+		echo $f differs between 1 and 4 threads
+		exit 1
+	fi
+done
 
 exit 0
@@ -11,119 +11,187 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
 #include <bzlib.h>
+#include <algorithm>
+#include <vector>
 
 using namespace std;
 
-ZLineReader::ZState::ZState()
-{
-  fpos=0;
-  memset(&s, 0, sizeof(s));
-  inflateInit2(&s, 31);
+namespace {
+  struct ZIndexFileHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t span;
+    uint64_t fileSize;  //!< of the gzipped file, so we notice if it changed
+    uint64_t fileMtime;
+    uint64_t uncompressedSize;
+    uint64_t lines;
+    uint64_t count;     //!< of access points, each stored as uncPos, fpos, bits, window length and window
+  };
+  const char g_zindexMagic[8]={'A','N','T','Z','I','D','X','1'};
+  const uint32_t g_zindexVersion=1;
+  const unsigned int c_windowSize = 32768;
 }
-ZLineReader::ZState::~ZState()
+
+ZLineReader::ZLineReader(const std::string& fname, bool useIndexFile) : d_fname(fname), d_useIndexFile(useIndexFile)
 {
-  inflateEnd(&s);
+  d_fp=fopen(fname.c_str(), "rb");
+  if(!d_fp)
+    throw runtime_error("Unable to open '"+fname+"' for reading on ZLineReader: "+ string(strerror(errno)));
+  memset(&d_s, 0, sizeof(d_s));
+  if(inflateInit2(&d_s, 31) != Z_OK)
+    throw runtime_error("Unable to initialize inflate for '"+fname+"'");
+  if(!d_useIndexFile || !loadIndex())
+    d_points.push_back({0, 0, 0, string()}); // the start of the file, where we read a gzip header
+  d_have=0;
+  d_datapos=0;
+  d_uncPos=0;
+  if(!fill() && !feof(d_fp))
+    throw runtime_error("Error inflating after open of '"+fname+"'");
 }
 
-ZLineReader::ZState::ZState(const ZLineReader::ZState& orig)
+//! Makes sure d_outbuffer has data for us if there is any, inflating as much as fits so fgets() gets long spans. Returns false on EOF
+bool ZLineReader::fill()
 {
-  memset(&s, 0, sizeof(s));
-  fpos = orig.fpos;
+  if(d_have)
+    return true;
+  d_s.next_out=(Bytef*)d_outbuffer;
+  d_s.avail_out=sizeof(d_outbuffer);
+  d_datapos=0;
+  bool eof=false;
+  while(d_s.avail_out) {
+    if(!d_s.avail_in) {
+      d_s.next_in = (Bytef*)d_inbuffer;
+      d_s.avail_in = fread(d_inbuffer, 1, sizeof(d_inbuffer), d_fp);
+      if(!d_s.avail_in) {
+        eof=true;
+        break;
+      }
+    }
+    // while we don't have an index for all of the file, stop at each deflate block so we can put access points there
+    auto res = inflate(&d_s, d_complete ? Z_NO_FLUSH : Z_BLOCK);
+    if(res == Z_STREAM_END) {
+      if(!nextStream()) {
+        eof=true;
+        break;
+      }
+      continue;
+    }
+    if(res != Z_OK)
+      throw runtime_error("Error inflating '"+d_fname+"': "+ string(d_s.msg ? d_s.msg : "no error message"));
+    if(!d_complete && (d_s.data_type & 128) && !(d_s.data_type & 64))
+      addAccessPoint(d_uncPos + (d_s.next_out - (Bytef*)d_outbuffer));
+  }
+  d_have = d_s.next_out - (Bytef*)d_outbuffer;
 
-  auto res=inflateCopy(&s, (z_stream*)&orig.s);
-  if(res != Z_OK)  {
-    throw std::runtime_error("Unable to copy Z state");
-  } 
+  // we can only get here by reading on from an access point, so whatever lies beyond d_indexed is contiguous with it
+  if(!d_complete && d_uncPos + d_have > d_indexed) {
+    d_lines += count(d_outbuffer + (d_indexed - d_uncPos), d_outbuffer + d_have, '\n');
+    d_indexed = d_uncPos + d_have;
+  }
+  if(eof && !d_complete) {
+    d_complete=true;
+    if(d_useIndexFile)
+      saveIndex();
+  }
+  return d_have > 0;
 }
 
-ZLineReader::ZState& ZLineReader::ZState::operator=(const ZLineReader::ZState& orig)
+//! Remembers where we are, if we are c_span beyond the previous access point. Call only right after inflate stopped at a block boundary
+void ZLineReader::addAccessPoint(uint64_t uncPos)
 {
-  inflateEnd(&s);
-  memset(&s, 0, sizeof(s));
-  fpos = orig.fpos;
-
-  auto res=inflateCopy(&s, (z_stream*)&orig.s);
-  if(res != Z_OK)  {
-    throw std::runtime_error("Unable to copy Z state");
+  if(uncPos < d_points.back().uncPos + c_span)
+    return;
+  AccessPoint ap;
+  ap.uncPos = uncPos;
+  ap.fpos = ftell(d_fp) - d_s.avail_in;
+  ap.bits = d_s.data_type & 7;
+
+  static thread_local vector<Bytef> window(c_windowSize), packed(compressBound(c_windowSize));
+  uInt windowLen = c_windowSize;
+  if(inflateGetDictionary(&d_s, &window[0], &windowLen) != Z_OK)
+    throw runtime_error("Unable to get inflate window for '"+d_fname+"'");
+  if(windowLen) {
+    uLongf packedLen = packed.size();
+    if(compress2(&packed[0], &packedLen, &window[0], windowLen, Z_BEST_SPEED) != Z_OK)
+      throw runtime_error("Unable to compress inflate window for '"+d_fname+"'");
+    ap.window.assign((const char*)&packed[0], packedLen);
   }
-  return *this;
+  d_points.push_back(std::move(ap));
 }
 
-ZLineReader::ZLineReader(const std::string& fname)
+//! Sets up inflate to continue from ap
+void ZLineReader::restore(const AccessPoint& ap)
 {
-  d_fp=fopen(fname.c_str(), "rb");
-  if(!d_fp)
-    throw runtime_error("Unable to open '"+fname+"' for reading on ZLineReader: "+ string(strerror(errno)));
-  
-  int ret = fread(d_inbuffer, 1, sizeof(d_inbuffer), d_fp);
-  d_zs.s.avail_in=ret;
-  d_zs.s.next_in = (Bytef*)d_inbuffer;
-  //  cerr<<"Got ret "<<ret<<endl;
-  d_zs.s.next_out=(Bytef*)d_outbuffer;
-  d_zs.s.avail_out=sizeof(d_outbuffer);
+  d_have=0;
   d_datapos=0;
-  if(inflate(&d_zs.s, Z_NO_FLUSH) != Z_OK)
-    throw runtime_error("Error inflating after open: "+string(d_zs.s.msg ? d_zs.s.msg : "no error message"));
-  
-  d_have = d_zs.s.next_out - (Bytef*)d_outbuffer;
-  d_uncPos=0;
-  d_haveSeeked=0;
-}
-
-bool ZLineReader::getChar(char* c)
-{
-  if(!d_have) {
-    //    cerr<<"Nothing available.."<<endl;
-    d_zs.s.next_out=(Bytef*)d_outbuffer;
-    d_zs.s.avail_out=sizeof(d_outbuffer);
-    d_datapos=0;
-     
-    if(d_zs.s.avail_in) {
-      //      cerr<<"zlib has a bit more to chew on"<<endl;
-      auto res=inflate(&d_zs.s, Z_NO_FLUSH);
-      if(res!= Z_OK) {
-        if(res == Z_STREAM_END) {
-          if(d_zs.s.next_out == (Bytef*)d_outbuffer)
-            return false;
-        }
-        else
-          throw runtime_error("Error inflating 1: "+ string(d_zs.s.msg ? d_zs.s.msg : "no error message"));
-      }
-      d_have = d_zs.s.next_out - (Bytef*)d_outbuffer;
-    }
-    if(!d_have) {
-      //      cerr<<"Still no output, getting more input.. "<<d_zs.s.avail_in<<endl;
-      d_zs.s.next_in = (Bytef*)d_inbuffer;
-      d_zs.s.avail_in = fread(d_zs.s.next_in, 1, sizeof(d_inbuffer) - d_zs.s.avail_in, d_fp);
-      //      cerr<<"d_zs.s.avail_in: "<<d_zs.s.avail_in<<endl;
-      if(!d_zs.s.avail_in)
+  d_uncPos=ap.uncPos;
+  d_s.next_in=(Bytef*)d_inbuffer;
+  d_s.avail_in=0;
+  if(!ap.fpos) { // the very beginning
+    fseek(d_fp, 0, SEEK_SET);
+    inflateReset2(&d_s, 31);
+    d_raw=false;
+    return;
+  }
+  inflateReset2(&d_s, -15); // raw deflate, we are beyond the gzip header
+  d_raw=true;
+  if(fseek(d_fp, ap.fpos - (ap.bits ? 1 : 0), SEEK_SET) < 0)
+    throw runtime_error("Unable to seek in '"+d_fname+"': "+string(strerror(errno)));
+  if(ap.bits) {
+    int c = getc(d_fp);
+    if(c == EOF)
+      throw runtime_error("Unable to read from '"+d_fname+"' at an access point");
+    inflatePrime(&d_s, ap.bits, c >> (8 - ap.bits));
+  }
+  if(!ap.window.empty()) {
+    static thread_local vector<Bytef> window(c_windowSize);
+    uLongf windowLen = window.size();
+    if(uncompress(&window[0], &windowLen, (const Bytef*)ap.window.c_str(), ap.window.size()) != Z_OK ||
+       inflateSetDictionary(&d_s, &window[0], windowLen) != Z_OK)
+      throw runtime_error("Unable to restore inflate window for '"+d_fname+"', remove "+indexFileName()+"?");
+  }
+}
+
+/** Called when inflate reaches the end of a gzip stream. If another one follows, like in BGZF files, sets up inflate for it.
+    If we restored an access point we inflate raw deflate data, so the 8 byte gzip trailer is still ours to skip */
+bool ZLineReader::nextStream()
+{
+  for(unsigned int trailer = d_raw ? 8 : 0; ; ) {
+    if(!d_s.avail_in) {
+      d_s.next_in = (Bytef*)d_inbuffer;
+      d_s.avail_in = fread(d_inbuffer, 1, sizeof(d_inbuffer), d_fp);
+      if(!d_s.avail_in)
         return false;
-      auto res = inflate(&d_zs.s, Z_NO_FLUSH);
-      if(res == Z_STREAM_END) {
-        if(d_zs.s.next_out == (Bytef*)d_outbuffer)
-          return false;
-      }
-      else if(res != Z_OK)
-        throw runtime_error("Error inflating 2: "+ string(d_zs.s.msg ? d_zs.s.msg : "no error message"));
-      d_have = d_zs.s.next_out - (Bytef*)d_outbuffer;
     }
+    unsigned int eat = min(trailer, d_s.avail_in);
+    d_s.next_in += eat;
+    d_s.avail_in -= eat;
+    trailer -= eat;
+    if(!trailer && d_s.avail_in)
+      break;
   }
-  
-  if(c)
-    *c = d_outbuffer[d_datapos];
-  //  cerr<<"Returning: '"<<*c<<"', d_zs.s.avail_out: "<<d_have<<"\n";
-  d_datapos++;
-  d_have--;
-  d_uncPos++;
+  if(*d_s.next_in != 0x1f) // no gzip magic, trailing garbage (or zeroes) that gzip also ignores
+    return false;
+  inflateReset2(&d_s, 31);
+  d_raw=false;
   return true;
 }
 
+//! Consume len bytes of d_outbuffer
+void ZLineReader::advance(unsigned int len)
+{
+  d_datapos += len;
+  d_have -= len;
+  d_uncPos += len;
+}
+
 void ZLineReader::unget(char* line)
 {
   d_stash=line;
 }
 
-
+//! Like fgets(3): reads up to and including a newline, but no more than num-1 characters. We find the newline with memchr and copy whole spans
 char* ZLineReader::fgets(char* line, int num)
 {
   if(!d_stash.empty()) {
@@ -131,86 +199,186 @@ char* ZLineReader::fgets(char* line, int num)
     d_stash.clear();
     return line;
   }
-  if(!d_haveSeeked && (d_restarts.empty() || d_uncPos - d_restarts.rbegin()->first > 400000)) {
-    d_zs.fpos = ftell(d_fp) - d_zs.s.avail_in;
-    d_restarts[d_uncPos + d_have]=d_zs;
-  }
 
-  int i=0;
-  char c;
-  for(i=0; i<num;++i) {
-    if(!getChar(&c))
-      break;
-    *line++=c;
-    if(c=='\n')
+  char* out = line;
+  char* end = line + num - 1;
+  while(out < end && fill()) {
+    const char* begin = d_outbuffer + d_datapos;
+    unsigned int span = min((ptrdiff_t)d_have, end - out);
+    auto newline = (const char*)memchr(begin, '\n', span);
+    if(newline)
+      span = newline - begin + 1;
+    memcpy(out, begin, span);
+    out += span;
+    advance(span);
+    if(newline)
       break;
   }
-  *line=0;
+  *out=0;
 
-  return i ? line : 0;
+  return out != line ? line : 0;
 }
 
 void ZLineReader::skip(uint64_t bytes)
 {
-  for(unsigned int i = 0 ; i < bytes; ++i) {
-    if(!getChar(0)) {
+  while(bytes) {
+    if(!fill()) {
       throw runtime_error("Had EOF while seeking?!");
     }
+    unsigned int span = min((uint64_t)d_have, bytes);
+    advance(span);
+    bytes -= span;
   }
 }
 
+/** Exact once we have seen all of the file. Before that, an estimate based on how well the part we inflated so far compressed.
+    The gzip trailer has the exact size modulo 4GB, if that is close to our estimate it is the real size. It won't be for files
+    of concatenated gzip streams, like BGZF */
 uint64_t ZLineReader::uncompressedSize()
 {
-  throw runtime_error("Can't yet estimate size of compressed files, sorry");
+  if(d_complete)
+    return d_indexed;
+  struct stat buf;
+  if(fstat(fileno(d_fp), &buf) < 0) 
+    throw runtime_error("Unable to determine size of file in ZLineReader");
+  uint64_t consumed = ftell(d_fp) - d_s.avail_in;
+  if(!consumed || buf.st_size < 18)
+    return 0;
+  uint64_t estimate = 1.0 * buf.st_size * (d_uncPos + d_have) / consumed;
+
+  unsigned char trailer[4];
+  long pos = ftell(d_fp);
+  if(fseek(d_fp, -4, SEEK_END) < 0 || fread(trailer, 1, 4, d_fp) != 4 || fseek(d_fp, pos, SEEK_SET) < 0)
+    throw runtime_error("Unable to read gzip trailer in ZLineReader: "+string(strerror(errno)));
+  uint64_t isize = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint64_t)trailer[3] << 24);
+  uint64_t candidate = (estimate & ~0xffffffffULL) | isize;
+  if(candidate > estimate + (1ULL<<31))
+    candidate -= 1ULL<<32;
+  else if(candidate + (1ULL<<31) < estimate)
+    candidate += 1ULL<<32;
+  if(candidate + estimate / 4 >= estimate && candidate <= estimate + estimate / 4)
+    return candidate;
+  return estimate;
 }
 
 void ZLineReader::seek(uint64_t pos)
 {
-  d_haveSeeked=1;
-  
-  auto iter = d_restarts.lower_bound(pos);
-  if(iter == d_restarts.begin()) {
-    throw runtime_error("Found nothing for pos = "+boost::lexical_cast<string>(pos));
-  }
-  if(iter != d_restarts.begin())
-    --iter;
-  //cerr<<"Want to seek to uncompressed pos: "<<pos<<", seeking to fpos: "<<iter->second.fpos;
-  //cerr<<", giving us uncompressed pos "<<iter->first<<endl;
-
+  // the last access point at or before pos. Beyond d_indexed, we'll add more as we skip there
+  auto iter = upper_bound(d_points.begin(), d_points.end(), pos, [](uint64_t p, const AccessPoint& ap) { return p < ap.uncPos; });
+  --iter; // d_points[0] is at 0
 
-  if(pos > d_uncPos && (pos - d_uncPos) < (pos - iter->first)) {
-    //    cerr<<"Skipping, "<< (pos - d_uncPos) << " < " << (pos - iter ->first)<<endl;
+  if(pos >= d_uncPos && (pos - d_uncPos) <= (pos - iter->uncPos)) {
     skip(pos - d_uncPos);
     return;
   }
+  restore(*iter);
+  skip(pos - iter->uncPos);
+}
 
-  fseek(d_fp, iter->second.fpos, SEEK_SET);
-  d_zs = iter->second;
-  d_uncPos = iter->first;
+unsigned int ZLineReader::read(char* buf, unsigned int len)
+{
+  unsigned int got = 0;
+  while(got < len && fill()) {
+    unsigned int span = min((unsigned int)d_have, len - got);
+    memcpy(buf + got, d_outbuffer + d_datapos, span);
+    advance(span);
+    got += span;
+  }
+  return got;
+}
 
-  d_have=0;
-  d_datapos=0;
-  d_zs.s.next_in=(Bytef*)d_inbuffer;
-  d_zs.s.avail_in=0;
-  d_zs.s.next_out=(Bytef*)d_outbuffer;
-  d_zs.s.avail_out=sizeof(d_outbuffer);
-  //cerr<<"Now need to skip "<<pos - iter->first<<" bytes!"<<endl;
-  skip(pos - iter->first);
+std::string_view ZLineReader::buffered()
+{
+  if(!fill())
+    return std::string_view();
+  return std::string_view(d_outbuffer + d_datapos, d_have);
+}
+
+void ZLineReader::consume(size_t len)
+{
+  advance(len);
+}
+
+string ZLineReader::indexFileName() const
+{
+  return d_fname + ".zindex";
+}
 
+bool ZLineReader::loadIndex()
+{
+  struct stat buf;
+  if(fstat(fileno(d_fp), &buf) < 0)
+    return false;
+  unique_ptr<FILE, int(*)(FILE*)> fp(fopen(indexFileName().c_str(), "rb"), fclose);
+  if(!fp)
+    return false;
+  ZIndexFileHeader zifh;
+  if(fread(&zifh, sizeof(zifh), 1, fp.get()) != 1 || memcmp(zifh.magic, g_zindexMagic, sizeof(zifh.magic)) ||
+     zifh.version != g_zindexVersion || zifh.fileSize != (uint64_t)buf.st_size || zifh.fileMtime != (uint64_t)buf.st_mtime || !zifh.count)
+    return false;
+
+  vector<AccessPoint> points(zifh.count);
+  for(auto& ap : points) {
+    uint32_t bits, windowLen;
+    if(fread(&ap.uncPos, sizeof(ap.uncPos), 1, fp.get()) != 1 || fread(&ap.fpos, sizeof(ap.fpos), 1, fp.get()) != 1 ||
+       fread(&bits, sizeof(bits), 1, fp.get()) != 1 || fread(&windowLen, sizeof(windowLen), 1, fp.get()) != 1 || 
+       bits > 7 || windowLen > compressBound(c_windowSize) || ap.fpos > zifh.fileSize || ap.uncPos > zifh.uncompressedSize)
+      return false;
+    ap.bits = bits;
+    ap.window.resize(windowLen);
+    if(windowLen && fread(&ap.window[0], 1, windowLen, fp.get()) != windowLen)
+      return false;
+  }
+  if(points[0].uncPos || points[0].fpos)
+    return false;
+  d_points.swap(points);
+  d_indexed = zifh.uncompressedSize;
+  d_lines = zifh.lines;
+  d_complete = true;
+  return true;
+}
+
+void ZLineReader::saveIndex() const
+{
+  struct stat buf;
+  if(fstat(fileno(d_fp), &buf) < 0)
+    return;
+  ZIndexFileHeader zifh;
+  memset(&zifh, 0, sizeof(zifh));
+  memcpy(zifh.magic, g_zindexMagic, sizeof(zifh.magic));
+  zifh.version = g_zindexVersion;
+  zifh.span = c_span;
+  zifh.fileSize = buf.st_size;
+  zifh.fileMtime = buf.st_mtime;
+  zifh.uncompressedSize = d_indexed;
+  zifh.lines = d_lines;
+  zifh.count = d_points.size();
+
+  string fname = indexFileName();
+  string tmpname = fname + ".tmp" + boost::lexical_cast<string>(getpid()); // rename is atomic, so concurrent runs never see a partial index
+  FILE* fp = fopen(tmpname.c_str(), "wb");
+  if(!fp)
+    return;
+  bool ok = fwrite(&zifh, sizeof(zifh), 1, fp) == 1;
+  for(const auto& ap : d_points) {
+    uint32_t bits = ap.bits, windowLen = ap.window.size();
+    ok = ok && fwrite(&ap.uncPos, sizeof(ap.uncPos), 1, fp) == 1 && fwrite(&ap.fpos, sizeof(ap.fpos), 1, fp) == 1 &&
+      fwrite(&bits, sizeof(bits), 1, fp) == 1 && fwrite(&windowLen, sizeof(windowLen), 1, fp) == 1 &&
+      fwrite(ap.window.c_str(), 1, windowLen, fp) == windowLen;
+  }
+  if(fclose(fp) || !ok || rename(tmpname.c_str(), fname.c_str()))
+    unlink(tmpname.c_str());
 }
 
 ZLineReader::~ZLineReader()
 {
-  inflateEnd(&d_zs.s);
+  inflateEnd(&d_s);
   fclose(d_fp);
 }
 
-PlainLineReader::PlainLineReader(const std::string& fname)
+PlainLineReader::PlainLineReader(const std::string& fname) : d_mapped(fname)
 {
-  d_fp=fopen(fname.c_str(), "rb");
-  if(!d_fp)
-    throw runtime_error("Unable to open '"+fname+"' for reading on ZLineReader: "+ string(strerror(errno)));
-  
+  d_mapped.adviseSequential();
 }
 
 void PlainLineReader::unget(char* line)
@@ -218,6 +386,7 @@ void PlainLineReader::unget(char* line)
   d_stash=line;
 }
 
+//! Like fgets(3), straight from the mapping
 char* PlainLineReader::fgets(char* line, int num)
 {
   if(!d_stash.empty()) {
@@ -225,42 +394,457 @@ char* PlainLineReader::fgets(char* line, int num)
     d_stash.clear();
     return line;
   }
-
-  return ::fgets(line, num, d_fp);
+  if(d_pos >= d_mapped.size())
+    return 0;
+
+  const char* begin = d_mapped.data() + d_pos;
+  uint64_t span = min((uint64_t)num - 1, d_mapped.size() - d_pos);
+  auto newline = (const char*)memchr(begin, '\n', span);
+  if(newline)
+    span = newline - begin + 1;
+  memcpy(line, begin, span);
+  line[span] = 0;
+  d_pos += span;
+  return line;
 }
 
 void PlainLineReader::seek(uint64_t pos)
 {
-  if(fseek(d_fp, pos, SEEK_SET) < 0)
-    throw runtime_error("Seeking in plain line reader: "+string(strerror(errno)));
+  if(pos > d_mapped.size())
+    throw runtime_error("Seeking beyond the end of the file in plain line reader");
+  d_pos = pos;
 }
 
-uint64_t PlainLineReader::uncompressedSize()
+void PlainLineReader::advise(Access access)
 {
-  struct stat buf;
-  if(fstat(fileno(d_fp), &buf) < 0) 
-    throw runtime_error("Unable to determine size of file in PlainLineReader");
-  
-  return buf.st_size;
+  if(access == Access::Sequential)
+    d_mapped.adviseSequential();
+  else
+    d_mapped.adviseRandom();
+}
+
+std::string_view PlainLineReader::buffered()
+{
+  if(d_pos >= d_mapped.size())
+    return std::string_view();
+  return std::string_view(d_mapped.data() + d_pos, d_mapped.size() - d_pos);
+}
+
+
+//! Plain gzip gets inflated on a thread of its own, BGZF on workers threads
+unique_ptr<LineReader> LineReader::make(const std::string& fname, bool useIndexFile, unsigned int workers)
+{
+  if(!boost::ends_with(fname, ".gz"))
+    return unique_ptr<LineReader>(new PlainLineReader(fname));
+  if(BGZFLineReader::detect(fname))
+    return unique_ptr<LineReader>(new BGZFLineReader(fname, workers ? workers : max(1U, thread::hardware_concurrency())));
+  return unique_ptr<LineReader>(new ReadAheadLineReader(unique_ptr<ZLineReader>(new ZLineReader(fname, useIndexFile))));
 }
 
+ThreadedLineReader::~ThreadedLineReader()
+{
+  stop();
+}
 
-uint64_t PlainLineReader::getUncPos()
+void ThreadedLineReader::unget(char* line)
 {
-  return ftell(d_fp);
+  d_stash=line;
 }
 
-PlainLineReader::~PlainLineReader()
+//! Same as ZLineReader::fgets, but over our chunks
+char* ThreadedLineReader::fgets(char* line, int num)
 {
+  if(!d_stash.empty()) {
+    strncpy(line, d_stash.c_str(), num);
+    d_stash.clear();
+    return line;
+  }
+
+  char* out = line;
+  char* end = line + num - 1;
+  while(out < end) {
+    if(d_curPos == d_cur.data.size()) {
+      if(!nextChunk())
+        break;
+      continue;
+    }
+    const char* begin = d_cur.data.c_str() + d_curPos;
+    size_t span = min(d_cur.data.size() - d_curPos, (size_t)(end - out));
+    auto newline = (const char*)memchr(begin, '\n', span);
+    if(newline)
+      span = newline - begin + 1;
+    memcpy(out, begin, span);
+    out += span;
+    d_curPos += span;
+    if(newline)
+      break;
+  }
+  *out=0;
+
+  return out != line ? line : 0;
+}
+
+std::string_view ThreadedLineReader::buffered()
+{
+  while(d_curPos == d_cur.data.size())
+    if(!nextChunk())
+      return std::string_view();
+  return std::string_view(d_cur.data.c_str() + d_curPos, d_cur.data.size() - d_curPos);
+}
+
+void ThreadedLineReader::consume(size_t len)
+{
+  d_curPos += len;
+}
+
+//! Within the chunk we have, a seek is free. Otherwise we stop the threads, and fetch() from where the subclass can restart
+void ThreadedLineReader::seek(uint64_t pos)
+{
+  if(pos < d_cur.uncPos || pos > d_cur.uncPos + d_cur.data.size()) {
+    stop();
+    d_sequential = 0;
+    d_cur.data.clear();
+    d_cur.uncPos = restart(pos);
+    while(pos > d_cur.uncPos + d_cur.data.size()) {
+      if(!nextChunk())
+        throw runtime_error("Had EOF while seeking?!");
+    }
+  }
+  d_curPos = pos - d_cur.uncPos;
+}
+
+//! Makes d_cur the chunk after it, false on EOF
+bool ThreadedLineReader::nextChunk()
+{
+  if(d_threads.empty()) {
+    if(++d_sequential < c_sequential || d_random) {
+      if(!fetch(&d_cur)) {
+        d_curPos = d_cur.data.size(); // fetch() may have emptied it
+        d_linesComplete = d_linesUpTo == d_cur.uncPos + d_cur.data.size();
+        return false;
+      }
+      process(&d_cur);
+      d_curPos = 0;
+      countLines();
+      return true;
+    }
+    start();
+  }
+
+  unique_lock<mutex> lock(d_lock);
+  d_cond.wait(lock, [this]() { return d_error || d_ready.count(d_consumed) || (d_eof && d_fetched == d_consumed); });
+  if(d_error)
+    rethrow_exception(d_error);
+  auto iter = d_ready.find(d_consumed);
+  if(iter == d_ready.end()) {
+    d_linesComplete = d_linesUpTo == d_cur.uncPos + d_cur.data.size();
+    return false;
+  }
+  d_spare.push_back(std::move(d_cur));
+  d_cur = std::move(iter->second);
+  d_ready.erase(iter);
+  ++d_consumed;
+  d_cond.notify_all();
+  lock.unlock();
+
+  d_curPos = 0;
+  countLines();
+  return true;
+}
+
+//! We know the number of lines once we read all chunks in order, without gaps
+void ThreadedLineReader::countLines()
+{
+  uint64_t end = d_cur.uncPos + d_cur.data.size();
+  if(d_linesComplete || d_cur.uncPos > d_linesUpTo || end <= d_linesUpTo)
+    return;
+  d_lines += count(d_cur.data.begin() + (d_linesUpTo - d_cur.uncPos), d_cur.data.end(), '\n');
+  d_linesUpTo = end;
+}
+
+void ThreadedLineReader::start()
+{
+  d_stop = d_eof = false;
+  d_error = nullptr;
+  d_fetched = d_consumed = 0;
+  d_threads.emplace_back(&ThreadedLineReader::fetchLoop, this);
+  for(unsigned int n = 0; n < d_workers; ++n)
+    d_threads.emplace_back(&ThreadedLineReader::processLoop, this);
+}
+
+//! After this, fetch() is wherever the threads left it, so call restart() before reading on
+void ThreadedLineReader::stop()
+{
+  if(d_threads.empty())
+    return;
+  {
+    lock_guard<mutex> lock(d_lock);
+    d_stop = true;
+  }
+  d_cond.notify_all();
+  for(auto& t : d_threads)
+    t.join();
+  d_threads.clear();
+  for(auto& c : d_work)
+    d_spare.push_back(std::move(c));
+  for(auto& c : d_ready)
+    d_spare.push_back(std::move(c.second));
+  d_work.clear();
+  d_ready.clear();
+}
+
+void ThreadedLineReader::fetchLoop()
+{
+  unsigned int capacity = 2 * (d_workers + 1);
+  for(;;) {
+    Chunk chunk;
+    {
+      unique_lock<mutex> lock(d_lock);
+      d_cond.wait(lock, [this, capacity]() { return d_stop || d_fetched - d_consumed < capacity; });
+      if(d_stop)
+        return;
+      if(!d_spare.empty()) {
+        chunk = std::move(d_spare.back());
+        d_spare.pop_back();
+      }
+    }
+    bool got;
+    try {
+      got = fetch(&chunk);
+      if(got && !d_workers)
+        process(&chunk);
+    }
+    catch(...) {
+      lock_guard<mutex> lock(d_lock);
+      d_error = current_exception();
+      got = false;
+    }
+
+    lock_guard<mutex> lock(d_lock);
+    if(!got) {
+      d_eof = true;
+      d_cond.notify_all();
+      return;
+    }
+    chunk.seq = d_fetched++;
+    if(d_workers)
+      d_work.push_back(std::move(chunk));
+    else
+      d_ready.emplace(chunk.seq, std::move(chunk));
+    d_cond.notify_all();
+  }
+}
+
+void ThreadedLineReader::processLoop()
+{
+  for(;;) {
+    Chunk chunk;
+    {
+      unique_lock<mutex> lock(d_lock);
+      d_cond.wait(lock, [this]() { return d_stop || d_eof || !d_work.empty(); });
+      if(d_stop || d_work.empty())
+        return;
+      chunk = std::move(d_work.front());
+      d_work.pop_front();
+    }
+    try {
+      process(&chunk);
+    }
+    catch(...) {
+      lock_guard<mutex> lock(d_lock);
+      d_error = current_exception();
+      d_cond.notify_all();
+      return;
+    }
+    lock_guard<mutex> lock(d_lock);
+    d_ready.emplace(chunk.seq, std::move(chunk));
+    d_cond.notify_all();
+  }
+}
+
+ReadAheadLineReader::~ReadAheadLineReader()
+{
+  stop();
+}
+
+uint64_t ReadAheadLineReader::uncompressedSize()
+{
+  lock_guard<mutex> lock(d_sourceLock);
+  return d_source->uncompressedSize();
+}
+
+uint64_t ReadAheadLineReader::lineCount()
+{
+  lock_guard<mutex> lock(d_sourceLock);
+  return d_source->lineCount();
+}
+
+bool ReadAheadLineReader::fetch(Chunk* chunk)
+{
+  lock_guard<mutex> lock(d_sourceLock);
+  chunk->uncPos = d_source->getUncPos();
+  chunk->data.resize(d_chunkSize);
+  chunk->data.resize(d_source->read(&chunk->data[0], d_chunkSize));
+  d_chunkSize = min(2 * d_chunkSize, c_maxChunkSize);
+  return !chunk->data.empty();
+}
+
+uint64_t ReadAheadLineReader::restart(uint64_t pos)
+{
+  lock_guard<mutex> lock(d_sourceLock);
+  d_chunkSize = c_minChunkSize;
+  d_source->seek(pos);
+  return pos;
+}
+
+namespace {
+  uint32_t readLE32(const unsigned char* p)
+  {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  //! The compressed size of a BGZF block less one, from the 'BC' subfield of the gzip extra field. False if there is none
+  bool findBSIZE(const unsigned char* extra, unsigned int xlen, unsigned int* bsize)
+  {
+    for(unsigned int pos = 0; pos + 4 <= xlen; ) {
+      unsigned int slen = extra[pos + 2] | (extra[pos + 3] << 8);
+      if(extra[pos] == 66 && extra[pos + 1] == 67 && slen == 2 && pos + 6 <= xlen) {
+        *bsize = extra[pos + 4] | (extra[pos + 5] << 8);
+        return true;
+      }
+      pos += 4 + slen;
+    }
+    return false;
+  }
+}
+
+BGZFLineReader::BGZFLineReader(const std::string& fname, unsigned int workers) : ThreadedLineReader(workers), d_fname(fname)
+{
+  d_fp = fopen(fname.c_str(), "r");
+  if(!d_fp)
+    throw runtime_error("Unable to open file '"+fname+"': "+string(strerror(errno)));
+}
+
+BGZFLineReader::~BGZFLineReader()
+{
+  stop();
   fclose(d_fp);
 }
 
-unique_ptr<LineReader> LineReader::make(const std::string& fname)
+bool BGZFLineReader::detect(const std::string& fname)
 {
-  if(boost::ends_with(fname, ".gz"))
-    return unique_ptr<LineReader>(new ZLineReader(fname));
-  else
-    return unique_ptr<LineReader>(new PlainLineReader(fname));
+  FILE* fp = fopen(fname.c_str(), "r");
+  if(!fp)
+    return false;
+  unsigned char header[64];
+  size_t got = fread(header, 1, sizeof(header), fp);
+  fclose(fp);
+  unsigned int bsize;
+  return got >= 12 && header[0] == 0x1f && header[1] == 0x8b && header[2] == 8 && (header[3] & 4) &&
+    findBSIZE(header + 12, min(got - 12, (size_t)(header[10] | (header[11] << 8))), &bsize);
+}
+
+//! Reads the next block, but leaves inflating it to process(). Skips empty blocks, like the one bgzip ends with
+bool BGZFLineReader::fetch(Chunk* chunk)
+{
+  for(;;) {
+    unsigned char header[12];
+    size_t got = fread(header, 1, sizeof(header), d_fp);
+    if(!got) {
+      d_seenEnd = true;
+      return false;
+    }
+    if(got != sizeof(header) || header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || !(header[3] & 4))
+      throw runtime_error("No BGZF block at offset "+to_string(d_coff)+" of '"+d_fname+"'");
+    unsigned int xlen = header[10] | (header[11] << 8), bsize;
+    unsigned char extra[65536];
+    if(fread(extra, 1, xlen, d_fp) != xlen || !findBSIZE(extra, xlen, &bsize) || bsize + 1 < 12 + xlen + 8)
+      throw runtime_error("No BGZF block at offset "+to_string(d_coff)+" of '"+d_fname+"'");
+
+    unsigned int rest = bsize + 1 - 12 - xlen;
+    chunk->input.resize(rest);
+    if(fread(&chunk->input[0], 1, rest, d_fp) != rest)
+      throw runtime_error("Truncated BGZF block at offset "+to_string(d_coff)+" of '"+d_fname+"'");
+    uint32_t isize = readLE32((const unsigned char*)chunk->input.c_str() + rest - 4);
+    if(isize > 65536) // a BGZF block never holds more, and process() allocates this much
+      throw runtime_error("No BGZF block at offset "+to_string(d_coff)+" of '"+d_fname+"'");
+
+    chunk->uncPos = d_uoff;
+    if(isize && (d_blocks.empty() || d_uoff > d_blocks.back().first))
+      d_blocks.push_back({d_uoff, d_coff});
+    d_coff += bsize + 1;
+    d_uoff += isize;
+    if(d_coff > d_seenComp) {
+      d_seenComp = d_coff;
+      d_seenUnc = d_uoff;
+    }
+    if(isize)
+      return true;
+  }
+}
+
+//! Inflates a block with a z_stream of this thread, and checks its CRC
+void BGZFLineReader::process(Chunk* chunk)
+{
+  struct Inflater
+  {
+    Inflater()
+    {
+      memset(&s, 0, sizeof(s));
+      if(inflateInit2(&s, -15) != Z_OK)
+        throw runtime_error("Unable to initialize inflate");
+    }
+    ~Inflater()
+    {
+      inflateEnd(&s);
+    }
+    z_stream s;
+  };
+  static thread_local Inflater inflater;
+
+  const unsigned char* input = (const unsigned char*)chunk->input.c_str();
+  unsigned int len = chunk->input.size() - 8;
+  uint32_t crc = readLE32(input + len), isize = readLE32(input + len + 4);
+  chunk->data.resize(isize);
+
+  z_stream& s = inflater.s;
+  inflateReset(&s);
+  s.next_in = (Bytef*)input;
+  s.avail_in = len;
+  s.next_out = (Bytef*)&chunk->data[0];
+  s.avail_out = isize;
+  if(inflate(&s, Z_FINISH) != Z_STREAM_END || s.avail_out)
+    throw runtime_error("Corrupt BGZF block in '"+d_fname+"'");
+  if(crc32(0, (const Bytef*)chunk->data.c_str(), isize) != crc)
+    throw runtime_error("CRC error in BGZF block in '"+d_fname+"'");
+}
+
+//! The last block that starts at or before pos. If we have not fetched that far yet, the last block we know of
+uint64_t BGZFLineReader::restart(uint64_t pos)
+{
+  auto iter = upper_bound(d_blocks.begin(), d_blocks.end(), pos, [](uint64_t p, const pair<uint64_t, uint64_t>& b) { return p < b.first; });
+  if(iter == d_blocks.begin())
+    d_uoff = d_coff = 0;
+  else {
+    --iter;
+    d_uoff = iter->first;
+    d_coff = iter->second;
+  }
+  if(fseek(d_fp, d_coff, SEEK_SET) < 0)
+    throw runtime_error("Unable to seek in '"+d_fname+"': "+string(strerror(errno)));
+  return d_uoff;
+}
+
+//! Exact once we have seen all blocks. Before that, an estimate based on how well the blocks we saw compressed
+uint64_t BGZFLineReader::uncompressedSize()
+{
+  if(d_seenEnd)
+    return d_seenUnc;
+  struct stat buf;
+  if(fstat(fileno(d_fp), &buf) < 0)
+    throw runtime_error("Unable to determine size of file in BGZFLineReader");
+  uint64_t comp = d_seenComp;
+  return comp ? 1.0 * buf.st_size * d_seenUnc / comp : 0;
 }
 
 
@@ -311,7 +895,7 @@ uint64_t BGZFWriter::write(const char*c, unsigned int len)
   d_s.next_in = (Bytef*) c;
   d_s.avail_in = len;
 
-  char *buffer = new char[1024+len*2]; // XXX windows
+  char buffer[4096];
   do {
     d_s.next_out = (Bytef*) buffer;
     d_s.avail_out=sizeof(buffer);
@@ -325,7 +909,6 @@ uint64_t BGZFWriter::write(const char*c, unsigned int len)
     //cerr<<"Got "<<(d_s.next_out - (Bytef*)buffer)<<" bytes (end="<<(res==Z_STREAM_END)<<")"<<endl;
     d_block.append(buffer, d_s.next_out - (Bytef*)buffer);
   } while(d_s.avail_in);
-  delete[] buffer;
   d_written+=len;
   if(d_written > 65000)
     emitBlock();
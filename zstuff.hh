@@ -1,13 +1,22 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <zlib.h>
 #include <stdio.h>
 #include <map>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
 #include <stdexcept>
 #include <boost/utility.hpp>
 #include <memory>
 #include <boost/crc.hpp>
 #include <stdint.h>
+#include "misc.hh"
 
 //! Virtual base for seekable line readers
 class LineReader
@@ -20,65 +29,219 @@ public:
   virtual uint64_t getUncPos()=0;
   virtual void unget(char *line) = 0;
   virtual uint64_t uncompressedSize() = 0;
-  static std::unique_ptr<LineReader> make(const std::string& fname);
+  virtual uint64_t lineCount() //!< number of lines in the file, 0 if we don't know (yet)
+  {
+    return 0;
+  }
+  enum class Access { Sequential, Random };
+  virtual void advise(Access access) {} //!< how we'll read from now on, for readers that can use that
+
+  //! What we have in memory from getUncPos() on, empty only at EOF. Ignores unget(). Valid until the next call other than consume()
+  virtual std::string_view buffered() = 0;
+  virtual void consume(size_t len) = 0; //!< moves on len bytes, no more than buffered() returned
+  //! picks the reader for fname. useIndexFile lets readers that keep an index next to the file read and write it,
+  //! workers is how many threads may inflate BGZF blocks, 0 for one per core
+  static std::unique_ptr<LineReader> make(const std::string& fname, bool useIndexFile=true, unsigned int workers=0);
 };
 
-//! A plain text seekable line reader
+//! A plain text seekable line reader. The file is mapped, so seeks are free and buffered() is all of the rest of the file
 class PlainLineReader : public LineReader, boost::noncopyable
 {
 public:
-  PlainLineReader(const std::string& fname);
-  ~PlainLineReader();
-  //  bool getLine(std::string* str) = 0;
+  explicit PlainLineReader(const std::string& fname);
   char* fgets(char* line, int num);
   void seek(uint64_t pos);
-  uint64_t getUncPos();
+  uint64_t getUncPos()
+  {
+    return d_pos;
+  }
   void unget(char *line);
-  uint64_t uncompressedSize();
+  uint64_t uncompressedSize()
+  {
+    return d_mapped.size();
+  }
+  void advise(Access access);
+  std::string_view buffered();
+  void consume(size_t len)
+  {
+    d_pos += len;
+  }
 private:
-  FILE* d_fp;
+  MappedFile d_mapped;
+  uint64_t d_pos{0};
   std::string d_stash;
 };
 
 
-//! A gzipped compressed seekable line reader
+/** A gzipped compressed seekable line reader. The first time we inflate the file, we remember an access point every c_span
+    bytes: where a deflate block starts, plus the 32KB window inflate needs to continue from there. Once we have read all of
+    it, those points, the uncompressed size and the number of lines go to an index next to the file (name.zindex), so
+    later runs can seek right away. Files of concatenated gzip streams, like BGZF, are fine too */
 class ZLineReader : public LineReader, boost::noncopyable
 {
 public:
-  ZLineReader(const std::string& fname);
+  explicit ZLineReader(const std::string& fname, bool useIndexFile=true);
   ~ZLineReader();
-  //  bool getLine(std::string* str);
   char* fgets(char* line, int num);
   void unget(char *line);
   uint64_t getUncPos()
   {
     return d_uncPos;
   }
-  uint64_t uncompressedSize();
+  uint64_t uncompressedSize(); //!< exact once we have an index, estimated before that
+  uint64_t lineCount()
+  {
+    return d_complete ? d_lines : 0;
+  }
   void seek(uint64_t pos);
+  unsigned int read(char* buf, unsigned int len); //!< reads up to len bytes, returns how many we got, 0 on EOF
+  std::string_view buffered();
+  void consume(size_t len);
+  static const uint64_t c_span = 1 << 19; //!< uncompressed bytes between access points
 private:
-  bool getChar(char* c);
+  struct AccessPoint
+  {
+    uint64_t uncPos;    //!< where it is in the uncompressed data
+    uint64_t fpos;      //!< first whole byte of the compressed data we need
+    uint8_t bits;       //!< how many bits of the byte before fpos we need too
+    std::string window; //!< compressed, empty at the start of a gzip stream
+  };
+  bool fill();
+  void advance(unsigned int len);
   void skip(uint64_t toSkip);
+  void addAccessPoint(uint64_t uncPos);
+  void restore(const AccessPoint& ap);
+  bool nextStream();
+  std::string indexFileName() const;
+  bool loadIndex();
+  void saveIndex() const;
+
+  std::string d_fname;
   FILE* d_fp;
-  
-  struct ZState {
-    ZState();
-    ZState(const ZState& orig);
-    ~ZState();
-    ZState& operator=(const ZState& rhs);
-    uint64_t fpos;
-    z_stream s;
-  } d_zs;
+  z_stream d_s;
   int d_have;
   int d_datapos;
 
-  char d_inbuffer[4096], d_outbuffer[32768];
-  std::map<uint64_t, ZState> d_restarts;
+  char d_inbuffer[16384], d_outbuffer[32768];
+  std::vector<AccessPoint> d_points;
   uint64_t d_uncPos;
-  bool d_haveSeeked;
+  uint64_t d_indexed{0};  // we have inflated everything up to here, and have access points for it
+  uint64_t d_lines{0};    // newlines before d_indexed
+  bool d_complete{false}; // d_indexed is the end of the file
+  bool d_raw{false};      // inflating raw deflate data after restoring an access point, not a gzip stream
+  bool d_useIndexFile;
   std::string d_stash;
 };
 
+/** Line reader over uncompressed chunks that threads prepare ahead of us: subclasses say how to fetch() the next chunk, and what
+    of its decompression can be done in parallel by process(). After a seek we fetch on the calling thread, so random access 
+    (like that of BAMWriter::runQueue) doesn't pay for read-ahead it won't use. Once we read c_sequential chunks in a row, 
+    the threads take over, unless we were advised Access::Random. Subclasses must call stop() in their destructor */
+class ThreadedLineReader : public LineReader, boost::noncopyable
+{
+public:
+  ~ThreadedLineReader();
+  char* fgets(char* line, int num);
+  void unget(char *line);
+  uint64_t getUncPos()
+  {
+    return d_cur.uncPos + d_curPos;
+  }
+  void seek(uint64_t pos);
+  void advise(Access access)
+  {
+    d_random = access == Access::Random;
+  }
+  std::string_view buffered();
+  void consume(size_t len);
+  uint64_t lineCount() //!< known once we read all of the file in one go
+  {
+    return d_linesComplete ? d_lines : 0;
+  }
+  static const unsigned int c_sequential = 4;
+protected:
+  struct Chunk
+  {
+    uint64_t seq{0};
+    uint64_t uncPos{0};    //!< of the first byte of data
+    std::string input;     //!< for process()
+    std::string data;      //!< uncompressed
+  };
+  explicit ThreadedLineReader(unsigned int workers) : d_workers(workers)
+  {}
+  virtual bool fetch(Chunk* chunk) = 0;   //!< the next chunk of the file, false on EOF. Never called by two threads at once
+  virtual void process(Chunk* chunk) {}   //!< finishes what fetch() started, on any number of threads
+  virtual uint64_t restart(uint64_t pos) = 0; //!< make fetch() start at pos or before it, returns where
+  void stop();
+private:
+  bool nextChunk();
+  void countLines();
+  void start();
+  void fetchLoop();
+  void processLoop();
+
+  unsigned int d_workers; // threads running process(), with 0 the fetch thread does it
+  Chunk d_cur;
+  std::string::size_type d_curPos{0};
+  unsigned int d_sequential{0};
+  bool d_random{false}; // advised so, we don't start threads
+  uint64_t d_lines{0}, d_linesUpTo{0};
+  bool d_linesComplete{false};
+  std::string d_stash;
+
+  std::vector<std::thread> d_threads;
+  std::mutex d_lock; // protects everything below
+  std::condition_variable d_cond;
+  std::deque<Chunk> d_work;          // fetched, not yet processed
+  std::map<uint64_t, Chunk> d_ready; // by sequence number
+  std::vector<Chunk> d_spare;        // so we reuse their buffers
+  uint64_t d_fetched{0}, d_consumed{0};
+  bool d_eof{false}, d_stop{false};
+  std::exception_ptr d_error;
+};
+
+//! Plain gzip can only be inflated in order, so we do that on a thread of its own, a chunk or two ahead of the reader
+class ReadAheadLineReader : public ThreadedLineReader
+{
+public:
+  explicit ReadAheadLineReader(std::unique_ptr<ZLineReader> source) : ThreadedLineReader(0), d_source(std::move(source))
+  {}
+  ~ReadAheadLineReader();
+  uint64_t uncompressedSize();
+  uint64_t lineCount();
+  static const unsigned int c_minChunkSize = 4096, c_maxChunkSize = 1 << 18;
+protected:
+  bool fetch(Chunk* chunk);
+  uint64_t restart(uint64_t pos);
+private:
+  std::unique_ptr<ZLineReader> d_source;
+  std::mutex d_sourceLock;
+  unsigned int d_chunkSize{c_minChunkSize}; // doubles with every fetch, so a random read inflates little more than it needs
+};
+
+/** BGZF, as written by BGZFWriter and bgzip, is a series of gzip streams of at most 64KB, with their compressed size in a 'BC'
+    extra field. So we can find the next block without inflating this one, and inflate blocks on as many threads as we like. 
+    We remember where each block starts, which is all we need to seek */
+class BGZFLineReader : public ThreadedLineReader
+{
+public:
+  BGZFLineReader(const std::string& fname, unsigned int workers);
+  ~BGZFLineReader();
+  uint64_t uncompressedSize(); //!< exact once we have seen all blocks, estimated before that
+  static bool detect(const std::string& fname); //!< does fname start with a BGZF block
+protected:
+  bool fetch(Chunk* chunk);
+  void process(Chunk* chunk);
+  uint64_t restart(uint64_t pos);
+private:
+  std::string d_fname;
+  FILE* d_fp;
+  uint64_t d_coff{0}, d_uoff{0}; // compressed and uncompressed offset of the block fetch() reads next
+  std::vector<std::pair<uint64_t, uint64_t> > d_blocks; // uncompressed and compressed offset of the blocks fetch() saw, in order
+  std::atomic<uint64_t> d_seenUnc{0}, d_seenComp{0};
+  std::atomic<bool> d_seenEnd{false};
+};
+
 class BGZFWriter
 {
 public: